@@ -0,0 +1,201 @@
+"""qreki のベンチマーク
+
+C 拡張版の Kyureki と純 Python 版の _Kyureki について、
+from_date などの 1 件ずつの操作と from_ordinals などのまとめて変換する操作の
+1 件あたりの所要時間 (ナノ秒) を計る。
+
+使用例
+```
+python bench/bench_qreki.py
+python bench/bench_qreki.py --quick --json result.json
+```
+
+C 拡張版の朔日テーブルは区間ごとに初回だけ作られる。
+計測の前に 1 度ずつ実行しているので、結果は作成済みのテーブルを引く時間になる。
+"""
+import argparse
+import array
+import datetime
+import json
+import platform
+import random
+import sys
+import timeit
+
+import qreki
+from qreki.qreki import (Kyureki, _from_ordinals, _Kyureki, _to_ordinals,
+                         from_ordinals, to_ordinals)
+
+try:
+    from qreki import _qreki
+except ImportError:
+    _qreki = None
+
+# 名前: (開始, 終了)
+RANGES = {
+    'present': (datetime.date(2000, 1, 1), datetime.date(2030, 1, 1)),
+    'past': (datetime.date(500, 1, 1), datetime.date(600, 1, 1)),
+    'all': (datetime.date(1, 1, 1), datetime.date(9999, 12, 31)),
+}
+
+
+def implementations():
+    """(名前, Kyureki クラス, from_ordinals, to_ordinals) を列挙する"""
+    impls = [('python', _Kyureki, _from_ordinals, _to_ordinals)]
+    if _Kyureki is not Kyureki:
+        impls.append(('c_extension', Kyureki, from_ordinals, to_ordinals))
+    return impls
+
+
+def sample_dates(start, stop, n, seed=0):
+    """[start, stop) から n 日を選び、新暦の順に並べる"""
+    rand = random.Random(seed)
+    first, last = start.toordinal(), stop.toordinal()
+    ordinals = sorted(rand.randrange(first, last) for _ in range(n))
+    return [datetime.date.fromordinal(o) for o in ordinals]
+
+
+def measure(func, n, repeat):
+    """func を 1 度実行してから repeat 回計り、最も速い回の 1 件あたりの ns を返す"""
+    func()
+    best = min(timeit.repeat(func, number=1, repeat=repeat))
+    return best / n * 1e9
+
+
+def scalar_cases(cls, dates):
+    """1 件ずつの操作。 (操作名, 関数) を列挙する"""
+    from_date = cls.from_date
+    from_ymd = cls.from_ymd
+    ymds = [(d.year, d.month, d.day) for d in dates]
+    objs = [from_date(d) for d in dates]
+    pairs = list(zip(objs, objs[1:] + objs[:1]))
+
+    def run_from_date():
+        for d in dates:
+            from_date(d)
+
+    def run_from_ymd():
+        for y, m, d in ymds:
+            from_ymd(y, m, d)
+
+    def run_rokuyou():
+        for k in objs:
+            k.rokuyou
+
+    def run_str():
+        for k in objs:
+            str(k)
+
+    def run_hash():
+        for k in objs:
+            hash(k)
+
+    def run_compare():
+        for a, b in pairs:
+            a < b
+            a == b
+
+    return [('from_date', run_from_date),
+            ('from_ymd', run_from_ymd),
+            ('rokuyou', run_rokuyou),
+            ('__str__', run_str),
+            ('__hash__', run_hash),
+            ('compare', run_compare)]
+
+
+def bulk_cases(cls, from_ordinals_func, to_ordinals_func, start, n):
+    """まとめて変換する操作。 start から連続する n 日を扱う"""
+    stop = start + datetime.timedelta(n)
+    ordinals = array.array('i', range(start.toordinal(), stop.toordinal()))
+    columns = from_ordinals_func(ordinals)[:4]
+
+    def run_from_ordinals():
+        from_ordinals_func(ordinals)
+
+    def run_to_ordinals():
+        to_ordinals_func(*columns)
+
+    def run_range():
+        for _ in cls.range(start, stop):
+            pass
+
+    return [('from_ordinals', run_from_ordinals),
+            ('to_ordinals', run_to_ordinals),
+            ('range', run_range)]
+
+
+def run(n_python, n_c, repeat):
+    results = []
+    for impl, cls, from_ordinals_func, to_ordinals_func in implementations():
+        n = n_python if impl == 'python' else n_c
+        for range_name, (start, stop) in RANGES.items():
+            dates = sample_dates(start, stop, n)
+            for op, func in scalar_cases(cls, dates):
+                results.append({'impl': impl, 'range': range_name, 'op': op,
+                                'n': n,
+                                'ns_per_op': measure(func, n, repeat)})
+            # 連続する日付は範囲の中ほどから取る
+            middle = datetime.date.fromordinal(
+                    (start.toordinal() + stop.toordinal() - n) // 2)
+            for op, func in bulk_cases(cls, from_ordinals_func,
+                                       to_ordinals_func, middle, n):
+                results.append({'impl': impl, 'range': range_name, 'op': op,
+                                'n': n,
+                                'ns_per_op': measure(func, n, repeat)})
+    return results
+
+
+def environment():
+    env = {
+        'qreki': qreki.VERSION,
+        'python': platform.python_version(),
+        'implementation': platform.python_implementation(),
+        'machine': platform.machine(),
+        'platform': platform.platform(),
+    }
+    if _Kyureki is not Kyureki:
+        env['series_kernel'] = _qreki.series_kernel()
+        env['solver'] = _qreki.solver()
+        env['solver_precision'] = _qreki.solver_precision()
+    return env
+
+
+def print_table(results, file=sys.stdout):
+    print('{:<12} {:<8} {:<14} {:>8} {:>12}'.format(
+          'impl', 'range', 'op', 'n', 'ns/op'), file=file)
+    for r in results:
+        print('{impl:<12} {range:<8} {op:<14} {n:>8d} {ns_per_op:>12.1f}'.format(
+              **r), file=file)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--json', metavar='FILE',
+                        help='結果を JSON で FILE に書き出す。 - ならば標準出力')
+    parser.add_argument('--quick', action='store_true',
+                        help='件数と繰り返し回数を減らす')
+    parser.add_argument('--repeat', type=int, default=None)
+    args = parser.parse_args()
+
+    if args.quick:
+        n_python, n_c, repeat = 20, 2000, 3
+    else:
+        n_python, n_c, repeat = 200, 20000, 5
+    if args.repeat is not None:
+        repeat = args.repeat
+
+    results = run(n_python, n_c, repeat)
+    doc = {'environment': environment(), 'results': results}
+
+    if args.json == '-':
+        json.dump(doc, sys.stdout, ensure_ascii=False, indent=2)
+        print()
+    else:
+        print_table(results)
+        if args.json:
+            with open(args.json, 'w', encoding='utf-8') as f:
+                json.dump(doc, f, ensure_ascii=False, indent=2)
+
+
+if __name__ == '__main__':
+    main()
@@ -1,5 +1,13 @@
+import os
+
 from setuptools import Extension, setup
 
-ext_modules = [Extension('qreki._qreki', sources=['src/_qreki.c'], optional=True)]
+# QREKI_STATS=1 で _qreki.stats() の計数器を組み込む
+define_macros = []
+if os.environ.get('QREKI_STATS', '') not in ('', '0'):
+    define_macros.append(('QREKI_STATS', '1'))
+
+ext_modules = [Extension('qreki._qreki', sources=['src/_qreki.c'],
+                         define_macros=define_macros, optional=True)]
 
 setup(ext_modules=ext_modules)
@@ -2,6 +2,30 @@
 #include <Python.h>
 #include <structmember.h>
 #include <datetime.h>
+#include <pythread.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#ifdef QREKI_STATS
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#endif
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define QREKI_SIMD
+#endif
 
 typedef struct {
     PyObject_HEAD
@@ -11,48 +35,932 @@ typedef struct {
     unsigned char day;
 } KyurekiObject;
 
+/* kyureki_from_jd が作る朔日行列と、その算出に用いた二分二至 */
+typedef struct {
+    double nibun;           /* chu[0][1]: 直前の二分二至の黄経 */
+    double prev_nibun;      /* chu[0][0]: 直前の二分二至の時刻 */
+    double next_nibun;      /* chu[3][0]: 次の二分二至の時刻 */
+    int m[5][3];
+} KyurekiWindow;
+
+/* 朔日行列のキャッシュ。 [start, end) の日はすべて window で求まる */
+typedef struct {
+    double tz;
+    int start;
+    int end;
+    KyurekiWindow window;
+} WindowCacheEntry;
+
+typedef struct {
+    PyThread_type_lock lock;
+    WindowCacheEntry *entries;  /* 最近使ったものが先頭 */
+    Py_ssize_t size;
+    Py_ssize_t maxsize;
+    Py_ssize_t hits;
+    Py_ssize_t misses;
+} WindowCache;
+
+/* 朔日テーブルの 1 項目。 start 以降、次の項目の start までが同じ月 */
+typedef struct {
+    int start;              /* 区間の先頭日 (jd) */
+    unsigned char month;
+    unsigned char leap;
+    unsigned char day0;     /* start の旧暦日 - 1 。通常は 0 (朔日) */
+    unsigned char reserved;
+} MonthEntry;
+
+#define TABLE_FIRST_JD 1721425      /* date(1, 1, 1) */
+#define TABLE_LAST_JD 5373483       /* date(9999, 12, 31) */
+#define TABLE_SEGMENT_DAYS 36524
+#define TABLE_SEGMENTS 100
+
+/* entries は作り終えてから SEGMENT_PUBLISH で置く。
+ * GIL を持たない変換スレッドは SEGMENT_LOAD で読み、 NULL ならば区間がないとみなす */
+typedef struct {
+    Py_ssize_t n;
+    MonthEntry *entries;
+} TableSegment;
+
+#if defined(__GNUC__)
+#define SEGMENT_PUBLISH(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define SEGMENT_LOAD(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#elif defined(_MSC_VER)
+#define SEGMENT_PUBLISH(p, v) _InterlockedExchangePointer((void *volatile *)&(p), (v))
+#define SEGMENT_LOAD(p) \
+    ((MonthEntry *)_InterlockedCompareExchangePointer((void *volatile *)&(p), NULL, NULL))
+#else
+#define SEGMENT_PUBLISH(p, v) (*(MonthEntry *volatile *)&(p) = (v))
+#define SEGMENT_LOAD(p) (*(MonthEntry *volatile *)&(p))
+#endif
+
+typedef struct {
+    double tz;
+    int busy;               /* GIL を解放して参照している変換の数 */
+    TableSegment segments[TABLE_SEGMENTS];
+    void *map;              /* load_table で読み込んだファイル。 NULL ならば各区間を個別に確保 */
+    size_t map_size;
+} MonthTable;
+
+/* 朔日テーブルの項目の位置。区間をまたいで前後にたどる */
+typedef struct {
+    MonthTable *table;
+    int index;              /* 区間 */
+    Py_ssize_t i;           /* 区間の中の項目 */
+} TableCursor;
+
+#define TABLE_CURSOR_ENTRY(cursor) \
+    (&(cursor)->table->segments[(cursor)->index].entries[(cursor)->i])
+
+/* 2 つの項目が同じ月か。区間の境目では 1 つの月が 2 つの項目に分かれる */
+#define SAME_MONTH(a, b) \
+    ((a)->month == (b)->month && (a)->leap == (b)->leap && \
+     (a)->start - (a)->day0 == (b)->start - (b)->day0)
+
+/* dump_table / load_table のファイルの先頭。この後に全区間の MonthEntry が続く */
+#define TABLE_FILE_MAGIC "QREKITBL"
+#define TABLE_FILE_VERSION 1
+#define TABLE_FILE_BYTE_ORDER 0x01020304
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;    /* 書いた環境のバイト順 */
+    double tz;
+    int32_t first_jd;
+    int32_t segment_days;
+    int32_t segments;
+    int32_t entry_size;
+    uint32_t counts[TABLE_SEGMENTS];
+} TableFileHeader;
+
+/* 摂動項の係数表。 freq, phase, amp は SIMD 用に揃えた写し */
+typedef struct {
+    const double (*terms)[3];
+    int n;
+    int padded;
+    void *buffer;
+    double *freq;
+    double *phase;
+    double *amp;
+} SeriesTerms;
+
+typedef struct {
+    const char *name;
+    double (*sum)(const SeriesTerms *series, double t, double *rate);
+} SeriesKernel;
+
+#define SERIES_ALIGN 8
+
+/* from_ordinals の仕事を待つスレッド。 wake を解放すると task を処理して done を解放する
+ * task が NULL ならば自分の錠とこの構造体を解放して終わる */
+typedef struct {
+    PyThread_type_lock wake;
+    PyThread_type_lock done;
+    struct ConvertTask *task;
+} ConvertWorker;
+
+typedef struct {
+    PyObject *kyureki_type;
+    PyObject *range_type;
+    PyObject *array_h;      /* array('H', [0]) */
+    PyObject *array_b;      /* array('B', [0]) */
+    PyObject *array_i;      /* array('i', [0]) */
+    PyObject *array_d;      /* array('d', [0.0]) */
+    PyObject *rokuyou;      /* Kyureki.ROKUYOU 。 intern した 6 つの文字列 */
+    PyObject *rokuyou_name; /* intern した "ROKUYOU" */
+    PyObject *month_type;   /* year_calendar の要素 KyurekiMonth */
+    PyObject *array_type;   /* KyurekiArray */
+    PyObject *str_template;         /* module_exec で設定した Kyureki._str_template */
+    PyObject *str_leap_template;    /* 同じく _str_leap_template */
+    PyObject *str_template_name;        /* intern した "_str_template" */
+    PyObject *str_leap_template_name;   /* intern した "_str_leap_template" */
+    KyurekiObject *free_list;   /* 解放した Kyureki 。 ob_type で次をつなぐ */
+    Py_ssize_t free_count;
+    Py_ssize_t free_max;
+    ConvertWorker **workers;    /* 起動済みの from_ordinals のスレッド */
+    int workers_size;
+    int workers_max;
+    int workers_busy;           /* workers を使っている from_ordinals があるか */
+} qreki_state;
+
+/* Kyureki.range が返すイテレータ */
+typedef struct {
+    PyObject_HEAD
+    PyTypeObject *kyureki_type;
+    int tm0;
+    int stop;
+    double tz;
+    MonthEntry entry;       /* tm0 を含む月 */
+    int entry_end;
+    KyurekiWindow window;   /* tz が JST 以外のときに使う朔日行列 */
+    int window_end;
+} KyurekiRangeObject;
+
+/* 旧暦の列。年 ('H'), 月, 閏月, 日 ('B') を別々のバッファに持つ
+ * columns は 1 次元の読み出し専用 memoryview で、渡されたバッファをコピーせずに参照する */
+typedef struct {
+    PyObject_HEAD
+    Py_ssize_t n;
+    PyObject *columns[4];
+} KyurekiArrayObject;
+
+#define ARRAY_ITEM(self, k, type, i) \
+    (*(type *)((char *)PyMemoryView_GET_BUFFER((self)->columns[k])->buf + \
+               (i) * PyMemoryView_GET_BUFFER((self)->columns[k])->strides[0]))
+
+/* 旧暦の 1 か月。 start は月初の jd */
+typedef struct {
+    int month;
+    int leap;
+    int start;
+    int days;
+} MonthSpan;
+
+#define KYUREKI_STR_MAX 32     /* "65535年閏255月255日" の UTF-8 のバイト数より大きい */
+
+#define YEAR_MONTHS_MAX 14      /* 1 年の月の数は閏月を含めても 13 */
+
+/* find_dates の条件。それぞれ値 v を 1 << v のビットで表す */
+typedef struct {
+    unsigned long rokuyou;      /* Kyureki.ROKUYOU の添字 */
+    unsigned long day;          /* 旧暦の日 */
+    unsigned long month;        /* 旧暦の月 */
+    unsigned long leap;         /* 閏月フラグ */
+    unsigned long weekday;      /* date.weekday() */
+} DateQuery;
+
+/* moon_age で最後に使った前後の朔。 [start, end) の時刻の月齢は start からの日数 */
+typedef struct {
+    double start;
+    double end;
+} SakuSpan;
+
+/* 整数型の 1 次元バッファ */
+typedef struct {
+    Py_buffer view;
+    char format;
+} IntBuffer;
+
+/* from_ordinals の 1 スレッド分の仕事 */
+typedef struct ConvertTask {
+    const IntBuffer *input;
+    IntBuffer *output;
+    Py_ssize_t start;
+    Py_ssize_t stop;
+    double tz;
+    MonthTable *table;      /* month_table_prepare 済みのテーブル。なければ NULL */
+    int error;              /* CONVERT_OK, CONVERT_RANGE, CONVERT_SOLVER */
+    Py_ssize_t error_index;
+    PyThread_type_lock done;
+} ConvertTask;
+
+#define CONVERT_OK 0
+#define CONVERT_RANGE 1
+#define CONVERT_SOLVER 2
+#define CONVERT_MONTH 3         /* 該当する旧暦の月がない */
+#define CONVERT_DAY 4           /* 該当する旧暦の日がない */
+
+/* 年, 月, 閏月, 日の順に比較できる整数 (Kyureki.key)
+ * year << 16 | month << 8 | leap << 7 | day 。 >> 7 で月までを比べられる */
+#define KYUREKI_KEY(year, month, leap, day) \
+    (((long long)(year) << 16) | ((month) << 8) | ((leap) << 7) | (day))
+#define KYUREKI_KEY_MAX 0xFFFFFFFFLL
+#define CONVERT_MIN_CHUNK 4096  /* これより細かくはスレッドに分けない */
+#define FREE_LIST_MAX 256       /* free_list に残す Kyureki の数の既定値 */
+#define THREAD_POOL_MAX 64      /* from_ordinals のために残すスレッドの数の既定値 */
+
+#define ORDINAL_MIN 1           /* date.min.toordinal() */
+#define ORDINAL_MAX 3652059     /* date.max.toordinal() */
+
+/* stats() の計数器。 QREKI_STATS を定義してビルドしたときだけ数える
+ * *_ns は呼び出し全体の時間なので、 window_ns は saku_ns などを含む */
+#define STATS_FIELDS(X) \
+    X(before_nibun_calls) X(before_nibun_iterations) X(before_nibun_ns) \
+    X(chuki_calls) X(chuki_iterations) X(chuki_ns) \
+    X(sekki_calls) X(sekki_iterations) X(sekki_ns) \
+    X(saku_calls) X(saku_iterations) X(saku_restarts) X(saku_resolves) \
+    X(saku_failures) X(saku_ns) \
+    X(window_builds) X(window_shifts) X(window_ns) \
+    X(table_lookups) X(table_builds) X(table_ns) \
+    X(object_calls) X(object_reuses) X(object_ns) \
+    X(sun_evals) X(moon_evals) X(adaptive_stops)
+
+#ifdef QREKI_STATS
+#define STATS_MEMBER(name) long long name;
+typedef struct {
+    STATS_FIELDS(STATS_MEMBER)
+} QrekiStats;
+#undef STATS_MEMBER
+
+static QrekiStats stats_counters;
+static void
+stats_add(long long *counter, long long n);
+static long long
+stats_clock(void);
+
+#define STATS_ADD(field, n) stats_add(&stats_counters.field, (n))
+#define STATS_START(var) long long var = stats_clock()
+#define STATS_END(field, var) stats_add(&stats_counters.field, stats_clock() - (var))
+#else
+#define STATS_ADD(field, n) ((void)(n))
+#define STATS_START(var) ((void)0)
+#define STATS_END(field, var) ((void)0)
+#endif
+
 static PyObject *
-Kyureki_from_ymd(PyTypeObject *subtype, PyObject *args, PyObject *kwargs);
+Kyureki_from_ymd(PyTypeObject *subtype, PyObject *const *args, Py_ssize_t nargs,
+                 PyObject *kwnames);
 static PyObject *
-Kyureki_from_date(PyTypeObject *subtype, PyObject *args, PyObject *kwargs);
+Kyureki_from_date(PyTypeObject *subtype, PyObject *const *args, Py_ssize_t nargs,
+                  PyObject *kwnames);
+static PyObject *
+Kyureki_from_ordinal(PyTypeObject *subtype, PyObject *const *args,
+                     Py_ssize_t nargs, PyObject *kwnames);
+static PyObject *
+Kyureki_range(PyTypeObject *subtype, PyObject *args, PyObject *kwargs);
 static PyObject *
 Kyureki_rokuyou(KyurekiObject *self, PyObject *args);
 static PyObject *
+Kyureki_key(KyurekiObject *self, PyObject *args);
+static PyObject *
+Kyureki_from_key(PyTypeObject *subtype, PyObject *arg);
+static PyObject *
+Kyureki_to_ordinal(KyurekiObject *self, PyObject *const *args, Py_ssize_t nargs,
+                   PyObject *kwnames);
+static PyObject *
+Kyureki_to_date(KyurekiObject *self, PyObject *const *args, Py_ssize_t nargs,
+                PyObject *kwnames);
+static PyObject *
+Kyureki_add_days(KyurekiObject *self, PyObject *const *args, Py_ssize_t nargs,
+                 PyObject *kwnames);
+static PyObject *
+Kyureki_add_months(KyurekiObject *self, PyObject *const *args, Py_ssize_t nargs,
+                   PyObject *kwnames);
+static PyObject *
+Kyureki_add(PyObject *a, PyObject *b);
+static PyObject *
+Kyureki_subtract(PyObject *a, PyObject *b);
+static PyObject *
+kyureki_add_days(KyurekiObject *self, long long days, double tz);
+static qreki_state *
+kyureki_operand_state(PyObject *a, PyObject *b);
+static PyObject *
+kyureki_object_new(PyTypeObject *subtype, int year, int month, int leap_month,
+                   int day);
+static PyObject *
 Kyureki_new(PyTypeObject *subtype, PyObject *args, PyObject *kwargs);
+static PyObject *
+Kyureki_vectorcall(PyObject *type, PyObject *const *args, size_t nargsf,
+                   PyObject *kwnames);
 static void
 Kyureki_dealloc(KyurekiObject *self);
 static PyObject *
 Kyureki_repr(KyurekiObject *self);
 static PyObject *
 Kyureki_str(KyurekiObject *self);
+static int
+kyureki_str_unchanged(qreki_state *state, PyTypeObject *type);
+static Py_ssize_t
+kyureki_format_utf8(char *p, int year, int month, int leap_month, int day);
+static PyObject *
+qreki_format_kyureki(PyObject *module, PyObject *args, PyObject *kwargs);
 static PyObject *
 Kyureki_richcompare(KyurekiObject *self, KyurekiObject *other, int op);
 static Py_hash_t
 Kyureki_hash(KyurekiObject *self);
 
+static void
+KyurekiRange_dealloc(KyurekiRangeObject *self);
+static PyObject *
+KyurekiRange_next(KyurekiRangeObject *self);
+static int
+kyureki_range_span(KyurekiRangeObject *self);
+
+static qreki_state *
+qreki_state_from_type(PyTypeObject *type);
+static int
+date_to_ordinal(PyObject *date, long *ordinal);
+static int
+ymd_to_ordinal(int year, int month, int day, long *ordinal);
+static void
+ordinal_to_ymd(long ordinal, int *year, int *month, int *day);
+static int
+fastcall_parse(const char *fname, PyObject *const *args, Py_ssize_t nargs,
+               PyObject *kwnames, const char *const *kwlist, int required,
+               PyObject **slots);
+static int
+fastcall_tz(PyObject *obj, double *tz);
+static int
+fastcall_int(PyObject *obj, long min, long max, long *value);
+static PyObject *
+kyureki_from_ordinal(PyTypeObject *subtype, long ordinal, double tz);
+static PyObject *
+qreki_from_ordinals(PyObject *module, PyObject *args, PyObject *kwargs);
+static PyObject *
+from_ordinals_impl(qreki_state *state, PyObject *args, PyObject *kwargs);
+static PyObject *
+kyureki_array_from_columns(PyTypeObject *type, PyObject *const *columns);
+static PyObject *
+kyureki_array_column(PyObject *obj, const char *format, const char *name);
+static PyObject *
+qreki_to_ordinals(PyObject *module, PyObject *args, PyObject *kwargs);
+static PyObject *
+qreki_rokuyou_from_date(PyObject *module, PyObject *const *args, Py_ssize_t nargs,
+                        PyObject *kwnames);
+static PyObject *
+qreki_rokuyou_from_ordinal(PyObject *module, PyObject *const *args,
+                           Py_ssize_t nargs, PyObject *kwnames);
+static PyObject *
+qreki_rokuyou_from_ordinals(PyObject *module, PyObject *args, PyObject *kwargs);
+static int
+rokuyou_from_jd(int tm0, double tz, int *rokuyou);
+static PyObject *
+qreki_sekki(PyObject *module, PyObject *args, PyObject *kwargs);
+static PyObject *
+qreki_sekki_of_year(PyObject *module, PyObject *args, PyObject *kwargs);
+static PyObject *
+qreki_sekki_from_ordinals(PyObject *module, PyObject *args, PyObject *kwargs);
+static PyObject *
+sekki_between(long first, long stop, double tz);
+static PyObject *
+sekki_instant(double tm);
+static PyObject *
+qreki_moon_age(PyObject *module, PyObject *const *args, Py_ssize_t nargs,
+               PyObject *kwnames);
+static PyObject *
+qreki_moon_age_from_ordinals(PyObject *module, PyObject *args, PyObject *kwargs);
+static int
+moon_age_from_jd(double tm, double tz, SakuSpan *span, double *age);
+static PyObject *
+qreki_year_calendar(PyObject *module, PyObject *args, PyObject *kwargs);
+static int
+year_months_from_jd(int kyureki_year, double tz, MonthSpan *months, int *n);
+static int
+month_end_from_jd(int tm0, long long key, double tz, int *end);
+static int
+month_start_from_jd(int tm0, long long key, double tz, int *start);
+static PyObject *
+qreki_find_dates(PyObject *module, PyObject *args, PyObject *kwargs);
+static PyObject *
+qreki_find_ordinals(PyObject *module, PyObject *args, PyObject *kwargs);
+static int
+date_query_parse(qreki_state *state, PyObject *args, PyObject *kwargs,
+                 long *first, long *stop, double *tz, DateQuery *query);
+static int
+date_query_mask(qreki_state *state, PyObject *obj, const char *name, long min,
+                long max, unsigned long *mask);
+static int
+date_query_run(long first, long stop, double tz, const DateQuery *query,
+               int **ordinals, Py_ssize_t *n);
+static int
+date_query_days(const DateQuery *query, int month, int day, int tm0, int last,
+                int **ordinals, Py_ssize_t *n, Py_ssize_t *size);
+static unsigned long
+date_query_cycle(unsigned long values, int period, int offset);
+static PyObject *
+rokuyou_from_ordinal(PyObject *module, long ordinal, double tz);
+static PyObject *
+qreki_window_cache_info(PyObject *module, PyObject *args);
+static PyObject *
+qreki_window_cache_clear(PyObject *module, PyObject *args);
+static PyObject *
+qreki_set_window_cache_size(PyObject *module, PyObject *args);
+static PyObject *
+qreki_free_list_info(PyObject *module, PyObject *args);
+static PyObject *
+qreki_free_list_clear(PyObject *module, PyObject *args);
+static PyObject *
+qreki_set_free_list_size(PyObject *module, PyObject *args);
+static qreki_state *
+free_list_state(PyTypeObject *type);
+static void
+free_list_trim(qreki_state *state, Py_ssize_t maxsize);
+static PyObject *
+qreki_stats(PyObject *module, PyObject *args);
+static PyObject *
+qreki_reset_stats(PyObject *module, PyObject *args);
+static PyObject *
+qreki_series_kernel(PyObject *module, PyObject *args);
+static PyObject *
+qreki_solver(PyObject *module, PyObject *args);
+static PyObject *
+qreki_set_solver(PyObject *module, PyObject *args);
+static PyObject *
+qreki_solver_precision(PyObject *module, PyObject *args);
+static PyObject *
+qreki_set_solver_precision(PyObject *module, PyObject *args);
+static int
+solver_tables_reset(void);
+static PyObject *
+qreki_set_series_kernel(PyObject *module, PyObject *args);
+static void
+convert_ordinals(ConvertTask *tasks, Py_ssize_t ntasks, ConvertWorker **workers,
+                 Py_ssize_t nworkers);
+static int
+thread_pool_start(qreki_state *state, int n);
+static void
+thread_pool_trim(qreki_state *state, int maxsize);
+static void
+convert_worker_main(void *arg);
+static PyObject *
+qreki_thread_pool_info(PyObject *module, PyObject *args);
+static PyObject *
+qreki_thread_pool_clear(PyObject *module, PyObject *args);
+static PyObject *
+qreki_set_thread_pool_size(PyObject *module, PyObject *args);
+static void
+convert_task_run(ConvertTask *task);
+static void
+convert_task_thread(void *arg);
+static int
+int_buffer_get(PyObject *obj, IntBuffer *buffer, int bytes_as_int);
+static int
+int_buffer_output(qreki_state *state, PyObject **obj, IntBuffer *buffer,
+                  Py_ssize_t n, int size, const char *name);
+static int
+double_buffer_output(qreki_state *state, PyObject **obj, Py_buffer *view,
+                     Py_ssize_t n, const char *name);
+static long long
+int_buffer_load(const IntBuffer *buffer, Py_ssize_t i);
+static void
+int_buffer_store(IntBuffer *buffer, Py_ssize_t i, long long value);
+
 static double
 normalize_angle(double angle);
 static int
 kyureki_from_jd(int tm0, double tz, int *kyureki_year, int *kyureki_month,
                 int *kyureki_leap, int *kyureki_day);
+static int
+kyureki_from_jd_nogil(int tm0, double tz, const MonthTable *table,
+                      int *kyureki_year, int *kyureki_month,
+                      int *kyureki_leap, int *kyureki_day);
+static int
+kyureki_from_window(int tm0, double tz, int *kyureki_year, int *kyureki_month,
+                    int *kyureki_leap, int *kyureki_day);
+static int
+kyureki_to_jd(int kyureki_year, int kyureki_month, int kyureki_leap,
+              int kyureki_day, double tz, int *tm0);
+static int
+kyureki_to_jd_table(MonthTable *table, int kyureki_year, int kyureki_month,
+                    int kyureki_leap, int kyureki_day, int estimate, int *tm0);
+static int
+kyureki_key_from_jd(int tm0, double tz, long long *key);
+static int
+kyureki_to_ordinal(KyurekiObject *self, PyObject *const *args, Py_ssize_t nargs,
+                   PyObject *kwnames, long *ordinal);
+static void
+convert_error(int error, const char *name, long long value);
+static int
+kyureki_window_from_jd(int tm0, double tz, KyurekiWindow *window);
+static int
+kyureki_window_index(const KyurekiWindow *window, int tm0);
+static int
+kyureki_window_start(const KyurekiWindow *window, int tm0, double tz);
+static int
+kyureki_window_end(const KyurekiWindow *window, int tm0, double tz);
+static int
+window_cache_get(int tm0, double tz, KyurekiWindow *window);
+static int
+window_cache_put(int tm0, double tz, const KyurekiWindow *window);
+static int
+window_cache_resize(Py_ssize_t maxsize);
+static int
+window_cache_init(void);
+static double
+nibun_longitude_from_jd(int tm0, double tz);
+static int
+kyureki_year_from_jd(int tm0, int kyureki_month);
+static void
+chuki_from_jd(double tm, double tz, double *chuki, double *longitude,
+              int adaptive);
 static void
-chuki_from_jd(double tm, double tz, double *chuki, double *longitude);
+before_nibun_from_jd(double tm, double tz, double *nibun, double *longitude,
+                     int adaptive);
 static void
-before_nibun_from_jd(double tm, double tz, double *nibun, double *longitude);
+sekki_from_jd(double tm, double tz, double *sekki, double *longitude);
+static int
+term_from_jd_fixed(double tm, double tz, double degree,
+                   double *term, double *longitude, int adaptive);
+static int
+saku_from_jd(double tm, double tz, double *saku, int adaptive);
 static int
-saku_from_jd(double tm, double tz, double *saku);
+day_settled(double tm, double delta, double *prev_delta);
+static int
+saku_from_jd_fixed(double tm, double tz, double *saku, int adaptive);
 static double
 longitude_of_sun(double t);
 static double
 longitude_of_moon(double t);
+static double
+longitude_of_sun_with_rate(double t, double *rate);
+static double
+longitude_of_moon_with_rate(double t, double *rate);
+static int
+term_from_jd_newton(double tm, double tz, double degree,
+                    double *term, double *longitude, int adaptive);
+static int
+saku_from_jd_newton(double tm, double tz, double *saku, int adaptive);
+static void
+month_table_clear(MonthTable *table);
+static double
+series_sum_scalar(const SeriesTerms *series, double t, double *rate);
+static int
+series_kernel_supported(const char *name);
+static int
+series_init(void);
+static double *
+series_aligned_buffer(SeriesTerms *series, int n);
 static void
 jd2yearmonth(double jd, int *year, int *month);
 
+static int
+month_table_lookup(MonthTable *table, int tm0, int *kyureki_year,
+                   int *kyureki_month, int *kyureki_leap, int *kyureki_day);
+static const MonthEntry *
+month_table_find(MonthTable *table, int tm0, int *end);
+static const MonthEntry *
+month_table_peek(const MonthTable *table, int tm0, int *end);
+static const MonthEntry *
+table_cursor_find(TableCursor *cursor, MonthTable *table, int tm0);
+static const MonthEntry *
+table_cursor_step(TableCursor *cursor, int step);
+static int
+table_cursor_month_first(TableCursor *cursor);
+static int
+table_cursor_month(TableCursor *cursor, MonthSpan *span);
+static MonthTable *
+month_table_for(double tz);
+static int
+month_tables_busy(void);
+static void
+tz_tables_free(int keep);
+static PyObject *
+qreki_tz_tables_info(PyObject *module, PyObject *args);
+static PyObject *
+qreki_tz_tables_clear(PyObject *module, PyObject *args);
+static PyObject *
+qreki_set_tz_tables_size(PyObject *module, PyObject *args);
+static TableSegment *
+month_table_segment(MonthTable *table, int index);
+static int
+month_table_prepare(MonthTable *table, const IntBuffer *ordinals);
+static int
+month_table_check(const TableFileHeader *header, size_t size);
+static PyObject *
+qreki_dump_table(PyObject *module, PyObject *args, PyObject *kwargs);
+static PyObject *
+qreki_load_table(PyObject *module, PyObject *args);
+static void
+solver_error(void);
+
 static int module_exec(PyObject *module);
+static struct PyModuleDef qreki_module;
 
 static const double degToRad = Py_MATH_PI / 180.0;
 static const double jst_tz = 0.375;
 
+/* 朔日テーブルはモジュールの状態ではなくプロセスで共有する
+ * 中身は solver の設定だけで決まり、 GIL を解放した変換スレッドが
+ * ConvertTask.table から読むので、モジュールを作り直しても作り直さない */
+
+/* JST の朔日テーブル。区間 (約 100 年) ごとに必要になった時点で構築する */
+static MonthTable jst_table = {0.375};
+
+/* JST 以外の朔日テーブル。タイムゾーンごとに最初に使われたときに作り、
+ * tz_tables_max 個を超える分は window_cache で扱う */
+#define TZ_TABLES_LIMIT 32
+static MonthTable *tz_tables[TZ_TABLES_LIMIT];
+static int tz_tables_size = 0;
+static int tz_tables_max = 8;
+static int converts_running = 0;    /* GIL を解放している from_ordinals の数 */
+
+/* 摂動項の和の計算方法。 series_init で CPU に合わせて選ぶ */
+static double (*series_sum)(const SeriesTerms *series, double t, double *rate) = series_sum_scalar;
+static const char *series_kernel_name = "scalar";
+
+/* 朔、中気の求め方 */
+#define SOLVER_FIXED 0      /* 平均の角速度で補正する (QREKI.AWK と同じ) */
+#define SOLVER_NEWTON 1     /* 黄経の時間微分を使って補正する */
+static int solver = SOLVER_FIXED;
+static const char *solver_names[] = {"fixed", "newton", NULL};
+
+/* 反復の打ち切り方
+ * adaptive は推定値の誤差が日付を変えうる間だけ反復する。 kyureki_window_from_jd でだけ使う */
+#define PRECISION_EXACT 0       /* 補正量が 1 秒以下になるまで */
+#define PRECISION_ADAPTIVE 1
+#define ADAPTIVE_MARGIN (10.0 / 86400.0)    /* exact の結果との差の見込み */
+static int solver_precision = PRECISION_EXACT;
+static const char *precision_names[] = {"exact", "adaptive", NULL};
+
+/* テーブルを使わない日付のための朔日行列キャッシュ
+ * GIL を持たない変換スレッドからも引くので、モジュールの状態ではなく
+ * プロセスで 1 つとし、 window_cache_init で 1 度だけ作る */
+static WindowCache window_cache = {NULL, NULL, 0, 128, 0, 0};
+
+
+/* 摂動項の係数 (角速度, 位相, 振幅) */
+static const double sun_terms[][3] = {
+    {31557.0, 161.0, .0004},
+    {29930.0, 48.0, .0004},
+    {2281.0, 221.0, .0005},
+    {155.0, 118.0, .0005},
+    {33718.0, 316.0, .0006},
+    {9038.0, 64.0, .0007},
+    {3035.0, 110.0, .0007},
+    {65929.0, 45.0, .0007},
+    {22519.0, 352.0, .0013},
+    {45038.0, 254.0, .0015},
+    {445267.0, 208.0, .0018},
+    {19.0, 159.0, .0018},
+    {32964.0, 158.0, .0020},
+    {71998.1, 265.1, .0200},
+};
+
+static const double moon_terms[][3] = {
+    {2322131.0, 191.0, .0003},
+    {4067.0, 70.0, .0003},
+    {549197.0, 220.0, .0003},
+    {1808933.0, 58.0, .0003},
+    {349472.0, 337.0, .0003},
+    {381404.0, 354.0, .0003},
+    {958465.0, 340.0, .0003},
+    {12006.0, 187.0, .0004},
+    {39871.0, 223.0, .0004},
+    {509131.0, 242.0, .0005},
+    {1745069.0, 24.0, .0005},
+    {1908795.0, 90.0, .0005},
+    {2258267.0, 156.0, .0006},
+    {111869.0, 38.0, .0006},
+    {27864.0, 127.0, .0007},
+    {485333.0, 186.0, .0007},
+    {405201.0, 50.0, .0007},
+    {790672.0, 114.0, .0007},
+    {1403732.0, 98.0, .0008},
+    {858602.0, 129.0, .0009},
+    {1920802.0, 186.0, .0011},
+    {1267871.0, 249.0, .0012},
+    {1856938.0, 152.0, .0016},
+    {401329.0, 274.0, .0018},
+    {341337.0, 16.0, .0021},
+    {71998.0, 85.0, .0021},
+    {990397.0, 357.0, .0021},
+    {818536.0, 151.0, .0022},
+    {922466.0, 163.0, .0023},
+    {99863.0, 122.0, .0024},
+    {1379739.0, 17.0, .0026},
+    {918399.0, 182.0, .0027},
+    {1934.0, 145.0, .0028},
+    {541062.0, 259.0, .0037},
+    {1781068.0, 21.0, .0038},
+    {133.0, 29.0, .0040},
+    {1844932.0, 56.0, .0040},
+    {1331734.0, 283.0, .0040},
+    {481266.0, 205.0, .0050},
+    {31932.0, 107.0, .0052},
+    {926533.0, 323.0, .0068},
+    {449334.0, 188.0, .0079},
+    {826671.0, 111.0, .0085},
+    {1431597.0, 315.0, .0100},
+    {1303870.0, 246.0, .0107},
+    {489205.0, 142.0, .0110},
+    {1443603.0, 52.0, .0125},
+    {75870.0, 41.0, .0154},
+    {513197.9, 222.5, .0304},
+    {445267.1, 27.9, .0347},
+    {441199.8, 47.4, .0409},
+    {854535.2, 148.2, .0458},
+    {1367733.1, 280.7, .0533},
+    {377336.3, 13.2, .0571},
+    {63863.5, 124.2, .0588},
+    {966404.0, 276.5, .1144},
+    {35999.05, 87.53, .1851},
+    {954397.74, 179.93, .2136},
+    {890534.22, 145.7, .6583},
+    {413335.35, 10.74, 1.2740},
+    {477198.868, 44.963, 6.2888},
+};
+
+
+static SeriesTerms sun_series = {sun_terms, sizeof(sun_terms) / sizeof(sun_terms[0])};
+static SeriesTerms moon_series = {moon_terms, sizeof(moon_terms) / sizeof(moon_terms[0])};
+
+
+/* 摂動項の和 Σ amp * cos(freq * t + phase) を求める
+ * rate が NULL でなければ Σ amp * freq * sin(freq * t + phase) も求める */
+static double
+series_sum_scalar(const SeriesTerms *series, double t, double *rate)
+{
+    double ang, th = 0.0, dth = 0.0;
+    int i;
+
+    for (i = 0; i < series->n; i++) {
+        ang = normalize_angle(series->terms[i][0] * t + series->terms[i][1]);
+        th += series->terms[i][2] * cos(degToRad * ang);
+        if (rate) {
+            dth += series->terms[i][2] * series->terms[i][0] * sin(degToRad * ang);
+        }
+    }
+
+    if (rate) { *rate = dth; }
+    return th;
+}
+
+
+#ifdef QREKI_SIMD
+/* cos の多項式近似 (|x| <= pi/4) */
+#define COS_C0 -1.13585365213876817300E-11
+#define COS_C1 2.08757008419747316778E-9
+#define COS_C2 -2.75573141792967388112E-7
+#define COS_C3 2.48015872888517045348E-5
+#define COS_C4 -1.38888888888730564116E-3
+#define COS_C5 4.16666666666665929218E-2
+#define SIN_S0 1.58962301576546568060E-10
+#define SIN_S1 -2.50507477628578072866E-8
+#define SIN_S2 2.75573136213857245213E-6
+#define SIN_S3 -1.98412698295895385996E-4
+#define SIN_S4 8.33333333332211858878E-3
+#define SIN_S5 -1.66666666666666307295E-1
+
+/* 1.5 * 2^52 を足して引くと最も近い整数に丸められる */
+#define ROUND_MAGIC 6755399441055744.0
+
+/* width 個ずつ角度を [-45, 45] 度に落とし、多項式で cos (と sin) を求めて足し込む */
+#define SERIES_KERNEL(name, width, isa)                                       \
+typedef double name##_vd __attribute__((vector_size((width) * 8)));          \
+typedef long long name##_vl __attribute__((vector_size((width) * 8)));       \
+                                                                              \
+__attribute__((target(isa))) static double                                    \
+series_sum_##name(const SeriesTerms *series, double t, double *rate)          \
+{                                                                             \
+    name##_vd acc = {0}, dacc = {0}, freq, ang, q, x, z, c, s;                \
+    name##_vl odd, negate, y;                                                 \
+    double th = 0.0;                                                          \
+    int i, j;                                                                 \
+                                                                              \
+    for (i = 0; i < series->padded; i += (width)) {                           \
+        freq = *(const name##_vd *)&series->freq[i];                          \
+        ang = freq * t + *(const name##_vd *)&series->phase[i];               \
+        ang -= 360.0 * ((ang * (1.0 / 360.0) + ROUND_MAGIC) - ROUND_MAGIC);   \
+        q = (ang * (1.0 / 90.0) + ROUND_MAGIC) - ROUND_MAGIC;                 \
+        x = (ang - 90.0 * q) * degToRad;                                      \
+        z = x * x;                                                            \
+        c = 1.0 - 0.5 * z + z * z * (((((COS_C0 * z + COS_C1) * z + COS_C2)  \
+            * z + COS_C3) * z + COS_C4) * z + COS_C5);                        \
+        s = x + x * z * (((((SIN_S0 * z + SIN_S1) * z + SIN_S2)               \
+            * z + SIN_S3) * z + SIN_S4) * z + SIN_S5);                        \
+        /* cos(x + 90q): q=0 cos, 1 -sin, +-2 -cos, -1 sin */                 \
+        odd = (q == 1.0) | (q == -1.0);                                       \
+        negate = (q == 1.0) | (q == 2.0) | (q == -2.0);                       \
+        y = ((name##_vl)s & odd) | ((name##_vl)c & ~odd);                     \
+        y ^= negate & LLONG_MIN;                                              \
+        acc += *(const name##_vd *)&series->amp[i] * (name##_vd)y;            \
+        if (rate) {                                                           \
+            /* sin(x + 90q): q=0 sin, 1 cos, +-2 -sin, -1 -cos */             \
+            negate = (q == -1.0) | (q == 2.0) | (q == -2.0);                  \
+            y = ((name##_vl)c & odd) | ((name##_vl)s & ~odd);                 \
+            y ^= negate & LLONG_MIN;                                          \
+            dacc += *(const name##_vd *)&series->amp[i] * freq                \
+                    * (name##_vd)y;                                           \
+        }                                                                     \
+    }                                                                         \
+                                                                              \
+    for (j = 0; j < (width); j++) {                                           \
+        th += acc[j];                                                         \
+    }                                                                         \
+    if (rate) {                                                               \
+        *rate = 0.0;                                                          \
+        for (j = 0; j < (width); j++) {                                       \
+            *rate += dacc[j];                                                 \
+        }                                                                     \
+    }                                                                         \
+    return th;                                                                \
+}
+
+SERIES_KERNEL(sse2, 2, "sse2")
+SERIES_KERNEL(avx2, 4, "avx2,fma")
+SERIES_KERNEL(avx512, 8, "avx512f")
+#endif
+
+
+static const SeriesKernel series_kernels[] = {
+    {"scalar", series_sum_scalar},
+#ifdef QREKI_SIMD
+    {"sse2", series_sum_sse2},
+    {"avx2", series_sum_avx2},
+    {"avx512", series_sum_avx512},
+#endif
+    {NULL, NULL}
+};
+
+
+static int
+series_kernel_supported(const char *name)
+{
+    if (strcmp(name, "scalar") == 0) { return 1; }
+#ifdef QREKI_SIMD
+    __builtin_cpu_init();
+    if (strcmp(name, "sse2") == 0) { return 1; }
+    if (strcmp(name, "avx2") == 0) {
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    }
+    if (strcmp(name, "avx512") == 0) { return __builtin_cpu_supports("avx512f"); }
+#endif
+    return 0;
+}
+
+
+/* 係数表を SIMD 用に揃えて並べ、 CPU に合った計算方法を選ぶ */
+static int
+series_init(void)
+{
+    SeriesTerms *all[2] = {&sun_series, &moon_series};
+    SeriesTerms *series;
+    const SeriesKernel *kernel;
+    int i, k;
+
+    for (k = 0; k < 2; k++) {
+        series = all[k];
+        if (series->freq) { continue; }
+        series->padded = (series->n + SERIES_ALIGN - 1) / SERIES_ALIGN * SERIES_ALIGN;
+        series->freq = series_aligned_buffer(series, 3 * series->padded);
+        if (!series->freq) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        series->phase = series->freq + series->padded;
+        series->amp = series->phase + series->padded;
+        for (i = 0; i < series->padded; i++) {
+            series->freq[i] = i < series->n ? series->terms[i][0] : 0.0;
+            series->phase[i] = i < series->n ? series->terms[i][1] : 0.0;
+            series->amp[i] = i < series->n ? series->terms[i][2] : 0.0;
+        }
+    }
+
+    for (kernel = series_kernels; kernel->name; kernel++) {
+        if (series_kernel_supported(kernel->name)) {
+            series_sum = kernel->sum;
+            series_kernel_name = kernel->name;
+        }
+    }
+
+    return 0;
+}
+
+
+/* SERIES_ALIGN 個の double 境界に揃えた領域を確保する */
+static double *
+series_aligned_buffer(SeriesTerms *series, int n)
+{
+    uintptr_t p;
+
+    series->buffer = PyMem_RawMalloc((n + SERIES_ALIGN) * sizeof(double));
+    if (!series->buffer) { return NULL; }
+    p = (uintptr_t)series->buffer;
+    p = (p + SERIES_ALIGN * sizeof(double) - 1) & ~(uintptr_t)(SERIES_ALIGN * sizeof(double) - 1);
+
+    return (double *)p;
+}
+
 
 static PyMemberDef Kyureki_members[] = {
     {"year", T_USHORT, offsetof(KyurekiObject, year), READONLY, NULL},
@@ -64,92 +972,444 @@ static PyMemberDef Kyureki_members[] = {
 
 
 static PyObject *
-Kyureki_from_ymd(PyTypeObject *subtype, PyObject *args, PyObject *kwargs)
+Kyureki_from_ymd(PyTypeObject *subtype, PyObject *const *args, Py_ssize_t nargs,
+                 PyObject *kwnames)
 {
-    int year, month, day;
-    PyObject *tz = NULL;
-    PyObject *date, *from_date_args;
-    PyObject *self;
+    static const char *const kwlist[] = {"year", "month", "day", "tz", NULL};
+    PyObject *slots[4];
+    long year, month, day, ordinal;
+    double tz = jst_tz;
 
-    static char *kwlist[] = {"year", "month", "day", "tz", NULL};
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "iii|O", kwlist,
-                                     &year, &month, &day, &tz)) { return NULL; }
+    if (fastcall_parse("from_ymd", args, nargs, kwnames, kwlist, 3, slots) ||
+            fastcall_int(slots[0], INT_MIN, INT_MAX, &year) ||
+            fastcall_int(slots[1], INT_MIN, INT_MAX, &month) ||
+            fastcall_int(slots[2], INT_MIN, INT_MAX, &day) ||
+            fastcall_tz(slots[3], &tz)) { return NULL; }
 
-    date = PyDate_FromDate(year, month, day);
-    if (!date) { return NULL; }
-    if (tz == NULL) {
-        from_date_args = PyTuple_Pack(1, date);
-    } else {
-        from_date_args = PyTuple_Pack(2, date, tz);
-    }
-    Py_DECREF(date);
-    if (!from_date_args) { return NULL; }
+    if (ymd_to_ordinal(year, month, day, &ordinal)) { return NULL; }
 
-    self = Kyureki_from_date(subtype, from_date_args, NULL);
-    Py_DECREF(from_date_args);
-    return self;
+    return kyureki_from_ordinal(subtype, ordinal, tz);
 }
 
 
 static PyObject *
-Kyureki_from_date(PyTypeObject *subtype, PyObject *args, PyObject *kwargs)
+Kyureki_from_date(PyTypeObject *subtype, PyObject *const *args, Py_ssize_t nargs,
+                  PyObject *kwnames)
 {
-    PyObject *t, *ret;
-    static char *kwlist[] = {"date", "tz", NULL};
-    PyObject *date;
-    long ordinal, tm0;
+    static const char *const kwlist[] = {"date", "tz", NULL};
+    PyObject *slots[2];
+    long ordinal;
     double tz = jst_tz;
-    PyObject *ordinal_obj;
-    int kyureki_year, kyureki_month, kyureki_leap, kyureki_day, error;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|d", kwlist, &date, &tz)) {
+    if (fastcall_parse("from_date", args, nargs, kwnames, kwlist, 1, slots) ||
+            fastcall_tz(slots[1], &tz)) { return NULL; }
+
+    if (date_to_ordinal(slots[0], &ordinal)) { return NULL; }
+
+    return kyureki_from_ordinal(subtype, ordinal, tz);
+}
+
+
+static PyObject *
+Kyureki_from_ordinal(PyTypeObject *subtype, PyObject *const *args,
+                     Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"ordinal", "tz", NULL};
+    PyObject *slots[2];
+    long ordinal;
+    double tz = jst_tz;
+
+    if (fastcall_parse("from_ordinal", args, nargs, kwnames, kwlist, 1, slots) ||
+            fastcall_int(slots[0], LONG_MIN, LONG_MAX, &ordinal) ||
+            fastcall_tz(slots[1], &tz)) { return NULL; }
+
+    return kyureki_from_ordinal(subtype, ordinal, tz);
+}
+
+
+static PyObject *
+kyureki_from_ordinal(PyTypeObject *subtype, long ordinal, double tz)
+{
+    int kyureki_year, kyureki_month, kyureki_leap, kyureki_day;
+
+    if (ordinal < ORDINAL_MIN || ordinal > ORDINAL_MAX) {
+        convert_error(CONVERT_RANGE, "ordinal", ordinal);
         return NULL;
     }
 
-    if ((ordinal_obj = PyObject_CallMethod(date, "toordinal", NULL)) == NULL) {
+    if (kyureki_from_jd((int)ordinal + 1721424, tz, &kyureki_year,
+                        &kyureki_month, &kyureki_leap, &kyureki_day)) {
+        solver_error();
         return NULL;
     }
-    ordinal = PyLong_AsLong(ordinal_obj);
-    Py_DECREF(ordinal_obj);
-    if (PyErr_Occurred()) { return NULL; }
 
-    tm0 = ordinal + 1721424;
+    return kyureki_object_new(subtype, kyureki_year, kyureki_month,
+                              kyureki_leap, kyureki_day);
+}
+
 
-    error = kyureki_from_jd(tm0, tz, &kyureki_year, &kyureki_month,
-                            &kyureki_leap, &kyureki_day);
-    if (error) { return NULL; }
+static PyObject *
+Kyureki_range(PyTypeObject *subtype, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"start", "stop", "tz", NULL};
+    PyObject *start, *stop;
+    long start_ordinal, stop_ordinal;
+    double tz = jst_tz;
+    qreki_state *state;
+    KyurekiRangeObject *it;
 
-    t = Py_BuildValue("hbbb", kyureki_year, kyureki_month, kyureki_leap,
-                      kyureki_day);
-    if (!t) { return NULL; }
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|d", kwlist,
+                                     &start, &stop, &tz)) { return NULL; }
 
-    ret = Kyureki_new(subtype, t, NULL);
-    Py_DECREF(t);
-    return ret;
+    if (date_to_ordinal(start, &start_ordinal)) { return NULL; }
+    if (date_to_ordinal(stop, &stop_ordinal)) { return NULL; }
+
+    state = qreki_state_from_type(subtype);
+    if (!state) { return NULL; }
+
+    it = PyObject_New(KyurekiRangeObject, (PyTypeObject *)state->range_type);
+    if (!it) { return NULL; }
+    Py_INCREF(subtype);
+    it->kyureki_type = subtype;
+    it->tm0 = (int)start_ordinal + 1721424;
+    it->stop = (int)stop_ordinal + 1721424;
+    it->tz = tz;
+    it->entry_end = it->tm0;
+    it->window_end = it->tm0;
+
+    return (PyObject *)it;
 }
 
 
+/* Kyureki そのものは module_exec で作った文字列を返す
+ * ROKUYOU を差し替えた型やサブクラスのときだけ属性を引く */
 static PyObject *
 Kyureki_rokuyou(KyurekiObject *self, PyObject *args)
 {
+    qreki_state *state = free_list_state(Py_TYPE(self));
     PyObject *rokuyou_tuple, *rokuyou;
+    int index = (self->month + self->day) % 6;
+
+    if (state) {
+        rokuyou_tuple = PyDict_GetItemWithError(Py_TYPE(self)->tp_dict,
+                                                state->rokuyou_name);
+        if (rokuyou_tuple == state->rokuyou) {
+            rokuyou = PyTuple_GET_ITEM(state->rokuyou, index);
+            Py_INCREF(rokuyou);
+            return rokuyou;
+        }
+        if (!rokuyou_tuple && PyErr_Occurred()) { return NULL; }
+    }
+
     rokuyou_tuple = PyObject_GetAttrString((PyObject *)self, "ROKUYOU");
     if (!rokuyou_tuple) { return NULL; }
-    rokuyou = PySequence_GetItem(rokuyou_tuple, (self->month + self->day) % 6);
+    if (PyTuple_CheckExact(rokuyou_tuple) && PyTuple_GET_SIZE(rokuyou_tuple) == 6) {
+        rokuyou = PyTuple_GET_ITEM(rokuyou_tuple, index);
+        Py_INCREF(rokuyou);
+    } else {
+        rokuyou = PySequence_GetItem(rokuyou_tuple, index);
+    }
     Py_DECREF(rokuyou_tuple);
     return rokuyou;
 }
 
 
+static PyObject *
+Kyureki_to_ordinal(KyurekiObject *self, PyObject *const *args, Py_ssize_t nargs,
+                   PyObject *kwnames)
+{
+    long ordinal;
+
+    if (kyureki_to_ordinal(self, args, nargs, kwnames, &ordinal)) { return NULL; }
+
+    return PyLong_FromLong(ordinal);
+}
+
+
+static PyObject *
+Kyureki_to_date(KyurekiObject *self, PyObject *const *args, Py_ssize_t nargs,
+                PyObject *kwnames)
+{
+    long ordinal;
+    int y, m, d;
+
+    if (kyureki_to_ordinal(self, args, nargs, kwnames, &ordinal)) { return NULL; }
+
+    ordinal_to_ymd(ordinal, &y, &m, &d);
+    return PyDate_FromDate(y, m, d);
+}
+
+
+static int
+kyureki_to_ordinal(KyurekiObject *self, PyObject *const *args, Py_ssize_t nargs,
+                   PyObject *kwnames, long *ordinal)
+{
+    static const char *const kwlist[] = {"tz", NULL};
+    PyObject *slots[1];
+    double tz = jst_tz;
+    int tm0, error;
+
+    if (fastcall_parse("to_ordinal", args, nargs, kwnames, kwlist, 0, slots) ||
+            fastcall_tz(slots[0], &tz)) { return -1; }
+
+    error = kyureki_to_jd(self->year, self->month, self->leap_month, self->day,
+                          tz, &tm0);
+    if (error) {
+        convert_error(error, NULL, 0);
+        return -1;
+    }
+
+    *ordinal = tm0 - 1721424;
+    return 0;
+}
+
+
+static PyObject *
+Kyureki_add_days(KyurekiObject *self, PyObject *const *args, Py_ssize_t nargs,
+                 PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"days", "tz", NULL};
+    PyObject *slots[2];
+    double tz = jst_tz;
+    long long days;
+
+    if (fastcall_parse("add_days", args, nargs, kwnames, kwlist, 1, slots) ||
+            fastcall_tz(slots[1], &tz)) { return NULL; }
+    days = PyLong_AsLongLong(slots[0]);
+    if (days == -1 && PyErr_Occurred()) { return NULL; }
+
+    return kyureki_add_days(self, days, tz);
+}
+
+
+/* 新暦で days 日後の旧暦。月の境目は朔日テーブルで引くので、朔を解き直さない */
+static PyObject *
+kyureki_add_days(KyurekiObject *self, long long days, double tz)
+{
+    int tm0, error;
+
+    error = kyureki_to_jd(self->year, self->month, self->leap_month, self->day,
+                          tz, &tm0);
+    if (error) {
+        convert_error(error, NULL, 0);
+        return NULL;
+    }
+    if (days < -ORDINAL_MAX || days > ORDINAL_MAX) {
+        convert_error(CONVERT_RANGE, NULL, 0);
+        return NULL;
+    }
+    days += tm0 - 1721424;
+    if (days < ORDINAL_MIN || days > ORDINAL_MAX) {
+        convert_error(CONVERT_RANGE, NULL, 0);
+        return NULL;
+    }
+
+    return kyureki_from_ordinal(Py_TYPE(self), (long)days, tz);
+}
+
+
+/* months か月後の同じ日。閏月も 1 か月と数え、その月にない日 (小の月の 30 日) は月末にする
+ * 朔日テーブルを引けるときは、その月の項目から項目を順にたどって月初を求める */
+static PyObject *
+Kyureki_add_months(KyurekiObject *self, PyObject *const *args, Py_ssize_t nargs,
+                   PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"months", "tz", NULL};
+    PyObject *slots[2];
+    double tz = jst_tz;
+    long months;
+    long long key;
+    int tm0, start, end, day, error;
+    MonthTable *table;
+    TableCursor cursor;
+    MonthSpan span;
+
+    if (fastcall_parse("add_months", args, nargs, kwnames, kwlist, 1, slots) ||
+            fastcall_int(slots[0], LONG_MIN, LONG_MAX, &months) ||
+            fastcall_tz(slots[1], &tz)) { return NULL; }
+
+    error = kyureki_to_jd(self->year, self->month, self->leap_month, self->day,
+                          tz, &tm0);
+    if (error) { goto error; }
+    /* 1 万年でおよそ 12 万 4 千か月 */
+    if (months < -130000 || months > 130000) {
+        error = CONVERT_RANGE;
+        goto error;
+    }
+
+    if ((table = month_table_for(tz))) {
+        if (!table_cursor_find(&cursor, table, tm0)) {
+            error = CONVERT_SOLVER;
+            goto error;
+        }
+        if ((error = table_cursor_month_first(&cursor))) { goto error; }
+        for (; months > 0; months--) {
+            if ((error = table_cursor_month(&cursor, &span))) { goto error; }
+        }
+        for (; months < 0; months++) {
+            if (!table_cursor_step(&cursor, -1)) {
+                error = PyErr_Occurred() ? CONVERT_SOLVER : CONVERT_RANGE;
+                goto error;
+            }
+            if ((error = table_cursor_month_first(&cursor))) { goto error; }
+        }
+        if ((error = table_cursor_month(&cursor, &span))) { goto error; }
+        start = span.start;
+        end = span.start + span.days;
+    } else {
+        /* テーブルのない tz は 1 日ずつ旧暦を引いて月の境目を探す */
+        key = KYUREKI_KEY(self->year, self->month, self->leap_month, self->day);
+        if ((error = month_start_from_jd(tm0, key, tz, &start)) ||
+                (error = kyureki_key_from_jd(start, tz, &key))) { goto error; }
+        for (; months > 0; months--) {
+            if ((error = month_end_from_jd(start, key, tz, &start)) ||
+                    (error = kyureki_key_from_jd(start, tz, &key))) { goto error; }
+        }
+        for (; months < 0; months++) {
+            if (start - 1 < TABLE_FIRST_JD) {
+                error = CONVERT_RANGE;
+                goto error;
+            }
+            if ((error = kyureki_key_from_jd(start - 1, tz, &key)) ||
+                    (error = month_start_from_jd(start - 1, key, tz, &start)) ||
+                    (error = kyureki_key_from_jd(start, tz, &key))) { goto error; }
+        }
+        if ((error = month_end_from_jd(start, key, tz, &end))) { goto error; }
+    }
+
+    day = self->day < end - start ? self->day : end - start;
+    if (day < 1) { day = 1; }
+    return kyureki_from_ordinal(Py_TYPE(self), start + day - 1 - 1721424, tz);
+error:
+    convert_error(error, NULL, 0);
+    return NULL;
+}
+
+
+/* 日数として足し引きできる整数か。 bool は除く */
+#define DAYS_CHECK(obj) (PyLong_Check(obj) && !PyBool_Check(obj))
+
+
+/* 演算の a, b のうち Kyureki (かそのサブクラス) の方からモジュールの状態を得る */
+static qreki_state *
+kyureki_operand_state(PyObject *a, PyObject *b)
+{
+    qreki_state *state;
+
+    if ((state = free_list_state(Py_TYPE(a))) ||
+            (state = free_list_state(Py_TYPE(b)))) { return state; }
+    state = qreki_state_from_type(Py_TYPE(a));
+    if (!state) {
+        PyErr_Clear();
+        state = qreki_state_from_type(Py_TYPE(b));
+    }
+    return state;
+}
+
+
+/* Kyureki + int, int + Kyureki 。 JST の日数で進める */
+static PyObject *
+Kyureki_add(PyObject *a, PyObject *b)
+{
+    qreki_state *state = kyureki_operand_state(a, b);
+    PyTypeObject *type;
+    long long days;
+
+    if (!state) { return NULL; }
+    type = (PyTypeObject *)state->kyureki_type;
+    if (DAYS_CHECK(a) && PyObject_TypeCheck(b, type)) {
+        PyObject *tmp = a;
+        a = b;
+        b = tmp;
+    }
+    if (!PyObject_TypeCheck(a, type) || !DAYS_CHECK(b)) { Py_RETURN_NOTIMPLEMENTED; }
+
+    days = PyLong_AsLongLong(b);
+    if (days == -1 && PyErr_Occurred()) { return NULL; }
+    return kyureki_add_days((KyurekiObject *)a, days, jst_tz);
+}
+
+
+/* Kyureki - int は日数を戻し、 Kyureki - Kyureki は JST の日数の差 */
+static PyObject *
+Kyureki_subtract(PyObject *a, PyObject *b)
+{
+    KyurekiObject *self = (KyurekiObject *)a, *other = (KyurekiObject *)b;
+    qreki_state *state = kyureki_operand_state(a, b);
+    long long days;
+    int tm0, tm1, error;
+
+    if (!state) { return NULL; }
+    if (!PyObject_TypeCheck(a, (PyTypeObject *)state->kyureki_type) ||
+            PyBool_Check(b)) { Py_RETURN_NOTIMPLEMENTED; }
+
+    if (PyLong_Check(b)) {
+        days = PyLong_AsLongLong(b);
+        if (days == -1 && PyErr_Occurred()) { return NULL; }
+        if (days == LLONG_MIN) {
+            convert_error(CONVERT_RANGE, NULL, 0);
+            return NULL;
+        }
+        return kyureki_add_days(self, -days, jst_tz);
+    }
+
+    if (Py_TYPE(b) != Py_TYPE(a) && !PyObject_TypeCheck(b, Py_TYPE(a))) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+    if ((error = kyureki_to_jd(self->year, self->month, self->leap_month,
+                               self->day, jst_tz, &tm0)) ||
+            (error = kyureki_to_jd(other->year, other->month, other->leap_month,
+                                   other->day, jst_tz, &tm1))) {
+        convert_error(error, NULL, 0);
+        return NULL;
+    }
+
+    return PyLong_FromLong(tm0 - tm1);
+}
+
+
+static PyObject *
+Kyureki_key(KyurekiObject *self, PyObject *args)
+{
+    return PyLong_FromLongLong(KYUREKI_KEY(self->year, self->month,
+                                           self->leap_month, self->day));
+}
+
+
+static PyObject *
+Kyureki_from_key(PyTypeObject *subtype, PyObject *arg)
+{
+    long long key;
+
+    key = PyLong_AsLongLong(arg);
+    if (key == -1 && PyErr_Occurred()) { return NULL; }
+    if (key < 0 || key > KYUREKI_KEY_MAX) {
+        PyErr_Format(PyExc_ValueError, "key %lld is out of range", key);
+        return NULL;
+    }
+
+    return kyureki_object_new(subtype, (int)(key >> 16), (int)(key >> 8) & 0xFF,
+                              (int)(key >> 7) & 1, (int)key & 0x7F);
+}
+
+
 static PyMethodDef Kyureki_methods[] = {
-    {"from_ymd", (PyCFunction)Kyureki_from_ymd, METH_VARARGS|METH_KEYWORDS|METH_CLASS, NULL},
-    {"from_date", (PyCFunction)Kyureki_from_date, METH_VARARGS|METH_KEYWORDS|METH_CLASS, NULL},
+    {"from_ymd", (PyCFunction)(void (*)(void))Kyureki_from_ymd, METH_FASTCALL|METH_KEYWORDS|METH_CLASS, NULL},
+    {"from_date", (PyCFunction)(void (*)(void))Kyureki_from_date, METH_FASTCALL|METH_KEYWORDS|METH_CLASS, NULL},
+    {"from_ordinal", (PyCFunction)(void (*)(void))Kyureki_from_ordinal, METH_FASTCALL|METH_KEYWORDS|METH_CLASS, NULL},
+    {"from_key", (PyCFunction)Kyureki_from_key, METH_O|METH_CLASS, NULL},
+    {"range", (PyCFunction)Kyureki_range, METH_VARARGS|METH_KEYWORDS|METH_CLASS, NULL},
+    {"to_ordinal", (PyCFunction)(void (*)(void))Kyureki_to_ordinal, METH_FASTCALL|METH_KEYWORDS, NULL},
+    {"to_date", (PyCFunction)(void (*)(void))Kyureki_to_date, METH_FASTCALL|METH_KEYWORDS, NULL},
+    {"add_days", (PyCFunction)(void (*)(void))Kyureki_add_days, METH_FASTCALL|METH_KEYWORDS, NULL},
+    {"add_months", (PyCFunction)(void (*)(void))Kyureki_add_months, METH_FASTCALL|METH_KEYWORDS, NULL},
     {NULL, NULL, 0, NULL} /* Sentinel */
 };
 
 
 static PyGetSetDef Kyureki_getset[] = {
     {"rokuyou", (getter)Kyureki_rokuyou, NULL, NULL, NULL},
+    {"key", (getter)Kyureki_key, NULL, NULL, NULL},
     {NULL} /* Sentinel */
 };
 
@@ -157,20 +1417,82 @@ static PyGetSetDef Kyureki_getset[] = {
 static PyObject *
 Kyureki_new(PyTypeObject *subtype, PyObject *args, PyObject *kwargs)
 {
-    KyurekiObject *self;
-    unsigned short year;
-    unsigned char month, leap_month, day;
+    int year, month, leap_month, day;
     static char *kwlist[] = {"year", "month", "leap_month", "day", NULL};
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "hbbb", kwlist,
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "iiii", kwlist,
                                      &year, &month, &leap_month, &day)) { return NULL; }
 
-    self = PyObject_New(KyurekiObject, subtype);
+    return kyureki_object_new(subtype, year, month, leap_month, day);
+}
+
+
+/* Kyureki(year, month, leap_month, day) の呼び出し。引数のタプルを作らない */
+static PyObject *
+Kyureki_vectorcall(PyObject *type, PyObject *const *args, size_t nargsf,
+                   PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"year", "month", "leap_month", "day", NULL};
+    PyObject *slots[4];
+    long year, month, leap_month, day;
+
+    if (fastcall_parse("Kyureki", args, PyVectorcall_NARGS(nargsf), kwnames,
+                       kwlist, 4, slots) ||
+            fastcall_int(slots[0], INT_MIN, INT_MAX, &year) ||
+            fastcall_int(slots[1], INT_MIN, INT_MAX, &month) ||
+            fastcall_int(slots[2], INT_MIN, INT_MAX, &leap_month) ||
+            fastcall_int(slots[3], INT_MIN, INT_MAX, &day)) { return NULL; }
+
+    return kyureki_object_new((PyTypeObject *)type, year, month, leap_month, day);
+}
+
+
+static PyObject *
+kyureki_object_new(PyTypeObject *subtype, int year, int month, int leap_month,
+                   int day)
+{
+    KyurekiObject *self;
+    qreki_state *state;
+
+    /* key に詰められない値は受け付けない。純 Python 版と同じ範囲 */
+    if (year < 0 || year > 0xFFFF) {
+        PyErr_SetString(PyExc_ValueError, "year must be in 0..65535");
+        return NULL;
+    }
+    if (month < 0 || month > 0xFF) {
+        PyErr_SetString(PyExc_ValueError, "month must be in 0..255");
+        return NULL;
+    }
+    if (leap_month < 0 || leap_month > 1) {
+        PyErr_SetString(PyExc_ValueError, "leap_month must be 0 or 1");
+        return NULL;
+    }
+    if (day < 0 || day > 127) {
+        PyErr_SetString(PyExc_ValueError, "day must be in 0..127");
+        return NULL;
+    }
+
+    STATS_START(start);
+    state = free_list_state(subtype);
+    if (state && state->free_list) {
+        self = state->free_list;
+        state->free_list = (KyurekiObject *)Py_TYPE(self);
+        state->free_count--;
+        PyObject_Init((PyObject *)self, subtype);
+        STATS_ADD(object_reuses, 1);
+    } else if (state) {
+        self = PyObject_New(KyurekiObject, subtype);
+    } else {
+        /* サブクラスは __dict__ や GC を持ちうる */
+        self = (KyurekiObject *)subtype->tp_alloc(subtype, 0);
+    }
     if (!self) { return NULL; }
-    self->year = year;
-    self->month = month;
-    self->leap_month = leap_month;
-    self->day = day;
+    self->year = (unsigned short)year;
+    self->month = (unsigned char)month;
+    self->leap_month = (unsigned char)leap_month;
+    self->day = (unsigned char)day;
 
+    STATS_ADD(object_calls, 1);
+    STATS_END(object_ns, start);
     return (PyObject *)self;
 }
 
@@ -178,15 +1500,34 @@ Kyureki_new(PyTypeObject *subtype, PyObject *args, PyObject *kwargs)
 static void
 Kyureki_dealloc(KyurekiObject *self)
 {
-    PyObject_Del(self);
+    PyTypeObject *type = Py_TYPE(self);
+    qreki_state *state = free_list_state(type);
+
+    if (state && state->free_count < state->free_max) {
+        Py_SET_TYPE(self, (PyTypeObject *)state->free_list);
+        state->free_list = self;
+        state->free_count++;
+    } else {
+        type->tp_free(self);
+    }
+    Py_DECREF(type);
 }
 
 
 static PyObject *
 Kyureki_repr(KyurekiObject *self)
 {
+    PyTypeObject *type = Py_TYPE(self);
     PyObject *classname = NULL, *ret = NULL;
-    classname = PyObject_GetAttrString((PyObject *)Py_TYPE(self), "__name__");
+
+    /* ヒープ型の __name__ は ht_name そのもの */
+    if (type->tp_flags & Py_TPFLAGS_HEAPTYPE) {
+        return PyUnicode_FromFormat("%U(%u, %u, %u, %u)",
+                                    ((PyHeapTypeObject *)type)->ht_name,
+                                    self->year, self->month,
+                                    self->leap_month, self->day);
+    }
+    classname = PyObject_GetAttrString((PyObject *)type, "__name__");
     if (!classname) { return NULL; }
     ret = PyUnicode_FromFormat("%U(%u, %u, %u, %u)",
                                classname,
@@ -200,7 +1541,23 @@ Kyureki_repr(KyurekiObject *self)
 static PyObject *
 Kyureki_str(KyurekiObject *self)
 {
+    qreki_state *state = free_list_state(Py_TYPE(self));
     PyObject *template = NULL, *ret = NULL;
+    char buf[KYUREKI_STR_MAX];
+    Py_ssize_t n;
+
+    if (state) {
+        switch (kyureki_str_unchanged(state, Py_TYPE(self))) {
+            case -1:
+                return NULL;
+            case 1:
+                n = kyureki_format_utf8(buf, self->year, self->month,
+                                        self->leap_month, self->day);
+                return PyUnicode_DecodeUTF8(buf, n, NULL);
+        }
+    }
+
+    /* サブクラスや書き換えられたテンプレートは format で */
     if (self->leap_month) {
         template = PyObject_GetAttrString((PyObject *)self, "_str_leap_template");
     } else {
@@ -213,86 +1570,202 @@ Kyureki_str(KyurekiObject *self)
 }
 
 
+/* type の _str_template, _str_leap_template が module_exec で設定したままならば 1
+ * type は Kyureki そのもの (free_list_state で確かめたもの) 。インスタンスには
+ * __dict__ がなく基底は object だけなので、型の辞書の値と同一かを比べればよい */
+static int
+kyureki_str_unchanged(qreki_state *state, PyTypeObject *type)
+{
+    PyObject *template, *leap_template;
+
+    template = PyDict_GetItemWithError(type->tp_dict, state->str_template_name);
+    if (!template) { return PyErr_Occurred() ? -1 : 0; }
+    leap_template = PyDict_GetItemWithError(type->tp_dict,
+                                            state->str_leap_template_name);
+    if (!leap_template) { return PyErr_Occurred() ? -1 : 0; }
+    return template == state->str_template &&
+           leap_template == state->str_leap_template;
+}
+
+
+/* "2017年閏5月1日" を p に UTF-8 で書き、バイト数を返す
+ * p には KYUREKI_STR_MAX バイトあればよい */
+static Py_ssize_t
+kyureki_format_utf8(char *p, int year, int month, int leap_month, int day)
+{
+    char *start = p;
+    char digits[8];
+    int i;
+
+#define PUT_UINT(value) \
+    do { \
+        unsigned int v_ = (unsigned int)(value); \
+        i = 0; \
+        do { digits[i++] = (char)('0' + v_ % 10); v_ /= 10; } while (v_); \
+        while (i) { *p++ = digits[--i]; } \
+    } while (0)
+
+    PUT_UINT(year);
+    memcpy(p, "年", 3);
+    p += 3;
+    if (leap_month) {
+        memcpy(p, "閏", 3);
+        p += 3;
+    }
+    PUT_UINT(month);
+    memcpy(p, "月", 3);
+    p += 3;
+    PUT_UINT(day);
+    memcpy(p, "日", 3);
+    p += 3;
+
+#undef PUT_UINT
+    return p - start;
+}
+
+
+/* values の各要素を str にしたものを sep でつなぐ
+ * テンプレートが元のままならば、 Kyureki と KyurekiArray は
+ * kyureki_format_utf8 でバッファに直接書き、最後に 1 度だけ str か bytes にする */
 static PyObject *
-Kyureki_richcompare(KyurekiObject *self, KyurekiObject *other, int op)
+qreki_format_kyureki(PyObject *module, PyObject *args, PyObject *kwargs)
 {
-    PyObject *result;
-    int c;
+    qreki_state *state = PyModule_GetState(module);
+    static char *kwlist[] = {"values", "sep", "as_bytes", NULL};
+    PyObject *values, *sep = NULL, *seq = NULL, *item, *text, *ret = NULL;
+    KyurekiArrayObject *array = NULL;
+    KyurekiObject *k;
+    const char *sep_buf = "\n", *text_buf;
+    char *buf = NULL, *tmp;
+    Py_ssize_t sep_len = 1, n, i, len, size = 0, capacity;
+    int as_bytes = 0, fast;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|U$p", kwlist,
+                                     &values, &sep, &as_bytes)) { return NULL; }
+    if (sep) {
+        sep_buf = PyUnicode_AsUTF8AndSize(sep, &sep_len);
+        if (!sep_buf) { return NULL; }
+    }
 
-    if (!PyObject_IsInstance((PyObject *)other, (PyObject *)Py_TYPE(self))) {
-        Py_RETURN_NOTIMPLEMENTED;
+    fast = kyureki_str_unchanged(state, (PyTypeObject *)state->kyureki_type);
+    if (fast < 0) { return NULL; }
+    if (fast && PyObject_TypeCheck(values, (PyTypeObject *)state->array_type)) {
+        array = (KyurekiArrayObject *)values;
+        n = array->n;
+    } else {
+        seq = PySequence_Fast(values, "values must be iterable");
+        if (!seq) { return NULL; }
+        n = PySequence_Fast_GET_SIZE(seq);
     }
 
-    switch (op) {
-        case Py_LT:
-            if (self->year < other->year) { c = 1; break; }
-            if (self->year > other->year) { c = 0; break; }
-            if (self->month < other->month) { c = 1; break; }
-            if (self->month > other->month) { c = 0; break; }
-            if (self->leap_month < other->leap_month) { c = 1; break; }
-            if (self->leap_month > other->leap_month) { c = 0; break; }
-            c = self->day < other->day;
-            break;
-        case Py_LE:
-            if (self->year < other->year) { c = 1; break; }
-            if (self->year > other->year) { c = 0; break; }
-            if (self->month < other->month) { c = 1; break; }
-            if (self->month > other->month) { c = 0; break; }
-            if (self->leap_month < other->leap_month) { c = 1; break; }
-            if (self->leap_month > other->leap_month) { c = 0; break; }
-            c = self->day <= other->day;
-            break;
-        case Py_EQ:
-            c = ((self->year == other->year) &&
-                 (self->month == other->month) &&
-                 (self->leap_month == other->leap_month) &&
-                 (self->day == other->day));
-            break;
-        case Py_NE:
-            c = ((self->year != other->year) ||
-                 (self->month != other->month) ||
-                 (self->leap_month != other->leap_month) ||
-                 (self->day != other->day));
-            break;
-        case Py_GT:
-            if (self->year > other->year) { c = 1; break; }
-            if (self->year < other->year) { c = 0; break; }
-            if (self->month > other->month) { c = 1; break; }
-            if (self->month < other->month) { c = 0; break; }
-            if (self->leap_month > other->leap_month) { c = 1; break; }
-            if (self->leap_month < other->leap_month) { c = 0; break; }
-            c = self->day > other->day;
-            break;
-        case Py_GE:
-            if (self->year > other->year) { c = 1; break; }
-            if (self->year < other->year) { c = 0; break; }
-            if (self->month > other->month) { c = 1; break; }
-            if (self->month < other->month) { c = 0; break; }
-            if (self->leap_month > other->leap_month) { c = 1; break; }
-            if (self->leap_month < other->leap_month) { c = 0; break; }
-            c = self->day >= other->day;
-            break;
-        default:
-            Py_RETURN_NOTIMPLEMENTED;
+    /* "2017年8月28日" は 16 バイト。足りなければ広げる */
+    capacity = n * (16 + sep_len) + KYUREKI_STR_MAX;
+    buf = PyMem_Malloc(capacity);
+    if (!buf) {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+
+#define RESERVE(need) \
+    do { \
+        if (size + (need) > capacity) { \
+            capacity = (size + (need)) * 2; \
+            tmp = PyMem_Realloc(buf, capacity); \
+            if (!tmp) { \
+                PyErr_NoMemory(); \
+                goto cleanup; \
+            } \
+            buf = tmp; \
+        } \
+    } while (0)
+
+    for (i = 0; array ? i < n : i < PySequence_Fast_GET_SIZE(seq); i++) {
+        RESERVE(sep_len + KYUREKI_STR_MAX);
+        if (i) {
+            memcpy(buf + size, sep_buf, sep_len);
+            size += sep_len;
+        }
+        if (array) {
+            size += kyureki_format_utf8(buf + size,
+                                        ARRAY_ITEM(array, 0, unsigned short, i),
+                                        ARRAY_ITEM(array, 1, unsigned char, i),
+                                        ARRAY_ITEM(array, 2, unsigned char, i),
+                                        ARRAY_ITEM(array, 3, unsigned char, i));
+            continue;
+        }
+
+        item = PySequence_Fast_GET_ITEM(seq, i);
+        if (free_list_state(Py_TYPE(item)) == state) {
+            /* 途中の __str__ がテンプレートを書き換えることもあるので確かめ直す */
+            fast = kyureki_str_unchanged(state, Py_TYPE(item));
+            if (fast < 0) { goto cleanup; }
+            if (fast) {
+                k = (KyurekiObject *)item;
+                size += kyureki_format_utf8(buf + size, k->year, k->month,
+                                            k->leap_month, k->day);
+                continue;
+            }
+        }
+
+        Py_INCREF(item);
+        text = PyObject_Str(item);
+        Py_DECREF(item);
+        if (!text) { goto cleanup; }
+        text_buf = PyUnicode_AsUTF8AndSize(text, &len);
+        if (!text_buf) {
+            Py_DECREF(text);
+            goto cleanup;
+        }
+        RESERVE(len);
+        memcpy(buf + size, text_buf, len);
+        size += len;
+        Py_DECREF(text);
+    }
+#undef RESERVE
+
+    if (as_bytes) {
+        ret = PyBytes_FromStringAndSize(buf, size);
+    } else {
+        ret = PyUnicode_DecodeUTF8(buf, size, NULL);
+    }
+cleanup:
+    PyMem_Free(buf);
+    Py_XDECREF(seq);
+    return ret;
+}
+
+
+static PyObject *
+Kyureki_richcompare(KyurekiObject *self, KyurekiObject *other, int op)
+{
+    long long a, b;
+
+    if (Py_TYPE(other) != Py_TYPE(self) &&
+            !PyObject_TypeCheck((PyObject *)other, Py_TYPE(self))) {
+        Py_RETURN_NOTIMPLEMENTED;
     }
 
-    result = c ? Py_True: Py_False;
-    Py_INCREF(result);
-    return result;
+    a = KYUREKI_KEY(self->year, self->month, self->leap_month, self->day);
+    b = KYUREKI_KEY(other->year, other->month, other->leap_month, other->day);
+    Py_RETURN_RICHCOMPARE(a, b, op);
 }
 
 
+/* hash(self.key) と同じ値。 64 ビット環境では key は int のハッシュ値そのものになる */
 static Py_hash_t
 Kyureki_hash(KyurekiObject *self)
 {
+    long long key = KYUREKI_KEY(self->year, self->month, self->leap_month,
+                                self->day);
+    PyObject *obj;
     Py_hash_t ret;
-    PyObject *t;
 
-    t = Py_BuildValue("hbbb", self->year, self->month, self->leap_month, self->day);
-    if (!t) { return -1; }
-    ret = PyObject_Hash(t);
-    Py_DECREF(t);
+    if (sizeof(Py_hash_t) >= 8) { return (Py_hash_t)key; }
 
+    obj = PyLong_FromLongLong(key);
+    if (!obj) { return -1; }
+    ret = PyObject_Hash(obj);
+    Py_DECREF(obj);
     return ret;
 }
 
@@ -308,489 +1781,4026 @@ static PyType_Slot Kyureki_Type_slots[] = {
     {Py_tp_str, Kyureki_str},
     {Py_tp_richcompare, Kyureki_richcompare},
     {Py_tp_hash, Kyureki_hash},
+    {Py_nb_add, Kyureki_add},
+    {Py_nb_subtract, Kyureki_subtract},
     {0, 0},
 };
 
 
 static PyType_Spec Kyureki_Type_spec = {
-    "_qreki.Kyureki",
+    "qreki._qreki.Kyureki",
     sizeof(KyurekiObject),
     0,
-    Py_TPFLAGS_DEFAULT,
+    Py_TPFLAGS_DEFAULT|Py_TPFLAGS_BASETYPE,
     Kyureki_Type_slots
 };
 
 
-static double
-normalize_angle(double angle)
+static void
+KyurekiRange_dealloc(KyurekiRangeObject *self)
 {
+    PyTypeObject *type = Py_TYPE(self);
 
-    angle = fmod(angle, 360.0);
-    if (angle < 0.0) {
-        angle += 360.0;
-    }
-
-    return angle;
+    Py_DECREF(self->kyureki_type);
+    PyObject_Del(self);
+    Py_DECREF(type);
 }
 
 
-static int
-kyureki_from_jd(int tm0, double tz, int *kyureki_year, int *kyureki_month,
-                int *kyureki_leap, int *kyureki_day)
+static PyObject *
+KyurekiRange_next(KyurekiRangeObject *self)
 {
-    int shinreki_year, shinreki_month;
-    double tm;
-    double chu[4][2];
-    double saku[5];
-    int m[5][3];
-    int leap;
-    int i, state;
+    int tm0 = self->tm0;
+    const MonthEntry *entry = &self->entry;
 
-    tm = (double)tm0;
+    if (tm0 >= self->stop) { return NULL; }
 
-    before_nibun_from_jd(tm, tz, &chu[0][0], &chu[0][1]);
-    for (i=1; i < 4; i++) {
-        chuki_from_jd(chu[i-1][0] + 32.0, tz, &chu[i][0], &chu[i][1]);
+    if (tm0 >= self->entry_end) {
+        if (kyureki_range_span(self)) { return NULL; }
     }
+    self->tm0++;
 
-    if (saku_from_jd(chu[0][0], tz, &saku[0]) == -1)
-        return -1;
+    return kyureki_object_new(self->kyureki_type,
+                              kyureki_year_from_jd(tm0, entry->month),
+                              entry->month, entry->leap,
+                              tm0 - entry->start + entry->day0 + 1);
+}
 
-    for (i=1; i < 5; i++) {
-        if (saku_from_jd(saku[i-1] + 30.0, tz, &saku[i]) == -1)
-            return -1;
-        if (abs((int)saku[i - 1] - (int)saku[i]) <= 26) {
-            if (saku_from_jd(saku[i-1] + 35.0, tz, &saku[i]) == -1)
-                return -1;
-        }
-    }
 
-    if ((int)(saku[1]) <= (int)(chu[0][0])) {
-        for (i=0; i < 4; i++)
-            saku[i] = saku[i+1];
-        if (saku_from_jd(saku[3] + 35.0, tz, &saku[i]) == -1)
-            return -1;
+/* tm0 を含む月を求める。 JST 以外では朔日行列を使い切るまで使い回す */
+static int
+kyureki_range_span(KyurekiRangeObject *self)
+{
+    const MonthEntry *entry;
+    int tm0 = self->tm0;
+    int i, next;
+
+    MonthTable *table;
+
+    if (tm0 >= TABLE_FIRST_JD && tm0 <= TABLE_LAST_JD &&
+            (table = month_table_for(self->tz))) {
+        entry = month_table_find(table, tm0, &self->entry_end);
+        if (!entry) { return -1; }
+        self->entry = *entry;
+        return 0;
     }
-    else if((int)saku[0] > (int)chu[0][0]) {
-        for (i=4; i > 0; i--)
-            saku[i] = saku[i-1];
-        if (saku_from_jd(saku[0] - 27.0, tz, &saku[i]) == -1)
+
+    if (tm0 >= self->window_end) {
+        if (kyureki_window_from_jd(tm0, self->tz, &self->window) == -1) {
+            solver_error();
             return -1;
+        }
+        self->window_end = kyureki_window_end(&self->window, tm0, self->tz);
     }
 
-    leap = ((int)saku[4] <= (int)chu[3][0]) ? 1 : 0;
+    i = kyureki_window_index(&self->window, tm0);
+    next = (i < 4 && self->window.m[i+1][2] < self->window_end)
+           ? self->window.m[i+1][2] : self->window_end;
 
-    m[0][0] = (int)(chu[0][1] / 30.0) + 2;
-    m[0][1] = 0;
-    m[0][2] = (int)saku[0];
+    self->entry.start = tm0;
+    self->entry.month = (unsigned char)self->window.m[i][0];
+    self->entry.leap = (unsigned char)self->window.m[i][1];
+    self->entry.day0 = (unsigned char)(tm0 - self->window.m[i][2]);
+    self->entry_end = next;
 
-    for (i=1; i < 5; i++) {
-        if (leap == 1 && i != 1) {
-            if ((int)chu[i-1][0] <= (int)saku[i-1] ||
-                (int)chu[i-1][0] >= (int)saku[i]) {
-                m[i-1][0] = m[i-2][0];
-                m[i-1][1] = 1;
-                m[i-1][2] = (int)saku[i-1];
-                leap = 0;
-            }
-        }
-        m[i][0] = m[i-1][0] + 1;
-        if (m[i][0] > 12) {
-            m[i][0] -= 12;
-        }
-        m[i][1] = 0;
-        m[i][2] = (int)saku[i];
+    return 0;
+}
+
+
+static PyType_Slot KyurekiRange_Type_slots[] = {
+    {Py_tp_iter, PyObject_SelfIter},
+    {Py_tp_iternext, KyurekiRange_next},
+    {Py_tp_dealloc, KyurekiRange_dealloc},
+    {0, 0},
+};
+
+
+static PyType_Spec KyurekiRange_Type_spec = {
+    "qreki._qreki.KyurekiRange",
+    sizeof(KyurekiRangeObject),
+    0,
+    Py_TPFLAGS_DEFAULT,
+    KyurekiRange_Type_slots
+};
+
+
+static PyObject *
+KyurekiArray_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"year", "month", "leap_month", "day", NULL};
+    PyObject *objs[4];
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOOO", kwlist, &objs[0],
+                                     &objs[1], &objs[2], &objs[3])) { return NULL; }
+
+    return kyureki_array_from_columns(type, objs);
+}
+
+
+/* from_ordinals の結果から作る */
+static PyObject *
+KyurekiArray_from_ordinals(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    qreki_state *state = qreki_state_from_type(type);
+    PyObject *result, *ret;
+
+    if (!state) { return NULL; }
+    result = from_ordinals_impl(state, args, kwargs);
+    if (!result) { return NULL; }
+    ret = kyureki_array_from_columns(type, &PyTuple_GET_ITEM(result, 0));
+    Py_DECREF(result);
+    return ret;
+}
+
+
+static PyObject *
+kyureki_array_from_columns(PyTypeObject *type, PyObject *const *columns)
+{
+    static const char *names[4] = {"year", "month", "leap_month", "day"};
+    KyurekiArrayObject *self;
+    int k;
+
+    self = (KyurekiArrayObject *)type->tp_alloc(type, 0);
+    if (!self) { return NULL; }
+    for (k = 0; k < 4; k++) {
+        self->columns[k] = kyureki_array_column(columns[k], k ? "B" : "H", names[k]);
+        if (!self->columns[k]) { goto error; }
+        if (k == 0) {
+            self->n = PyMemoryView_GET_BUFFER(self->columns[0])->shape[0];
+        } else if (PyMemoryView_GET_BUFFER(self->columns[k])->shape[0] != self->n) {
+            PyErr_Format(PyExc_ValueError, "%s and year differ in length", names[k]);
+            goto error;
+        }
+    }
+    return (PyObject *)self;
+error:
+    Py_DECREF(self);
+    return NULL;
+}
+
+
+/* obj を format の 1 次元の読み出し専用 memoryview にする
+ * bytes のような 1 バイトのバッファは format の並びとみなす (pickle で受け取るため) */
+static PyObject *
+kyureki_array_column(PyObject *obj, const char *format, const char *name)
+{
+    PyObject *view, *tmp;
+    Py_buffer *b;
+
+    view = PyMemoryView_FromObject(obj);
+    if (!view) { return NULL; }
+    b = PyMemoryView_GET_BUFFER(view);
+    if (b->ndim != 1) {
+        PyErr_Format(PyExc_TypeError, "%s must be a 1-dimensional buffer", name);
+        goto error;
+    }
+    if (strcmp(b->format ? b->format : "B", format) != 0) {
+        if (b->itemsize != 1) {
+            PyErr_Format(PyExc_TypeError,
+                         "%s must be a buffer of '%s' or bytes", name, format);
+            goto error;
+        }
+        tmp = PyObject_CallMethod(view, "cast", "s", format);
+        if (!tmp) { goto error; }
+        Py_DECREF(view);
+        view = tmp;
+        b = PyMemoryView_GET_BUFFER(view);
+    }
+    if (!b->readonly) {
+        tmp = PyObject_CallMethod(view, "toreadonly", NULL);
+        if (!tmp) { goto error; }
+        Py_DECREF(view);
+        view = tmp;
+    }
+    return view;
+error:
+    Py_DECREF(view);
+    return NULL;
+}
+
+
+static void
+KyurekiArray_dealloc(KyurekiArrayObject *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+    int k;
+
+    for (k = 0; k < 4; k++) {
+        Py_XDECREF(self->columns[k]);
+    }
+    type->tp_free(self);
+    Py_DECREF(type);
+}
+
+
+static Py_ssize_t
+KyurekiArray_length(KyurekiArrayObject *self)
+{
+    return self->n;
+}
+
+
+static PyObject *
+KyurekiArray_item(KyurekiArrayObject *self, Py_ssize_t i)
+{
+    qreki_state *state;
+
+    if (i < 0 || i >= self->n) {
+        PyErr_SetString(PyExc_IndexError, "KyurekiArray index out of range");
+        return NULL;
+    }
+    state = qreki_state_from_type(Py_TYPE(self));
+    if (!state) { return NULL; }
+
+    return kyureki_object_new((PyTypeObject *)state->kyureki_type,
+                              ARRAY_ITEM(self, 0, unsigned short, i),
+                              ARRAY_ITEM(self, 1, unsigned char, i),
+                              ARRAY_ITEM(self, 2, unsigned char, i),
+                              ARRAY_ITEM(self, 3, unsigned char, i));
+}
+
+
+/* スライスは各列の memoryview のスライスで、コピーしない */
+static PyObject *
+KyurekiArray_subscript(KyurekiArrayObject *self, PyObject *key)
+{
+    PyObject *columns[4] = {NULL, NULL, NULL, NULL};
+    PyObject *ret = NULL;
+    Py_ssize_t i;
+    int k;
+
+    if (PyIndex_Check(key)) {
+        i = PyNumber_AsSsize_t(key, PyExc_IndexError);
+        if (i == -1 && PyErr_Occurred()) { return NULL; }
+        if (i < 0) { i += self->n; }
+        return KyurekiArray_item(self, i);
+    }
+    if (!PySlice_Check(key)) {
+        PyErr_Format(PyExc_TypeError,
+                     "KyurekiArray indices must be integers or slices, not %.200s",
+                     Py_TYPE(key)->tp_name);
+        return NULL;
+    }
+
+    for (k = 0; k < 4; k++) {
+        columns[k] = PyObject_GetItem(self->columns[k], key);
+        if (!columns[k]) { goto cleanup; }
+    }
+    ret = kyureki_array_from_columns(Py_TYPE(self), columns);
+cleanup:
+    for (k = 0; k < 4; k++) {
+        Py_XDECREF(columns[k]);
+    }
+    return ret;
+}
+
+
+/* 六曜の添字の列。 from_ordinals の rokuyou と同じ */
+static PyObject *
+KyurekiArray_rokuyou(KyurekiArrayObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"out", NULL};
+    qreki_state *state = qreki_state_from_type(Py_TYPE(self));
+    PyObject *out = NULL;
+    IntBuffer output;
+    Py_ssize_t i;
+
+    if (!state) { return NULL; }
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$O", kwlist, &out)) {
+        return NULL;
+    }
+
+    if (out == Py_None) { out = NULL; }
+    Py_XINCREF(out);
+    if (int_buffer_output(state, &out, &output, self->n, 1, "out")) {
+        Py_XDECREF(out);
+        return NULL;
+    }
+    if (output.format == 'B') {
+        unsigned char *p = output.view.buf;
+        for (i = 0; i < self->n; i++) {
+            p[i] = (ARRAY_ITEM(self, 1, unsigned char, i) +
+                    ARRAY_ITEM(self, 3, unsigned char, i)) % 6;
+        }
+    } else {
+        for (i = 0; i < self->n; i++) {
+            int_buffer_store(&output, i, (ARRAY_ITEM(self, 1, unsigned char, i) +
+                                          ARRAY_ITEM(self, 3, unsigned char, i)) % 6);
+        }
+    }
+    PyBuffer_Release(&output.view);
+
+    return out;
+}
+
+
+/* protocol 5 以上では各列を PickleBuffer で渡し、 out-of-band で送れるようにする */
+static PyObject *
+KyurekiArray_reduce_ex(KyurekiArrayObject *self, PyObject *arg)
+{
+    PyObject *columns, *column, *obj;
+    long protocol;
+    int k;
+
+    protocol = PyLong_AsLong(arg);
+    if (protocol == -1 && PyErr_Occurred()) { return NULL; }
+
+    columns = PyTuple_New(4);
+    if (!columns) { return NULL; }
+    for (k = 0; k < 4; k++) {
+        column = self->columns[k];
+        if (protocol >= 5 &&
+                PyBuffer_IsContiguous(PyMemoryView_GET_BUFFER(column), 'C')) {
+            obj = PyPickleBuffer_FromObject(column);
+        } else if (protocol >= 5) {
+            /* ステップつきのスライスは詰め直す */
+            column = PyObject_CallMethod(column, "tobytes", NULL);
+            if (!column) { goto error; }
+            obj = PyPickleBuffer_FromObject(column);
+            Py_DECREF(column);
+        } else {
+            obj = PyObject_CallMethod(column, "tobytes", NULL);
+        }
+        if (!obj) { goto error; }
+        PyTuple_SET_ITEM(columns, k, obj);
+    }
+
+    return Py_BuildValue("ON", (PyObject *)Py_TYPE(self), columns);
+error:
+    Py_DECREF(columns);
+    return NULL;
+}
+
+
+static PyObject *
+KyurekiArray_repr(KyurekiArrayObject *self)
+{
+    return PyUnicode_FromFormat("<%s of %zd>", Py_TYPE(self)->tp_name, self->n);
+}
+
+
+static PyObject *
+KyurekiArray_column(KyurekiArrayObject *self, void *closure)
+{
+    PyObject *column = self->columns[(Py_intptr_t)closure];
+    Py_INCREF(column);
+    return column;
+}
+
+
+static PyGetSetDef KyurekiArray_getset[] = {
+    {"year", (getter)KyurekiArray_column, NULL, "旧暦の年 (memoryview 'H')", (void *)0},
+    {"month", (getter)KyurekiArray_column, NULL, "旧暦の月 (memoryview 'B')", (void *)1},
+    {"leap_month", (getter)KyurekiArray_column, NULL, "閏月フラグ (memoryview 'B')", (void *)2},
+    {"day", (getter)KyurekiArray_column, NULL, "旧暦の日 (memoryview 'B')", (void *)3},
+    {NULL}  /* Sentinel */
+};
+
+
+static PyMethodDef KyurekiArray_methods[] = {
+    {"from_ordinals", (PyCFunction)KyurekiArray_from_ordinals, METH_VARARGS|METH_KEYWORDS|METH_CLASS, NULL},
+    {"rokuyou", (PyCFunction)KyurekiArray_rokuyou, METH_VARARGS|METH_KEYWORDS, NULL},
+    {"__reduce_ex__", (PyCFunction)KyurekiArray_reduce_ex, METH_O, NULL},
+    {NULL, NULL, 0, NULL} /* Sentinel */
+};
+
+
+static PyType_Slot KyurekiArray_Type_slots[] = {
+    {Py_tp_doc, "KyurekiArray Type"},
+    {Py_tp_getset, KyurekiArray_getset},
+    {Py_tp_methods, KyurekiArray_methods},
+    {Py_tp_new, KyurekiArray_new},
+    {Py_tp_dealloc, KyurekiArray_dealloc},
+    {Py_tp_repr, KyurekiArray_repr},
+    {Py_sq_length, KyurekiArray_length},
+    {Py_sq_item, KyurekiArray_item},
+    {Py_mp_length, KyurekiArray_length},
+    {Py_mp_subscript, KyurekiArray_subscript},
+    {0, 0},
+};
+
+
+static PyType_Spec KyurekiArray_Type_spec = {
+    "qreki._qreki.KyurekiArray",
+    sizeof(KyurekiArrayObject),
+    0,
+    Py_TPFLAGS_DEFAULT,
+    KyurekiArray_Type_slots
+};
+
+
+static qreki_state *
+qreki_state_from_type(PyTypeObject *type)
+{
+#if PY_VERSION_HEX >= 0x030B0000
+    PyObject *module = PyType_GetModuleByDef(type, &qreki_module);
+    if (!module) { return NULL; }
+    return PyModule_GetState(module);
+#else
+    PyObject *mro = type->tp_mro;
+    PyObject *module;
+    Py_ssize_t i;
+
+    for (i = 0; mro && i < PyTuple_GET_SIZE(mro); i++) {
+        type = (PyTypeObject *)PyTuple_GET_ITEM(mro, i);
+        if (!(type->tp_flags & Py_TPFLAGS_HEAPTYPE)) { continue; }
+        module = ((PyHeapTypeObject *)type)->ht_module;
+        if (module && PyModule_GetDef(module) == &qreki_module) {
+            return PyModule_GetState(module);
+        }
+    }
+    PyErr_SetString(PyExc_TypeError, "_qreki module not found");
+    return NULL;
+#endif
+}
+
+
+static int
+date_to_ordinal(PyObject *date, long *ordinal)
+{
+    PyObject *ordinal_obj;
+
+    /* datetime.date (とそのサブクラス) はフィールドを直接読む */
+    if (PyDate_Check(date)) {
+        return ymd_to_ordinal(PyDateTime_GET_YEAR(date), PyDateTime_GET_MONTH(date),
+                              PyDateTime_GET_DAY(date), ordinal);
+    }
+
+    if ((ordinal_obj = PyObject_CallMethod(date, "toordinal", NULL)) == NULL) {
+        return -1;
+    }
+    *ordinal = PyLong_AsLong(ordinal_obj);
+    Py_DECREF(ordinal_obj);
+    if (PyErr_Occurred()) { return -1; }
+
+    return 0;
+}
+
+
+/* date(year, month, day).toordinal() を date を作らずに求める */
+static int
+ymd_to_ordinal(int year, int month, int day, long *ordinal)
+{
+    static const int days_before_month[] = {
+        0, 0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334, 365};
+    int leap, days_in_month, y;
+
+    if (year < 1 || year > 9999) {
+        PyErr_Format(PyExc_ValueError, "year %i is out of range", year);
+        return -1;
+    }
+    if (month < 1 || month > 12) {
+        PyErr_SetString(PyExc_ValueError, "month must be in 1..12");
+        return -1;
+    }
+    leap = year % 4 == 0 && (year % 100 != 0 || year % 400 == 0);
+    days_in_month = days_before_month[month + 1] - days_before_month[month];
+    if (month == 2 && leap) { days_in_month++; }
+    if (day < 1 || day > days_in_month) {
+        PyErr_SetString(PyExc_ValueError, "day is out of range for month");
+        return -1;
+    }
+
+    y = year - 1;
+    *ordinal = y * 365L + y / 4 - y / 100 + y / 400 + days_before_month[month] +
+               (month > 2 && leap) + day;
+    return 0;
+}
+
+
+/* date.fromordinal(ordinal) の年月日。 3 月始まりの暦で 400 年周期に分けて求める */
+static void
+ordinal_to_ymd(long ordinal, int *year, int *month, int *day)
+{
+    long z, era, doe, yoe, doy, mp;
+
+    z = ordinal + 305;          /* 0000-03-01 からの日数 */
+    era = z / 146097;
+    doe = z - era * 146097;
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+
+    *day = (int)(doy - (153 * mp + 2) / 5 + 1);
+    *month = (int)(mp < 10 ? mp + 3 : mp - 9);
+    *year = (int)(yoe + era * 400 + (*month <= 2));
+}
+
+
+/* METH_FASTCALL の引数を kwlist の順に slots に並べる
+ * 先頭 required 個は必須。省略された任意の引数は NULL */
+static int
+fastcall_parse(const char *fname, PyObject *const *args, Py_ssize_t nargs,
+               PyObject *kwnames, const char *const *kwlist, int required,
+               PyObject **slots)
+{
+    Py_ssize_t count, i, j, nkw;
+    PyObject *key;
+
+    for (count = 0; kwlist[count]; count++) {
+        slots[count] = NULL;
+    }
+    if (nargs > count) {
+        PyErr_Format(PyExc_TypeError, "%s() takes at most %zd arguments (%zd given)",
+                     fname, count, nargs);
+        return -1;
+    }
+    for (i = 0; i < nargs; i++) {
+        slots[i] = args[i];
+    }
+
+    nkw = kwnames ? PyTuple_GET_SIZE(kwnames) : 0;
+    for (i = 0; i < nkw; i++) {
+        key = PyTuple_GET_ITEM(kwnames, i);
+        for (j = 0; j < count; j++) {
+            if (PyUnicode_CompareWithASCIIString(key, kwlist[j]) == 0) { break; }
+        }
+        if (j == count) {
+            PyErr_Format(PyExc_TypeError,
+                         "%s() got an unexpected keyword argument '%U'", fname, key);
+            return -1;
+        }
+        if (slots[j]) {
+            PyErr_Format(PyExc_TypeError,
+                         "argument for %s() given by name ('%s') and position (%zd)",
+                         fname, kwlist[j], j + 1);
+            return -1;
+        }
+        slots[j] = args[nargs + i];
+    }
+
+    for (i = 0; i < required; i++) {
+        if (!slots[i]) {
+            PyErr_Format(PyExc_TypeError,
+                         "%s() missing required argument '%s' (pos %zd)",
+                         fname, kwlist[i], i + 1);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* 省略可能な tz 引数。 obj が NULL ならば *tz をそのままにする */
+static int
+fastcall_tz(PyObject *obj, double *tz)
+{
+    double value;
+
+    if (!obj) { return 0; }
+    value = PyFloat_AsDouble(obj);
+    if (value == -1.0 && PyErr_Occurred()) { return -1; }
+    *tz = value;
+
+    return 0;
+}
+
+
+static int
+fastcall_int(PyObject *obj, long min, long max, long *value)
+{
+    long v;
+
+    if (PyFloat_Check(obj)) {
+        PyErr_SetString(PyExc_TypeError, "integer argument expected, got float");
+        return -1;
+    }
+    v = PyLong_AsLong(obj);
+    if (v == -1 && PyErr_Occurred()) { return -1; }
+    if (v < min || v > max) {
+        PyErr_Format(PyExc_OverflowError, "%ld is out of range [%ld, %ld]",
+                     v, min, max);
+        return -1;
+    }
+    *value = v;
+
+    return 0;
+}
+
+
+static PyObject *
+qreki_from_ordinals(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    return from_ordinals_impl(PyModule_GetState(module), args, kwargs);
+}
+
+
+static PyObject *
+from_ordinals_impl(qreki_state *state, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"ordinals", "tz", "year", "month", "leap_month",
+                             "day", "rokuyou", "threads", NULL};
+    PyObject *ordinals;
+    PyObject *out[5] = {NULL, NULL, NULL, NULL, NULL};
+    static const char *names[5] = {"year", "month", "leap_month", "day", "rokuyou"};
+    IntBuffer input, output[5];
+    double tz = jst_tz;
+    int threads = 1;
+    ConvertTask *tasks = NULL;
+    MonthTable *table;
+    Py_ssize_t n, ntasks, chunk, i;
+    int k, acquired = 0, nworkers = 0, pooled = 0;
+    PyObject *ret = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|d$OOOOOi", kwlist,
+                                     &ordinals, &tz, &out[0], &out[1], &out[2],
+                                     &out[3], &out[4], &threads)) { return NULL; }
+    if (threads < 1) {
+        PyErr_SetString(PyExc_ValueError, "threads must be at least 1");
+        return NULL;
+    }
+
+    if (int_buffer_get(ordinals, &input, 1)) { return NULL; }
+    n = input.view.len / input.view.itemsize;
+
+    for (k = 0; k < 5; k++) {
+        Py_XINCREF(out[k]);
+        if (out[k] == Py_None) { Py_CLEAR(out[k]); }
+    }
+    for (acquired = 0; acquired < 5; acquired++) {
+        if (int_buffer_output(state, &out[acquired], &output[acquired], n,
+                              acquired == 0 ? 2 : 1, names[acquired])) {
+            goto cleanup;
+        }
+    }
+
+    /* GIL を解放する前に、必要な朔日テーブルを作っておく */
+    table = month_table_for(tz);
+    if (table && month_table_prepare(table, &input)) { goto cleanup; }
+
+    ntasks = (n + CONVERT_MIN_CHUNK - 1) / CONVERT_MIN_CHUNK;
+    if (ntasks > threads) { ntasks = threads; }
+    if (ntasks < 1) { ntasks = 1; }
+    chunk = (n + ntasks - 1) / ntasks;
+
+    tasks = PyMem_Calloc(ntasks, sizeof(ConvertTask));
+    if (!tasks) {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+    for (i = 0; i < ntasks; i++) {
+        tasks[i].input = &input;
+        tasks[i].output = output;
+        tasks[i].start = i * chunk < n ? i * chunk : n;
+        tasks[i].stop = (i + 1) * chunk < n ? (i + 1) * chunk : n;
+        tasks[i].tz = tz;
+        tasks[i].table = table;
+    }
+
+    /* 起動済みのスレッドを使う。ほかの from_ordinals が使っている間や、
+     * 足りない分はその場でスレッドを作る */
+    if (ntasks > 1 && !state->workers_busy) {
+        state->workers_busy = pooled = 1;
+        nworkers = thread_pool_start(state, (int)(ntasks - 1));
+    }
+
+    /* 変換中は solver やテーブルを切り替えさせない */
+    converts_running++;
+    if (table) { table->busy++; }
+    Py_BEGIN_ALLOW_THREADS
+    convert_ordinals(tasks, ntasks, state->workers, nworkers);
+    Py_END_ALLOW_THREADS
+    if (table) { table->busy--; }
+    converts_running--;
+    if (pooled) { state->workers_busy = 0; }
+
+    for (i = 0; i < ntasks; i++) {
+        if (tasks[i].error) {
+            convert_error(tasks[i].error, "ordinal",
+                          int_buffer_load(&input, tasks[i].error_index));
+            goto cleanup;
+        }
+    }
+
+    ret = PyTuple_Pack(5, out[0], out[1], out[2], out[3], out[4]);
+cleanup:
+    PyMem_Free(tasks);
+    for (k = 0; k < acquired; k++) {
+        PyBuffer_Release(&output[k].view);
+    }
+    for (k = 0; k < 5; k++) {
+        Py_XDECREF(out[k]);
+    }
+    PyBuffer_Release(&input.view);
+    return ret;
+}
+
+
+static PyObject *
+qreki_to_ordinals(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    qreki_state *state = PyModule_GetState(module);
+    static char *kwlist[] = {"year", "month", "leap_month", "day", "tz", "out",
+                             NULL};
+    static const char *names[4] = {"year", "month", "leap_month", "day"};
+    PyObject *in[4];
+    PyObject *out = NULL;
+    IntBuffer input[4], output;
+    double tz = jst_tz;
+    Py_ssize_t n = 0, i;
+    int k, acquired = 0, error, tm0;
+    PyObject *ret = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOOO|d$O", kwlist,
+                                     &in[0], &in[1], &in[2], &in[3], &tz,
+                                     &out)) { return NULL; }
+
+    for (acquired = 0; acquired < 4; acquired++) {
+        if (int_buffer_get(in[acquired], &input[acquired], 0)) { goto cleanup; }
+        if (acquired == 0) {
+            n = input[0].view.len / input[0].view.itemsize;
+        } else if (input[acquired].view.len / input[acquired].view.itemsize != n) {
+            PyErr_Format(PyExc_ValueError, "%s and year differ in length",
+                         names[acquired]);
+            PyBuffer_Release(&input[acquired].view);
+            goto cleanup;
+        }
+    }
+
+    if (out == Py_None) { out = NULL; }
+    Py_XINCREF(out);
+    if (int_buffer_output(state, &out, &output, n, 4, "out")) { goto cleanup; }
+
+    for (i = 0; i < n; i++) {
+        long long v[4];
+
+        for (k = 0; k < 4; k++) {
+            v[k] = int_buffer_load(&input[k], i);
+        }
+        if (v[0] < 0 || v[0] > 10000) {
+            error = CONVERT_RANGE;
+        } else if (v[1] < 1 || v[1] > 12 || v[2] < 0 || v[2] > 1 ||
+                   v[3] < 1 || v[3] > 30) {
+            error = v[3] < 1 || v[3] > 30 ? CONVERT_DAY : CONVERT_MONTH;
+        } else {
+            error = kyureki_to_jd((int)v[0], (int)v[1], (int)v[2], (int)v[3],
+                                  tz, &tm0);
+        }
+        if (error) {
+            convert_error(error, "index", i);
+            PyBuffer_Release(&output.view);
+            goto cleanup;
+        }
+        int_buffer_store(&output, i, tm0 - 1721424);
+    }
+    PyBuffer_Release(&output.view);
+
+    ret = out;
+    out = NULL;
+cleanup:
+    Py_XDECREF(out);
+    for (k = 0; k < acquired; k++) {
+        PyBuffer_Release(&input[k].view);
+    }
+    return ret;
+}
+
+
+static PyObject *
+qreki_rokuyou_from_date(PyObject *module, PyObject *const *args, Py_ssize_t nargs,
+                        PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"date", "tz", NULL};
+    PyObject *slots[2];
+    double tz = jst_tz;
+    long ordinal;
+
+    if (fastcall_parse("rokuyou_from_date", args, nargs, kwnames, kwlist, 1, slots) ||
+            fastcall_tz(slots[1], &tz)) { return NULL; }
+    if (date_to_ordinal(slots[0], &ordinal)) { return NULL; }
+
+    return rokuyou_from_ordinal(module, ordinal, tz);
+}
+
+
+static PyObject *
+qreki_rokuyou_from_ordinal(PyObject *module, PyObject *const *args,
+                           Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"ordinal", "tz", NULL};
+    PyObject *slots[2];
+    double tz = jst_tz;
+    long ordinal;
+
+    if (fastcall_parse("rokuyou_from_ordinal", args, nargs, kwnames, kwlist, 1, slots) ||
+            fastcall_int(slots[0], LONG_MIN, LONG_MAX, &ordinal) ||
+            fastcall_tz(slots[1], &tz)) { return NULL; }
+
+    return rokuyou_from_ordinal(module, ordinal, tz);
+}
+
+
+static PyObject *
+rokuyou_from_ordinal(PyObject *module, long ordinal, double tz)
+{
+    qreki_state *state = PyModule_GetState(module);
+    PyObject *rokuyou;
+    int index, error;
+
+    if (ordinal < ORDINAL_MIN || ordinal > ORDINAL_MAX) {
+        convert_error(CONVERT_RANGE, "ordinal", ordinal);
+        return NULL;
+    }
+    error = rokuyou_from_jd((int)ordinal + 1721424, tz, &index);
+    if (error) {
+        convert_error(error, NULL, 0);
+        return NULL;
+    }
+
+    rokuyou = PyTuple_GET_ITEM(state->rokuyou, index);
+    Py_INCREF(rokuyou);
+    return rokuyou;
+}
+
+
+/* 六曜の添字 (Kyureki.ROKUYOU の何番目か) の列を得る */
+static PyObject *
+qreki_rokuyou_from_ordinals(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    qreki_state *state = PyModule_GetState(module);
+    static char *kwlist[] = {"ordinals", "tz", "out", NULL};
+    PyObject *ordinals, *out = NULL;
+    IntBuffer input, output;
+    double tz = jst_tz;
+    Py_ssize_t n, i;
+    long long ordinal;
+    int index, error;
+    PyObject *ret = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|d$O", kwlist,
+                                     &ordinals, &tz, &out)) { return NULL; }
+
+    if (int_buffer_get(ordinals, &input, 1)) { return NULL; }
+    n = input.view.len / input.view.itemsize;
+
+    if (out == Py_None) { out = NULL; }
+    Py_XINCREF(out);
+    if (int_buffer_output(state, &out, &output, n, 1, "out")) { goto cleanup; }
+
+    for (i = 0; i < n; i++) {
+        ordinal = int_buffer_load(&input, i);
+        if (ordinal < ORDINAL_MIN || ordinal > ORDINAL_MAX) {
+            error = CONVERT_RANGE;
+        } else {
+            error = rokuyou_from_jd((int)ordinal + 1721424, tz, &index);
+        }
+        if (error) {
+            convert_error(error, "ordinal", ordinal);
+            PyBuffer_Release(&output.view);
+            goto cleanup;
+        }
+        int_buffer_store(&output, i, index);
+    }
+    PyBuffer_Release(&output.view);
+
+    ret = out;
+    out = NULL;
+cleanup:
+    Py_XDECREF(out);
+    PyBuffer_Release(&input.view);
+    return ret;
+}
+
+
+/* 六曜の添字を得る。朔日テーブルを引けるときは年を求めない */
+static int
+rokuyou_from_jd(int tm0, double tz, int *rokuyou)
+{
+    const MonthEntry *entry;
+    MonthTable *table;
+    int kyureki_year, kyureki_month, kyureki_leap, kyureki_day, end;
+
+    if (tm0 >= TABLE_FIRST_JD && tm0 <= TABLE_LAST_JD &&
+            (table = month_table_for(tz))) {
+        entry = month_table_find(table, tm0, &end);
+        if (!entry) { return CONVERT_SOLVER; }
+        kyureki_month = entry->month;
+        kyureki_day = tm0 - entry->start + entry->day0 + 1;
+    } else if (kyureki_from_jd(tm0, tz, &kyureki_year, &kyureki_month,
+                               &kyureki_leap, &kyureki_day)) {
+        return CONVERT_SOLVER;
+    }
+
+    *rokuyou = (kyureki_month + kyureki_day) % 6;
+    return 0;
+}
+
+
+static PyObject *
+qreki_sekki(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"start", "stop", "tz", NULL};
+    PyObject *start, *stop;
+    double tz = jst_tz;
+    long first, last;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|d", kwlist,
+                                     &start, &stop, &tz)) { return NULL; }
+    if (date_to_ordinal(start, &first) || date_to_ordinal(stop, &last)) {
+        return NULL;
+    }
+
+    return sekki_between(first, last, tz);
+}
+
+
+static PyObject *
+qreki_sekki_of_year(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"year", "tz", NULL};
+    int year;
+    double tz = jst_tz;
+    long first, last;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|d", kwlist,
+                                     &year, &tz)) { return NULL; }
+    if (ymd_to_ordinal(year, 1, 1, &first) ||
+            ymd_to_ordinal(year, 12, 31, &last)) { return NULL; }
+
+    return sekki_between(first, last + 1, tz);
+}
+
+
+/* 新暦の日付がどの節気の期間にあるか。節気の時刻を含む日からその期間とする
+ * 隣りあう日付は同じ期間であることが多いので、直前の期間を覚えておく */
+static PyObject *
+qreki_sekki_from_ordinals(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    qreki_state *state = PyModule_GetState(module);
+    static char *kwlist[] = {"ordinals", "tz", "out", NULL};
+    PyObject *ordinals, *out = NULL;
+    IntBuffer input, output;
+    double tz = jst_tz;
+    double tm, next, longitude;
+    Py_ssize_t n, i;
+    long long ordinal;
+    int tm0, start = 0, end = 0, index = 0;
+    PyObject *ret = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|d$O", kwlist,
+                                     &ordinals, &tz, &out)) { return NULL; }
+
+    if (int_buffer_get(ordinals, &input, 1)) { return NULL; }
+    n = input.view.len / input.view.itemsize;
+
+    if (out == Py_None) { out = NULL; }
+    Py_XINCREF(out);
+    if (int_buffer_output(state, &out, &output, n, 1, "out")) { goto cleanup; }
+
+    for (i = 0; i < n; i++) {
+        ordinal = int_buffer_load(&input, i);
+        if (ordinal < ORDINAL_MIN || ordinal > ORDINAL_MAX) {
+            convert_error(CONVERT_RANGE, "ordinal", ordinal);
+            PyBuffer_Release(&output.view);
+            goto cleanup;
+        }
+        tm0 = (int)ordinal + 1721424;
+        if (tm0 < start || tm0 >= end) {
+            /* その日の終わりより前の節気と、その次の節気 */
+            sekki_from_jd(tm0 + 1.0, tz, &tm, &longitude);
+            index = (int)floor(longitude / 15.0 + 0.5) % 24;
+            sekki_from_jd(tm + 16.0, tz, &next, &longitude);
+            start = (int)tm;
+            end = (int)next;
+        }
+        int_buffer_store(&output, i, index);
+    }
+    PyBuffer_Release(&output.view);
+
+    ret = out;
+    out = NULL;
+cleanup:
+    Py_XDECREF(out);
+    PyBuffer_Release(&input.view);
+    return ret;
+}
+
+
+/* [first, stop) の日 (date.toordinal() の値) にある節気の (添字, 時刻) のリスト
+ * 次の節気は直前の節気の 16 日後を初期値として求める */
+static PyObject *
+sekki_between(long first, long stop, double tz)
+{
+    PyObject *ret, *item;
+    double tm, longitude;
+    int tm0 = (int)first + 1721424;
+
+    ret = PyList_New(0);
+    if (!ret) { return NULL; }
+
+    sekki_from_jd(tm0, tz, &tm, &longitude);
+    while ((long)floor(tm) - 1721424 < stop) {
+        if ((long)floor(tm) - 1721424 >= first) {
+            item = Py_BuildValue("(iN)", (int)floor(longitude / 15.0 + 0.5) % 24,
+                                 sekki_instant(tm));
+            if (!item || PyList_Append(ret, item)) {
+                Py_XDECREF(item);
+                Py_DECREF(ret);
+                return NULL;
+            }
+            Py_DECREF(item);
+        }
+        sekki_from_jd(tm + 16.0, tz, &tm, &longitude);
+    }
+
+    return ret;
+}
+
+
+/* moon_age(date, tz) 。 date が datetime ならばその時刻、 date ならば正午の月齢 */
+static PyObject *
+qreki_moon_age(PyObject *module, PyObject *const *args, Py_ssize_t nargs,
+               PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"date", "tz", NULL};
+    PyObject *slots[2];
+    SakuSpan span = {0.0, 0.0};
+    double tz = jst_tz, tm, age;
+    long ordinal;
+
+    if (fastcall_parse("moon_age", args, nargs, kwnames, kwlist, 1, slots) ||
+            fastcall_tz(slots[1], &tz) ||
+            date_to_ordinal(slots[0], &ordinal)) { return NULL; }
+
+    tm = ordinal + 1721424;
+    if (PyDateTime_Check(slots[0])) {
+        tm += (PyDateTime_DATE_GET_HOUR(slots[0]) * 3600 +
+               PyDateTime_DATE_GET_MINUTE(slots[0]) * 60 +
+               PyDateTime_DATE_GET_SECOND(slots[0]) +
+               PyDateTime_DATE_GET_MICROSECOND(slots[0]) / 1e6) / 86400.0;
+    } else {
+        tm += 0.5;
+    }
+
+    if (moon_age_from_jd(tm, tz, &span, &age)) {
+        solver_error();
+        return NULL;
+    }
+    return PyFloat_FromDouble(age);
+}
+
+
+static PyObject *
+qreki_moon_age_from_ordinals(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    qreki_state *state = PyModule_GetState(module);
+    static char *kwlist[] = {"ordinals", "tz", "hour", "out", NULL};
+    PyObject *ordinals, *out = NULL;
+    IntBuffer input;
+    Py_buffer output;
+    SakuSpan span = {0.0, 0.0};
+    double tz = jst_tz, hour = 12.0, age;
+    Py_ssize_t n, i;
+    long long ordinal;
+    PyObject *ret = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|d$dO", kwlist,
+                                     &ordinals, &tz, &hour, &out)) { return NULL; }
+    if (!(hour >= 0.0 && hour < 24.0)) {
+        PyErr_SetString(PyExc_ValueError, "hour must be in [0, 24)");
+        return NULL;
+    }
+
+    if (int_buffer_get(ordinals, &input, 1)) { return NULL; }
+    n = input.view.len / input.view.itemsize;
+
+    if (out == Py_None) { out = NULL; }
+    Py_XINCREF(out);
+    if (double_buffer_output(state, &out, &output, n, "out")) { goto cleanup; }
+
+    for (i = 0; i < n; i++) {
+        ordinal = int_buffer_load(&input, i);
+        if (ordinal < ORDINAL_MIN || ordinal > ORDINAL_MAX) {
+            convert_error(CONVERT_RANGE, "ordinal", ordinal);
+            PyBuffer_Release(&output);
+            goto cleanup;
+        }
+        if (moon_age_from_jd(ordinal + 1721424 + hour / 24.0, tz, &span, &age)) {
+            convert_error(CONVERT_SOLVER, "ordinal", ordinal);
+            PyBuffer_Release(&output);
+            goto cleanup;
+        }
+        ((double *)output.buf)[i] = age;
+    }
+    PyBuffer_Release(&output);
+
+    ret = out;
+    out = NULL;
+cleanup:
+    Py_XDECREF(out);
+    PyBuffer_Release(&input.view);
+    return ret;
+}
+
+
+static PyStructSequence_Field kyureki_month_fields[] = {
+    {"month", "旧暦の月"},
+    {"leap_month", "閏月フラグ"},
+    {"start", "月初の新暦 (datetime.date)"},
+    {"days", "月の日数"},
+    {NULL, NULL}
+};
+
+static PyStructSequence_Desc kyureki_month_desc = {
+    "qreki._qreki.KyurekiMonth",
+    "旧暦の 1 か月 (month, leap_month, start, days)",
+    kyureki_month_fields,
+    4,
+};
+
+
+static PyObject *
+qreki_year_calendar(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    qreki_state *state = PyModule_GetState(module);
+    static char *kwlist[] = {"year", "tz", NULL};
+    MonthSpan months[YEAR_MONTHS_MAX];
+    double tz = jst_tz;
+    long ordinal;
+    int year, n, i, y, m, d, error;
+    PyObject *ret, *item, *value;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|d", kwlist,
+                                     &year, &tz)) { return NULL; }
+    if (ymd_to_ordinal(year, 1, 1, &ordinal)) { return NULL; }
+
+    if ((error = year_months_from_jd(year, tz, months, &n))) {
+        convert_error(error, NULL, 0);
+        return NULL;
+    }
+
+    ret = PyTuple_New(n);
+    if (!ret) { return NULL; }
+    for (i = 0; i < n; i++) {
+        item = PyStructSequence_New((PyTypeObject *)state->month_type);
+        if (!item) { goto error; }
+        PyTuple_SET_ITEM(ret, i, item);
+
+        ordinal_to_ymd(months[i].start - 1721424, &y, &m, &d);
+        if (!(value = PyLong_FromLong(months[i].month))) { goto error; }
+        PyStructSequence_SET_ITEM(item, 0, value);
+        if (!(value = PyLong_FromLong(months[i].leap))) { goto error; }
+        PyStructSequence_SET_ITEM(item, 1, value);
+        if (!(value = PyDate_FromDate(y, m, d))) { goto error; }
+        PyStructSequence_SET_ITEM(item, 2, value);
+        if (!(value = PyLong_FromLong(months[i].days))) { goto error; }
+        PyStructSequence_SET_ITEM(item, 3, value);
+    }
+    return ret;
+error:
+    Py_DECREF(ret);
+    return NULL;
+}
+
+
+/* 旧暦 kyureki_year 年の正月から 12 月 (閏月を含む) までを求める
+ * 新暦の 1 月 1 日は前年の 11 月か 12 月なので、そこから 1 か月ずつ進める
+ * 朔日テーブルを引けるときは、続く 12, 13 か月分の項目をそのまま読む */
+static int
+year_months_from_jd(int kyureki_year, double tz, MonthSpan *months, int *n)
+{
+    long long key, first = KYUREKI_KEY(kyureki_year, 1, 0, 0);
+    int y = kyureki_year - 1;
+    int tm0, end, year, error;
+    const MonthEntry *entry;
+    MonthTable *table;
+    TableCursor cursor;
+    MonthSpan span;
+
+    tm0 = y * 365 + y / 4 - y / 100 + y / 400 + 1 + 1721424;
+    *n = 0;
+    if (tm0 >= TABLE_FIRST_JD && tm0 <= TABLE_LAST_JD &&
+            (table = month_table_for(tz))) {
+        if (!table_cursor_find(&cursor, table, tm0)) { return CONVERT_SOLVER; }
+        if ((error = table_cursor_month_first(&cursor))) { return error; }
+        for (;;) {
+            entry = TABLE_CURSOR_ENTRY(&cursor);
+            year = kyureki_year_from_jd(entry->start, entry->month);
+            if (year > kyureki_year) { break; }
+            if ((error = table_cursor_month(&cursor, &span))) { return error; }
+            if (year == kyureki_year) {
+                if (*n == YEAR_MONTHS_MAX) { return CONVERT_SOLVER; }
+                months[(*n)++] = span;
+            }
+        }
+        return *n ? 0 : CONVERT_RANGE;
+    }
+
+    for (;;) {
+        if ((error = kyureki_key_from_jd(tm0, tz, &key))) { return error; }
+        if (key >> 16 > kyureki_year) { break; }
+        if ((error = month_end_from_jd(tm0, key, tz, &end))) { return error; }
+        if (key >= first) {
+            if (*n == YEAR_MONTHS_MAX) { return CONVERT_SOLVER; }
+            months[*n].month = (int)(key >> 8 & 0xFF);
+            months[*n].leap = (int)(key >> 7 & 1);
+            months[*n].start = tm0;
+            months[*n].days = end - tm0;
+            (*n)++;
+        }
+        tm0 = end;
+    }
+
+    return *n ? 0 : CONVERT_RANGE;
+}
+
+
+static PyObject *
+qreki_find_dates(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    DateQuery query;
+    double tz;
+    long first, stop;
+    int *ordinals = NULL;
+    Py_ssize_t n, i;
+    int y, m, d;
+    PyObject *ret = NULL, *date;
+
+    if (date_query_parse(PyModule_GetState(module), args, kwargs, &first,
+                         &stop, &tz, &query)) { return NULL; }
+    if (date_query_run(first, stop, tz, &query, &ordinals, &n)) { return NULL; }
+
+    ret = PyList_New(n);
+    if (!ret) { goto cleanup; }
+    for (i = 0; i < n; i++) {
+        ordinal_to_ymd(ordinals[i], &y, &m, &d);
+        date = PyDate_FromDate(y, m, d);
+        if (!date) {
+            Py_CLEAR(ret);
+            goto cleanup;
+        }
+        PyList_SET_ITEM(ret, i, date);
+    }
+cleanup:
+    PyMem_Free(ordinals);
+    return ret;
+}
+
+
+static PyObject *
+qreki_find_ordinals(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    qreki_state *state = PyModule_GetState(module);
+    DateQuery query;
+    double tz;
+    long first, stop;
+    int *ordinals = NULL;
+    Py_ssize_t n;
+    Py_buffer view;
+    PyObject *ret;
+
+    if (date_query_parse(state, args, kwargs, &first, &stop, &tz, &query)) {
+        return NULL;
+    }
+    if (date_query_run(first, stop, tz, &query, &ordinals, &n)) { return NULL; }
+
+    ret = PySequence_Repeat(state->array_i, n);
+    if (ret && n) {
+        if (PyObject_GetBuffer(ret, &view, PyBUF_WRITABLE)) {
+            Py_CLEAR(ret);
+        } else {
+            memcpy(view.buf, ordinals, n * sizeof(int));
+            PyBuffer_Release(&view);
+        }
+    }
+    PyMem_Free(ordinals);
+    return ret;
+}
+
+
+static int
+date_query_parse(qreki_state *state, PyObject *args, PyObject *kwargs,
+                 long *first, long *stop, double *tz, DateQuery *query)
+{
+    static char *kwlist[] = {"start", "stop", "tz", "rokuyou", "day", "month",
+                             "leap_month", "weekday", NULL};
+    PyObject *start, *end;
+    PyObject *rokuyou = Py_None, *day = Py_None, *month = Py_None;
+    PyObject *leap = Py_None, *weekday = Py_None;
+
+    *tz = jst_tz;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|d$OOOOO", kwlist,
+                                     &start, &end, tz, &rokuyou, &day, &month,
+                                     &leap, &weekday)) { return -1; }
+    if (date_to_ordinal(start, first) || date_to_ordinal(end, stop) ||
+            date_query_mask(state, rokuyou, "rokuyou", 0, 5, &query->rokuyou) ||
+            date_query_mask(state, day, "day", 1, 30, &query->day) ||
+            date_query_mask(state, month, "month", 1, 12, &query->month) ||
+            date_query_mask(state, leap, "leap_month", 0, 1, &query->leap) ||
+            date_query_mask(state, weekday, "weekday", 0, 6, &query->weekday)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* None はすべて、整数はその値、それ以外はイテラブルの各値を表すビットにする
+ * rokuyou は '大安' などの文字列でもよい */
+static int
+date_query_mask(qreki_state *state, PyObject *obj, const char *name, long min,
+                long max, unsigned long *mask)
+{
+    PyObject *it, *item;
+    long value;
+    int i;
+
+    if (obj == Py_None) {
+        *mask = ~0UL;
+        return 0;
+    }
+
+    *mask = 0;
+    if (PyLong_Check(obj) || PyUnicode_Check(obj)) {
+        it = NULL;
+        item = obj;
+        Py_INCREF(item);
+    } else {
+        it = PyObject_GetIter(obj);
+        if (!it) { return -1; }
+        item = PyIter_Next(it);
+    }
+
+    for (; item; item = it ? PyIter_Next(it) : NULL) {
+        if (PyUnicode_Check(item) && strcmp(name, "rokuyou") == 0) {
+            for (i = 0; i < 6; i++) {
+                if (PyUnicode_Compare(item, PyTuple_GET_ITEM(state->rokuyou, i)) == 0) {
+                    break;
+                }
+            }
+            if (i == 6) {
+                PyErr_Format(PyExc_ValueError, "unknown rokuyou %R", item);
+                goto error;
+            }
+            value = i;
+        } else {
+            value = PyLong_AsLong(item);
+            if (value == -1 && PyErr_Occurred()) { goto error; }
+            if (value < min || value > max) {
+                PyErr_Format(PyExc_ValueError, "%s must be in %ld..%ld",
+                             name, min, max);
+                goto error;
+            }
+        }
+        *mask |= 1UL << value;
+        Py_DECREF(item);
+    }
+    if (it) {
+        Py_DECREF(it);
+        if (PyErr_Occurred()) { return -1; }
+    }
+    return 0;
+error:
+    Py_DECREF(item);
+    Py_XDECREF(it);
+    return -1;
+}
+
+
+/* [first, stop) で query に合う日の序数を求める
+ * 朔日テーブルの項目を順にたどり、月と閏月が合う項目だけ日を調べる。
+ * テーブルのない tz は 1 か月ごとに月の境目を旧暦から探す */
+static int
+date_query_run(long first, long stop, double tz, const DateQuery *query,
+               int **ordinals, Py_ssize_t *n)
+{
+    Py_ssize_t size = 0;
+    const MonthEntry *entry, *next;
+    MonthTable *table = NULL;
+    TableCursor cursor = {NULL, 0, 0};
+    long long key;
+    int tm0, end, last, month, leap, day, error;
+    int stop_jd = (int)stop + 1721424;
+
+    *ordinals = NULL;
+    *n = 0;
+    tm0 = (int)first + 1721424;
+    if (tm0 < stop_jd && (table = month_table_for(tz)) &&
+            !table_cursor_find(&cursor, table, tm0)) {
+        error = CONVERT_SOLVER;
+        goto error;
+    }
+    while (tm0 < stop_jd) {
+        if (table) {
+            entry = TABLE_CURSOR_ENTRY(&cursor);
+            month = entry->month;
+            leap = entry->leap;
+            day = tm0 - entry->start + entry->day0 + 1;
+            next = table_cursor_step(&cursor, 1);
+            if (!next && PyErr_Occurred()) {
+                error = CONVERT_SOLVER;
+                goto error;
+            }
+            end = next ? next->start : TABLE_LAST_JD + 1;
+        } else {
+            if ((error = kyureki_key_from_jd(tm0, tz, &key))) { goto error; }
+            error = month_end_from_jd(tm0, key, tz, &end);
+            if (error == CONVERT_RANGE) {
+                end = TABLE_LAST_JD + 1;
+            } else if (error) {
+                goto error;
+            }
+            month = (int)(key >> 8 & 0xFF);
+            leap = (int)(key >> 7 & 1);
+            day = (int)(key & 0x7F);
+        }
+        last = end < stop_jd ? end : stop_jd;
+
+        if (query->month >> month & 1 && query->leap >> leap & 1 &&
+                date_query_days(query, month, day, tm0, last, ordinals, n,
+                                &size)) { goto fail; }
+        tm0 = end;
+    }
+    return 0;
+error:
+    convert_error(error, NULL, 0);
+fail:
+    PyMem_Free(*ordinals);
+    *ordinals = NULL;
+    return -1;
+}
+
+
+/* values の各ビット v について、日 d ≡ v - offset (mod period) を表すビットを 1..30 日で作る */
+static unsigned long
+date_query_cycle(unsigned long values, int period, int offset)
+{
+    unsigned long mask = 0;
+    int v, d;
+
+    for (v = 0; v < period; v++) {
+        if (!(values >> v & 1)) { continue; }
+        for (d = ((v - offset) % period + period) % period; d <= 30; d += period) {
+            mask |= 1UL << d;
+        }
+    }
+    return mask;
+}
+
+
+/* [tm0, last) のうち query の日, 六曜, 曜日に合う日を ordinals に加える
+ * day は tm0 の旧暦日で、 last までは同じ月が続く。
+ * 六曜は (month + day) % 6 なので 6 日ごと、曜日は 7 日ごとに合う。
+ * それぞれを旧暦日のビットにして query->day と重ね、残った日だけを加える */
+static int
+date_query_days(const DateQuery *query, int month, int day, int tm0, int last,
+                int **ordinals, Py_ssize_t *n, Py_ssize_t *size)
+{
+    unsigned long mask;
+    int *buf;
+    int hi, d;
+
+    hi = day + (last - tm0) - 1;
+    if (hi > 30) { hi = 30; }
+    if (day < 1 || hi < day) { return 0; }
+
+    mask = query->day & (((2UL << hi) - 1) & ~((1UL << day) - 1));
+    if (mask && query->rokuyou != ~0UL) {
+        mask &= date_query_cycle(query->rokuyou, 6, month);
+    }
+    if (mask && query->weekday != ~0UL) {
+        /* 旧暦日 d の曜日は (tm0 - day + d - 1721424 + 6) % 7 */
+        mask &= date_query_cycle(query->weekday, 7, (tm0 - day - 1721424 + 6) % 7);
+    }
+
+    for (d = day; mask >> d; d++) {
+        if (!(mask >> d & 1)) { continue; }
+        if (*n == *size) {
+            *size = *size ? *size * 2 : 64;
+            buf = PyMem_Realloc(*ordinals, *size * sizeof(int));
+            if (!buf) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            *ordinals = buf;
+        }
+        (*ordinals)[(*n)++] = tm0 + (d - day) - 1721424;
+    }
+    return 0;
+}
+
+
+/* tm0 (旧暦 key) を含む月の先頭日を求める */
+static int
+month_start_from_jd(int tm0, long long key, double tz, int *start)
+{
+    long long k;
+    int s = tm0 - (int)(key & 0x7F) + 1;
+    int error;
+
+    if (s > tm0) { s = tm0; }
+    if (s < TABLE_FIRST_JD) { s = TABLE_FIRST_JD; }
+    while (s > TABLE_FIRST_JD) {
+        if ((error = kyureki_key_from_jd(s - 1, tz, &k))) { return error; }
+        if (k >> 7 != key >> 7) { break; }
+        s--;
+    }
+    while (s < tm0) {
+        if ((error = kyureki_key_from_jd(s, tz, &k))) { return error; }
+        if (k >> 7 == key >> 7) { break; }
+        s++;
+    }
+
+    *start = s;
+    return 0;
+}
+
+
+/* tm0 (旧暦 key) を含む月の次の月の先頭日を求める
+ * 月の長さはほとんど 29 日か 30 日なので、月初から 29 日後の前後だけを調べる */
+static int
+month_end_from_jd(int tm0, long long key, double tz, int *end)
+{
+    long long k;
+    int e = tm0 - (int)(key & 0x7F) + 30;
+    int error;
+
+    if (e <= tm0) { e = tm0 + 1; }
+    for (;;) {
+        if (e > TABLE_LAST_JD) { return CONVERT_RANGE; }
+        if ((error = kyureki_key_from_jd(e, tz, &k))) { return error; }
+        if (k >> 7 != key >> 7) { break; }
+        e++;
+    }
+    while (e - 1 > tm0) {
+        if ((error = kyureki_key_from_jd(e - 1, tz, &k))) { return error; }
+        if (k >> 7 == key >> 7) { break; }
+        e--;
+    }
+
+    *end = e;
+    return 0;
+}
+
+
+/* 時刻 tm (ローカル補正込みのユリウス通日) の月齢 (直前の朔からの日数) を求める
+ * span の朔の間にあればそのまま使い、次の朔の間ならばその終わりから 1 つだけ解く
+ * 日付順に並んだ 1 年分でも朔を解くのは 13 回ほどになる */
+static int
+moon_age_from_jd(double tm, double tz, SakuSpan *span, double *age)
+{
+    double start, end;
+
+    if (tm < span->start || tm >= span->end) {
+        if (span->end <= tm && tm < span->end + 29.0) {
+            start = span->end;
+        } else {
+            if (saku_from_jd(tm, tz, &start, 0) == -1) { return -1; }
+            if (start > tm && saku_from_jd(start - 15.0, tz, &start, 0) == -1) {
+                return -1;
+            }
+        }
+        for (;;) {
+            if (saku_from_jd(start + 30.0, tz, &end, 0) == -1) { return -1; }
+            if (end - start <= 26.0 &&
+                    saku_from_jd(start + 35.0, tz, &end, 0) == -1) { return -1; }
+            if (tm < end) { break; }
+            start = end;
+        }
+        span->start = start;
+        span->end = end;
+    }
+
+    *age = tm - span->start;
+    return 0;
+}
+
+
+/* 節気の時刻 tm (ローカル補正込みのユリウス通日) を秒に丸めた datetime にする */
+static PyObject *
+sekki_instant(double tm)
+{
+    long day = (long)floor(tm);
+    long seconds = (long)floor((tm - day) * 86400.0 + 0.5);
+    int year, month, mday;
+
+    if (seconds >= 86400) {
+        day++;
+        seconds -= 86400;
+    }
+    ordinal_to_ymd(day - 1721424, &year, &month, &mday);
+
+    return PyDateTime_FromDateAndTime(year, month, mday, (int)(seconds / 3600),
+                                      (int)(seconds / 60 % 60), (int)(seconds % 60), 0);
+}
+
+
+/* kyureki_from_jd などの失敗を例外にする
+ * name が NULL でなければ、 name と value を添えて失敗した要素を示す */
+static void
+convert_error(int error, const char *name, long long value)
+{
+    if (!name) {
+        switch (error) {
+            case CONVERT_RANGE:
+                PyErr_SetString(PyExc_ValueError, "date is out of range");
+                return;
+            case CONVERT_MONTH:
+                PyErr_SetString(PyExc_ValueError, "no such kyureki month");
+                return;
+            case CONVERT_DAY:
+                PyErr_SetString(PyExc_ValueError, "day is out of range for month");
+                return;
+        }
+    }
+
+    switch (error) {
+        case CONVERT_RANGE:
+            PyErr_Format(PyExc_ValueError, "%s %lld is out of range", name, value);
+            break;
+        case CONVERT_MONTH:
+            PyErr_Format(PyExc_ValueError, "%s %lld: no such kyureki month",
+                         name, value);
+            break;
+        case CONVERT_DAY:
+            PyErr_Format(PyExc_ValueError, "%s %lld: day is out of range for month",
+                         name, value);
+            break;
+        default:
+            solver_error();
+            break;
+    }
+}
+
+
+/* tasks[1:] を別スレッドで、 tasks[0] をこのスレッドで処理する
+ * tasks[1:nworkers + 1] は起動済みの workers に渡し、残りはスレッドを作る
+ * GIL を持たずに呼ぶ */
+static void
+convert_ordinals(ConvertTask *tasks, Py_ssize_t ntasks, ConvertWorker **workers,
+                 Py_ssize_t nworkers)
+{
+    Py_ssize_t i;
+
+    for (i = 1; i < ntasks && i <= nworkers; i++) {
+        workers[i - 1]->task = &tasks[i];
+        PyThread_release_lock(workers[i - 1]->wake);
+    }
+    for (; i < ntasks; i++) {
+        tasks[i].done = PyThread_allocate_lock();
+        if (tasks[i].done) {
+            PyThread_acquire_lock(tasks[i].done, WAIT_LOCK);
+            if (PyThread_start_new_thread(convert_task_thread, &tasks[i])
+                    == PYTHREAD_INVALID_THREAD_ID) {
+                PyThread_release_lock(tasks[i].done);
+                PyThread_free_lock(tasks[i].done);
+                tasks[i].done = NULL;
+            }
+        }
+    }
+
+    convert_task_run(&tasks[0]);
+
+    for (i = 1; i < ntasks && i <= nworkers; i++) {
+        PyThread_acquire_lock(workers[i - 1]->done, WAIT_LOCK);
+    }
+    for (; i < ntasks; i++) {
+        if (tasks[i].done) {
+            PyThread_acquire_lock(tasks[i].done, WAIT_LOCK);
+            PyThread_release_lock(tasks[i].done);
+            PyThread_free_lock(tasks[i].done);
+            tasks[i].done = NULL;
+        } else {
+            /* スレッドを作れなかった分はここで処理する */
+            convert_task_run(&tasks[i]);
+        }
+    }
+}
+
+
+static void
+convert_task_thread(void *arg)
+{
+    ConvertTask *task = arg;
+
+    convert_task_run(task);
+    PyThread_release_lock(task->done);
+}
+
+
+/* 起動済みのスレッドの本体。 GIL は持たない */
+static void
+convert_worker_main(void *arg)
+{
+    ConvertWorker *worker = arg;
+
+    for (;;) {
+        PyThread_acquire_lock(worker->wake, WAIT_LOCK);
+        if (!worker->task) { break; }
+        convert_task_run(worker->task);
+        PyThread_release_lock(worker->done);
+    }
+
+    /* 止めた側は待たないので、後始末はこちらでする */
+    PyThread_free_lock(worker->wake);
+    PyThread_free_lock(worker->done);
+    PyMem_RawFree(worker);
+}
+
+
+/* n 個のスレッドが使えるように起動しておき、使える数を返す
+ * workers_max を超える分や、作れなかった分は数えない。 GIL を持って呼ぶ */
+static int
+thread_pool_start(qreki_state *state, int n)
+{
+    ConvertWorker **workers, *worker;
+
+    if (n > state->workers_max) { n = state->workers_max; }
+    if (n > state->workers_size) {
+        workers = PyMem_Realloc(state->workers, n * sizeof(ConvertWorker *));
+        if (!workers) { return state->workers_size; }
+        state->workers = workers;
+    }
+
+    while (state->workers_size < n) {
+        worker = PyMem_RawCalloc(1, sizeof(ConvertWorker));
+        if (!worker) { break; }
+        worker->wake = PyThread_allocate_lock();
+        worker->done = PyThread_allocate_lock();
+        if (!worker->wake || !worker->done) { goto error; }
+        PyThread_acquire_lock(worker->wake, WAIT_LOCK);
+        PyThread_acquire_lock(worker->done, WAIT_LOCK);
+        if (PyThread_start_new_thread(convert_worker_main, worker)
+                == PYTHREAD_INVALID_THREAD_ID) { goto error; }
+        state->workers[state->workers_size++] = worker;
+    }
+    return state->workers_size < n ? state->workers_size : n;
+error:
+    if (worker->wake) { PyThread_free_lock(worker->wake); }
+    if (worker->done) { PyThread_free_lock(worker->done); }
+    PyMem_RawFree(worker);
+    return state->workers_size;
+}
+
+
+/* 起動済みのスレッドを maxsize 個まで減らす。使っている間は呼ばない */
+static void
+thread_pool_trim(qreki_state *state, int maxsize)
+{
+    ConvertWorker *worker;
+
+    while (state->workers_size > maxsize) {
+        worker = state->workers[--state->workers_size];
+        worker->task = NULL;
+        PyThread_release_lock(worker->wake);
+    }
+    if (!state->workers_size) {
+        PyMem_Free(state->workers);
+        state->workers = NULL;
+    }
+}
+
+
+/* task->start から task->stop までを変換する。 GIL は不要 */
+static void
+convert_task_run(ConvertTask *task)
+{
+    IntBuffer *output = task->output;
+    long long ordinal;
+    int kyureki_year, kyureki_month, kyureki_leap, kyureki_day;
+    Py_ssize_t i;
+
+    task->error = CONVERT_OK;
+    for (i = task->start; i < task->stop; i++) {
+        ordinal = int_buffer_load(task->input, i);
+        if (ordinal < ORDINAL_MIN || ordinal > ORDINAL_MAX) {
+            task->error = CONVERT_RANGE;
+            task->error_index = i;
+            return;
+        }
+        if (kyureki_from_jd_nogil((int)ordinal + 1721424, task->tz, task->table,
+                                  &kyureki_year, &kyureki_month, &kyureki_leap,
+                                  &kyureki_day)) {
+            task->error = CONVERT_SOLVER;
+            task->error_index = i;
+            return;
+        }
+        int_buffer_store(&output[0], i, kyureki_year);
+        int_buffer_store(&output[1], i, kyureki_month);
+        int_buffer_store(&output[2], i, kyureki_leap);
+        int_buffer_store(&output[3], i, kyureki_day);
+        int_buffer_store(&output[4], i, (kyureki_month + kyureki_day) % 6);
+    }
+}
+
+
+static PyObject *
+qreki_window_cache_info(PyObject *module, PyObject *args)
+{
+    PyObject *ret;
+
+    PyThread_acquire_lock(window_cache.lock, WAIT_LOCK);
+    ret = Py_BuildValue("nnnn", window_cache.hits, window_cache.misses,
+                        window_cache.maxsize, window_cache.size);
+    PyThread_release_lock(window_cache.lock);
+
+    return ret;
+}
+
+
+static PyObject *
+qreki_window_cache_clear(PyObject *module, PyObject *args)
+{
+    PyThread_acquire_lock(window_cache.lock, WAIT_LOCK);
+    window_cache.size = 0;
+    window_cache.hits = 0;
+    window_cache.misses = 0;
+    PyThread_release_lock(window_cache.lock);
+
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+qreki_set_window_cache_size(PyObject *module, PyObject *args)
+{
+    Py_ssize_t maxsize;
+
+    if (!PyArg_ParseTuple(args, "n", &maxsize)) { return NULL; }
+    if (maxsize < 0) {
+        PyErr_SetString(PyExc_ValueError, "maxsize must be non-negative");
+        return NULL;
+    }
+    if (window_cache_resize(maxsize)) { return NULL; }
+
+    Py_RETURN_NONE;
+}
+
+
+/* JST 以外の朔日テーブルの (タイムゾーンのタプル, 最大数) */
+static PyObject *
+qreki_tz_tables_info(PyObject *module, PyObject *args)
+{
+    PyObject *tzs, *tz;
+    int i;
+
+    tzs = PyTuple_New(tz_tables_size);
+    if (!tzs) { return NULL; }
+    for (i = 0; i < tz_tables_size; i++) {
+        tz = PyFloat_FromDouble(tz_tables[i]->tz);
+        if (!tz) {
+            Py_DECREF(tzs);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(tzs, i, tz);
+    }
+
+    return Py_BuildValue("Ni", tzs, tz_tables_max);
+}
+
+
+static PyObject *
+qreki_tz_tables_clear(PyObject *module, PyObject *args)
+{
+    if (month_tables_busy()) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "cannot clear tables while from_ordinals is running");
+        return NULL;
+    }
+    tz_tables_free(0);
+
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+qreki_set_tz_tables_size(PyObject *module, PyObject *args)
+{
+    int maxsize;
+
+    if (!PyArg_ParseTuple(args, "i", &maxsize)) { return NULL; }
+    if (maxsize < 0 || maxsize > TZ_TABLES_LIMIT) {
+        PyErr_Format(PyExc_ValueError,
+                     "maxsize must be in 0..%d", TZ_TABLES_LIMIT);
+        return NULL;
+    }
+    if (maxsize < tz_tables_size && month_tables_busy()) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "cannot shrink tables while from_ordinals is running");
+        return NULL;
+    }
+    tz_tables_max = maxsize;
+    tz_tables_free(maxsize);
+
+    Py_RETURN_NONE;
+}
+
+
+/* type がこのモジュールの Kyureki そのものならばモジュールの状態を返す。
+ * サブクラスやモジュールの破棄後は NULL */
+static qreki_state *
+free_list_state(PyTypeObject *type)
+{
+    PyObject *module;
+    qreki_state *state;
+
+    if (!(type->tp_flags & Py_TPFLAGS_HEAPTYPE)) { return NULL; }
+    module = ((PyHeapTypeObject *)type)->ht_module;
+    if (!module || PyModule_GetDef(module) != &qreki_module) { return NULL; }
+    state = PyModule_GetState(module);
+    if (state->kyureki_type != (PyObject *)type) { return NULL; }
+    return state;
+}
+
+
+static void
+free_list_trim(qreki_state *state, Py_ssize_t maxsize)
+{
+    KyurekiObject *self;
+
+    while (state->free_count > maxsize) {
+        self = state->free_list;
+        state->free_list = (KyurekiObject *)Py_TYPE(self);
+        state->free_count--;
+        PyObject_Del(self);
+    }
+}
+
+
+static PyObject *
+qreki_free_list_info(PyObject *module, PyObject *args)
+{
+    qreki_state *state = PyModule_GetState(module);
+
+    return Py_BuildValue("nn", state->free_count, state->free_max);
+}
+
+
+static PyObject *
+qreki_free_list_clear(PyObject *module, PyObject *args)
+{
+    free_list_trim(PyModule_GetState(module), 0);
+
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+qreki_set_free_list_size(PyObject *module, PyObject *args)
+{
+    qreki_state *state = PyModule_GetState(module);
+    Py_ssize_t maxsize;
+
+    if (!PyArg_ParseTuple(args, "n", &maxsize)) { return NULL; }
+    if (maxsize < 0) {
+        PyErr_SetString(PyExc_ValueError, "maxsize must be non-negative");
+        return NULL;
+    }
+    free_list_trim(state, maxsize);
+    state->free_max = maxsize;
+
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+qreki_thread_pool_info(PyObject *module, PyObject *args)
+{
+    qreki_state *state = PyModule_GetState(module);
+
+    return Py_BuildValue("ii", state->workers_size, state->workers_max);
+}
+
+
+static PyObject *
+qreki_thread_pool_clear(PyObject *module, PyObject *args)
+{
+    qreki_state *state = PyModule_GetState(module);
+
+    if (state->workers_busy) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "cannot stop threads while from_ordinals is running");
+        return NULL;
+    }
+    thread_pool_trim(state, 0);
+
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+qreki_set_thread_pool_size(PyObject *module, PyObject *args)
+{
+    qreki_state *state = PyModule_GetState(module);
+    int maxsize;
+
+    if (!PyArg_ParseTuple(args, "i", &maxsize)) { return NULL; }
+    if (maxsize < 0) {
+        PyErr_SetString(PyExc_ValueError, "maxsize must be non-negative");
+        return NULL;
+    }
+    if (maxsize < state->workers_size && state->workers_busy) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "cannot stop threads while from_ordinals is running");
+        return NULL;
+    }
+    thread_pool_trim(state, maxsize);
+    state->workers_max = maxsize;
+
+    Py_RETURN_NONE;
+}
+
+
+#ifdef QREKI_STATS
+static void
+stats_add(long long *counter, long long n)
+{
+    /* from_ordinals のスレッドからも数える */
+#if defined(__GNUC__)
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+#elif defined(_MSC_VER)
+    InterlockedExchangeAdd64(counter, n);
+#else
+    *counter += n;
+#endif
+}
+
+
+static long long
+stats_clock(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+
+    if (!frequency.QuadPart) { QueryPerformanceFrequency(&frequency); }
+    QueryPerformanceCounter(&counter);
+    return (long long)((double)counter.QuadPart * 1e9 / frequency.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+}
+#endif
+
+
+/* QREKI_STATS なしでビルドしたときは None */
+static PyObject *
+qreki_stats(PyObject *module, PyObject *args)
+{
+#ifdef QREKI_STATS
+    PyObject *ret, *value;
+
+    ret = PyDict_New();
+    if (!ret) { return NULL; }
+#define STATS_ITEM(name) \
+    value = PyLong_FromLongLong(stats_counters.name); \
+    if (!value || PyDict_SetItemString(ret, #name, value)) { goto error; } \
+    Py_DECREF(value);
+    STATS_FIELDS(STATS_ITEM)
+#undef STATS_ITEM
+
+    PyThread_acquire_lock(window_cache.lock, WAIT_LOCK);
+    value = Py_BuildValue("nn", window_cache.hits, window_cache.misses);
+    PyThread_release_lock(window_cache.lock);
+    if (!value || PyDict_SetItemString(ret, "window_cache_hits", PyTuple_GET_ITEM(value, 0)) ||
+            PyDict_SetItemString(ret, "window_cache_misses", PyTuple_GET_ITEM(value, 1))) {
+        goto error;
+    }
+    Py_DECREF(value);
+
+    return ret;
+error:
+    Py_XDECREF(value);
+    Py_DECREF(ret);
+    return NULL;
+#else
+    Py_RETURN_NONE;
+#endif
+}
+
+
+static PyObject *
+qreki_reset_stats(PyObject *module, PyObject *args)
+{
+#ifdef QREKI_STATS
+    memset(&stats_counters, 0, sizeof(stats_counters));
+    PyThread_acquire_lock(window_cache.lock, WAIT_LOCK);
+    window_cache.hits = 0;
+    window_cache.misses = 0;
+    PyThread_release_lock(window_cache.lock);
+#endif
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+qreki_series_kernel(PyObject *module, PyObject *args)
+{
+    return PyUnicode_FromString(series_kernel_name);
+}
+
+
+static PyObject *
+qreki_set_series_kernel(PyObject *module, PyObject *args)
+{
+    const char *name;
+    const SeriesKernel *kernel;
+
+    if (!PyArg_ParseTuple(args, "s", &name)) { return NULL; }
+
+    for (kernel = series_kernels; kernel->name; kernel++) {
+        if (strcmp(kernel->name, name) == 0) { break; }
+    }
+    if (!kernel->name || !series_kernel_supported(name)) {
+        PyErr_Format(PyExc_ValueError, "series kernel '%s' is not available", name);
+        return NULL;
+    }
+    if (month_tables_busy()) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "cannot change the series kernel while from_ordinals is running");
+        return NULL;
+    }
+    series_sum = kernel->sum;
+    series_kernel_name = kernel->name;
+
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+qreki_solver(PyObject *module, PyObject *args)
+{
+    return PyUnicode_FromString(solver_names[solver]);
+}
+
+
+/* 求め方を切り替え、それまでに求めた朔日テーブルとキャッシュを捨てる */
+static PyObject *
+qreki_set_solver(PyObject *module, PyObject *args)
+{
+    const char *name;
+    int i;
+
+    if (!PyArg_ParseTuple(args, "s", &name)) { return NULL; }
+
+    for (i = 0; solver_names[i]; i++) {
+        if (strcmp(solver_names[i], name) == 0) { break; }
+    }
+    if (!solver_names[i]) {
+        PyErr_Format(PyExc_ValueError, "unknown solver '%s'", name);
+        return NULL;
+    }
+
+    if (solver != i) {
+        if (solver_tables_reset()) { return NULL; }
+        solver = i;
+    }
+
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+qreki_solver_precision(PyObject *module, PyObject *args)
+{
+    return PyUnicode_FromString(precision_names[solver_precision]);
+}
+
+
+/* 反復の打ち切り方を切り替える。 set_solver と同じく朔日テーブルとキャッシュを捨てる */
+static PyObject *
+qreki_set_solver_precision(PyObject *module, PyObject *args)
+{
+    const char *name;
+    int i;
+
+    if (!PyArg_ParseTuple(args, "s", &name)) { return NULL; }
+
+    for (i = 0; precision_names[i]; i++) {
+        if (strcmp(precision_names[i], name) == 0) { break; }
+    }
+    if (!precision_names[i]) {
+        PyErr_Format(PyExc_ValueError, "unknown precision '%s'", name);
+        return NULL;
+    }
+
+    if (solver_precision != i) {
+        if (solver_tables_reset()) { return NULL; }
+        solver_precision = i;
+    }
+
+    Py_RETURN_NONE;
+}
+
+
+/* それまでに求めた朔日テーブルとキャッシュを捨てる */
+static int
+solver_tables_reset(void)
+{
+    if (month_tables_busy()) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "cannot change the solver while from_ordinals is running");
+        return -1;
+    }
+    month_table_clear(&jst_table);
+    tz_tables_free(0);
+    PyThread_acquire_lock(window_cache.lock, WAIT_LOCK);
+    window_cache.size = 0;
+    PyThread_release_lock(window_cache.lock);
+    return 0;
+}
+
+/* 整数型の 1 次元バッファを得る
+ * bytes_as_int が真ならば、 bytes のような 1 バイトのバッファは
+ * native int の並びとみなす */
+static int
+int_buffer_get(PyObject *obj, IntBuffer *buffer, int bytes_as_int)
+{
+    const char *format;
+
+    if (PyObject_GetBuffer(obj, &buffer->view,
+                           PyBUF_FORMAT | PyBUF_C_CONTIGUOUS)) { return -1; }
+
+    format = buffer->view.format ? buffer->view.format : "B";
+    if (*format == '@') { format++; }
+    if (format[0] == '\0' || format[1] != '\0' ||
+        !strchr("bBhHiIlLqQnNc", format[0]) ||
+        buffer->view.ndim > 1) {
+        PyErr_Format(PyExc_TypeError,
+                     "a 1-dimensional buffer of integers is required, not '%s'",
+                     buffer->view.format);
+        PyBuffer_Release(&buffer->view);
+        return -1;
+    }
+
+    buffer->format = format[0];
+    if (bytes_as_int && buffer->view.itemsize == 1) {
+        if (buffer->view.len % sizeof(int)) {
+            PyErr_SetString(PyExc_ValueError,
+                            "byte buffer length must be a multiple of sizeof(int)");
+            PyBuffer_Release(&buffer->view);
+            return -1;
+        }
+        buffer->format = 'i';
+        buffer->view.itemsize = sizeof(int);
+    }
+
+    return 0;
+}
+
+
+/* 出力先のバッファを得る。 *obj が NULL ならば新しい array を作る */
+static int
+int_buffer_output(qreki_state *state, PyObject **obj, IntBuffer *buffer,
+                  Py_ssize_t n, int size, const char *name)
+{
+    PyObject *template = size >= 4 ? state->array_i :
+                         size >= 2 ? state->array_h : state->array_b;
+    const char *format;
+
+    if (!*obj) {
+        *obj = PySequence_Repeat(template, n);
+        if (!*obj) { return -1; }
+    }
+
+    if (PyObject_GetBuffer(*obj, &buffer->view,
+                           PyBUF_FORMAT | PyBUF_C_CONTIGUOUS | PyBUF_WRITABLE)) {
+        return -1;
+    }
+
+    format = buffer->view.format ? buffer->view.format : "B";
+    if (*format == '@') { format++; }
+    if (format[0] == '\0' || format[1] != '\0' ||
+        !strchr("bBhHiIlLqQnN", format[0]) ||
+        buffer->view.ndim > 1 || buffer->view.itemsize < size) {
+        PyErr_Format(PyExc_TypeError,
+                     "%s must be a 1-dimensional buffer of %d-byte or wider integers",
+                     name, size);
+        PyBuffer_Release(&buffer->view);
+        return -1;
+    }
+    if (buffer->view.len / buffer->view.itemsize < n) {
+        PyErr_Format(PyExc_ValueError, "%s is shorter than the input", name);
+        PyBuffer_Release(&buffer->view);
+        return -1;
+    }
+    buffer->format = format[0];
+
+    return 0;
+}
+
+
+/* *obj が NULL ならば array('d') を作る */
+static int
+double_buffer_output(qreki_state *state, PyObject **obj, Py_buffer *view,
+                     Py_ssize_t n, const char *name)
+{
+    const char *format;
+
+    if (!*obj) {
+        *obj = PySequence_Repeat(state->array_d, n);
+        if (!*obj) { return -1; }
+    }
+
+    if (PyObject_GetBuffer(*obj, view,
+                           PyBUF_FORMAT | PyBUF_C_CONTIGUOUS | PyBUF_WRITABLE)) {
+        return -1;
+    }
+
+    format = view->format ? view->format : "B";
+    if (*format == '@') { format++; }
+    if (strcmp(format, "d") || view->ndim > 1) {
+        PyErr_Format(PyExc_TypeError, "%s must be a 1-dimensional buffer of doubles",
+                     name);
+        PyBuffer_Release(view);
+        return -1;
+    }
+    if (view->len / view->itemsize < n) {
+        PyErr_Format(PyExc_ValueError, "%s is shorter than the input", name);
+        PyBuffer_Release(view);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static long long
+int_buffer_load(const IntBuffer *buffer, Py_ssize_t i)
+{
+    const char *p = (const char *)buffer->view.buf;
+
+    switch (buffer->format) {
+        case 'b': return ((const signed char *)p)[i];
+        case 'B': case 'c': return ((const unsigned char *)p)[i];
+        case 'h': return ((const short *)p)[i];
+        case 'H': return ((const unsigned short *)p)[i];
+        case 'i': return ((const int *)p)[i];
+        case 'I': return ((const unsigned int *)p)[i];
+        case 'l': return ((const long *)p)[i];
+        case 'L': return (long long)((const unsigned long *)p)[i];
+        case 'q': return ((const long long *)p)[i];
+        case 'Q': return (long long)((const unsigned long long *)p)[i];
+        case 'n': return ((const Py_ssize_t *)p)[i];
+        case 'N': return (long long)((const size_t *)p)[i];
+    }
+    return 0;
+}
+
+
+static void
+int_buffer_store(IntBuffer *buffer, Py_ssize_t i, long long value)
+{
+    char *p = (char *)buffer->view.buf;
+
+    switch (buffer->format) {
+        case 'b': ((signed char *)p)[i] = (signed char)value; break;
+        case 'B': ((unsigned char *)p)[i] = (unsigned char)value; break;
+        case 'h': ((short *)p)[i] = (short)value; break;
+        case 'H': ((unsigned short *)p)[i] = (unsigned short)value; break;
+        case 'i': ((int *)p)[i] = (int)value; break;
+        case 'I': ((unsigned int *)p)[i] = (unsigned int)value; break;
+        case 'l': ((long *)p)[i] = (long)value; break;
+        case 'L': ((unsigned long *)p)[i] = (unsigned long)value; break;
+        case 'q': ((long long *)p)[i] = value; break;
+        case 'Q': ((unsigned long long *)p)[i] = (unsigned long long)value; break;
+        case 'n': ((Py_ssize_t *)p)[i] = (Py_ssize_t)value; break;
+        case 'N': ((size_t *)p)[i] = (size_t)value; break;
+    }
+}
+
+
+static PyMethodDef module_methods[] = {
+    {"from_ordinals", (PyCFunction)qreki_from_ordinals, METH_VARARGS|METH_KEYWORDS, NULL},
+    {"to_ordinals", (PyCFunction)qreki_to_ordinals, METH_VARARGS|METH_KEYWORDS, NULL},
+    {"rokuyou_from_date", (PyCFunction)(void (*)(void))qreki_rokuyou_from_date, METH_FASTCALL|METH_KEYWORDS, NULL},
+    {"rokuyou_from_ordinal", (PyCFunction)(void (*)(void))qreki_rokuyou_from_ordinal, METH_FASTCALL|METH_KEYWORDS, NULL},
+    {"rokuyou_from_ordinals", (PyCFunction)qreki_rokuyou_from_ordinals, METH_VARARGS|METH_KEYWORDS, NULL},
+    {"sekki", (PyCFunction)qreki_sekki, METH_VARARGS|METH_KEYWORDS, NULL},
+    {"sekki_of_year", (PyCFunction)qreki_sekki_of_year, METH_VARARGS|METH_KEYWORDS, NULL},
+    {"sekki_from_ordinals", (PyCFunction)qreki_sekki_from_ordinals, METH_VARARGS|METH_KEYWORDS, NULL},
+    {"moon_age", (PyCFunction)(void (*)(void))qreki_moon_age, METH_FASTCALL|METH_KEYWORDS, NULL},
+    {"moon_age_from_ordinals", (PyCFunction)qreki_moon_age_from_ordinals, METH_VARARGS|METH_KEYWORDS, NULL},
+    {"year_calendar", (PyCFunction)qreki_year_calendar, METH_VARARGS|METH_KEYWORDS, NULL},
+    {"find_dates", (PyCFunction)qreki_find_dates, METH_VARARGS|METH_KEYWORDS, NULL},
+    {"find_ordinals", (PyCFunction)qreki_find_ordinals, METH_VARARGS|METH_KEYWORDS, NULL},
+    {"format_kyureki", (PyCFunction)qreki_format_kyureki, METH_VARARGS|METH_KEYWORDS, NULL},
+    {"window_cache_info", (PyCFunction)qreki_window_cache_info, METH_NOARGS, NULL},
+    {"window_cache_clear", (PyCFunction)qreki_window_cache_clear, METH_NOARGS, NULL},
+    {"set_window_cache_size", (PyCFunction)qreki_set_window_cache_size, METH_VARARGS, NULL},
+    {"tz_tables_info", (PyCFunction)qreki_tz_tables_info, METH_NOARGS, NULL},
+    {"tz_tables_clear", (PyCFunction)qreki_tz_tables_clear, METH_NOARGS, NULL},
+    {"set_tz_tables_size", (PyCFunction)qreki_set_tz_tables_size, METH_VARARGS, NULL},
+    {"free_list_info", (PyCFunction)qreki_free_list_info, METH_NOARGS, NULL},
+    {"free_list_clear", (PyCFunction)qreki_free_list_clear, METH_NOARGS, NULL},
+    {"set_free_list_size", (PyCFunction)qreki_set_free_list_size, METH_VARARGS, NULL},
+    {"thread_pool_info", (PyCFunction)qreki_thread_pool_info, METH_NOARGS, NULL},
+    {"thread_pool_clear", (PyCFunction)qreki_thread_pool_clear, METH_NOARGS, NULL},
+    {"set_thread_pool_size", (PyCFunction)qreki_set_thread_pool_size, METH_VARARGS, NULL},
+    {"stats", (PyCFunction)qreki_stats, METH_NOARGS, NULL},
+    {"reset_stats", (PyCFunction)qreki_reset_stats, METH_NOARGS, NULL},
+    {"series_kernel", (PyCFunction)qreki_series_kernel, METH_NOARGS, NULL},
+    {"set_series_kernel", (PyCFunction)qreki_set_series_kernel, METH_VARARGS, NULL},
+    {"dump_table", (PyCFunction)qreki_dump_table, METH_VARARGS|METH_KEYWORDS, NULL},
+    {"load_table", (PyCFunction)qreki_load_table, METH_VARARGS, NULL},
+    {"solver", (PyCFunction)qreki_solver, METH_NOARGS, NULL},
+    {"set_solver", (PyCFunction)qreki_set_solver, METH_VARARGS, NULL},
+    {"solver_precision", (PyCFunction)qreki_solver_precision, METH_NOARGS, NULL},
+    {"set_solver_precision", (PyCFunction)qreki_set_solver_precision, METH_VARARGS, NULL},
+    {NULL, NULL, 0, NULL} /* Sentinel */
+};
+
+
+static double
+normalize_angle(double angle)
+{
+
+    angle = fmod(angle, 360.0);
+    if (angle < 0.0) {
+        angle += 360.0;
+    }
+
+    return angle;
+}
+
+
+static int
+kyureki_from_jd(int tm0, double tz, int *kyureki_year, int *kyureki_month,
+                int *kyureki_leap, int *kyureki_day)
+{
+    MonthTable *table;
+
+    if (tm0 >= TABLE_FIRST_JD && tm0 <= TABLE_LAST_JD &&
+            (table = month_table_for(tz))) {
+        return month_table_lookup(table, tm0, kyureki_year, kyureki_month,
+                                  kyureki_leap, kyureki_day);
+    }
+
+    return kyureki_from_window(tm0, tz, kyureki_year, kyureki_month,
+                               kyureki_leap, kyureki_day);
+}
+
+
+/* GIL を持たずに呼べる kyureki_from_jd
+ * table の区間は作らず、まだない区間の日は朔日行列から求める */
+static int
+kyureki_from_jd_nogil(int tm0, double tz, const MonthTable *table,
+                      int *kyureki_year, int *kyureki_month,
+                      int *kyureki_leap, int *kyureki_day)
+{
+    const MonthEntry *entry;
+    int end;
+
+    if (table && tm0 >= TABLE_FIRST_JD && tm0 <= TABLE_LAST_JD &&
+            (entry = month_table_peek(table, tm0, &end))) {
+        STATS_ADD(table_lookups, 1);
+        *kyureki_month = entry->month;
+        *kyureki_leap = entry->leap;
+        *kyureki_day = tm0 - entry->start + entry->day0 + 1;
+        *kyureki_year = kyureki_year_from_jd(tm0, entry->month);
+        return 0;
+    }
+
+    return kyureki_from_window(tm0, tz, kyureki_year, kyureki_month,
+                               kyureki_leap, kyureki_day);
+}
+
+
+/* 朔日行列 (window_cache) から求める。 GIL は不要 */
+static int
+kyureki_from_window(int tm0, double tz, int *kyureki_year, int *kyureki_month,
+                    int *kyureki_leap, int *kyureki_day)
+{
+    KyurekiWindow window;
+    int i;
+
+    if (!window_cache_get(tm0, tz, &window)) {
+        if (kyureki_window_from_jd(tm0, tz, &window) == -1)
+            return -1;
+        if (window_cache_put(tm0, tz, &window) == -1)
+            return -1;
+    }
+
+    i = kyureki_window_index(&window, tm0);
+    *kyureki_month = window.m[i][0];
+    *kyureki_leap = window.m[i][1];
+    *kyureki_day = tm0 - window.m[i][2] + 1;
+    *kyureki_year = kyureki_year_from_jd(tm0, *kyureki_month);
+
+    return 0;
+}
+
+
+/* 旧暦の日付から新暦のユリウス日を得る
+ * 朔日テーブルを引けるときは、その月の項目の朔日から日数で求める。
+ * テーブルのない tz では、旧暦は新暦に対して単調に増えるので、見積もった範囲を
+ * 二分探索する。月の切り替わりで日が飛ぶことがあるため、月初からの日数では求めない */
+static int
+kyureki_to_jd(int kyureki_year, int kyureki_month, int kyureki_leap,
+              int kyureki_day, double tz, int *tm0)
+{
+    long long target, key;
+    int y = kyureki_year - 1;
+    int lo, hi, mid, error, i;
+    MonthTable *table;
+
+    if (kyureki_month < 1 || kyureki_month > 12 || kyureki_leap < 0 ||
+            kyureki_leap > 1) {
+        return CONVERT_MONTH;
+    }
+    if (kyureki_day < 1 || kyureki_day > 30) { return CONVERT_DAY; }
+    target = KYUREKI_KEY(kyureki_year, kyureki_month, kyureki_leap, kyureki_day);
+
+    /* 平均の朔望月で見積もった日 */
+    lo = y * 365 + y / 4 - y / 100 + y / 400 + 1 + 1721424 + 35
+         + (int)((kyureki_month - 1 + kyureki_leap * 0.5) * 29.530589)
+         + kyureki_day - 1;
+    if ((table = month_table_for(tz))) {
+        error = kyureki_to_jd_table(table, kyureki_year, kyureki_month,
+                                    kyureki_leap, kyureki_day, lo, tm0);
+        if (error != -1) { return error; }
+    }
+
+    /* 見積もった日から、ずれた月数と日数だけ寄せる。当たらなければ二分探索する */
+    for (i = 0; i < 4 && lo >= TABLE_FIRST_JD && lo <= TABLE_LAST_JD; i++) {
+        if ((error = kyureki_key_from_jd(lo, tz, &key))) { return error; }
+        if (key == target) {
+            *tm0 = lo;
+            return 0;
+        }
+        lo += (int)floor(((double)((target >> 16) - (key >> 16)) * 12.0 +
+                          (double)(((target >> 8) & 0xFF) - ((key >> 8) & 0xFF)) +
+                          (double)(((target >> 7) & 1) - ((key >> 7) & 1)) * 0.5) *
+                         29.530589 + 0.5) +
+              (int)(target & 0x7F) - (int)(key & 0x7F);
+    }
+
+    /* 旧暦の正月はおおむね新暦の 1 月下旬から 2 月中旬 */
+    lo = y * 365 + y / 4 - y / 100 + y / 400 + 1 + 1721424
+         + (int)((kyureki_month - 1) * 29.530589) - 30;
+    hi = lo + 150;
+
+    if (lo < TABLE_FIRST_JD) { lo = TABLE_FIRST_JD; }
+    for (;;) {
+        if (lo > TABLE_LAST_JD) { return CONVERT_RANGE; }
+        if ((error = kyureki_key_from_jd(lo, tz, &key))) { return error; }
+        if (key < target) { break; }
+        if (key == target) {
+            *tm0 = lo;
+            return 0;
+        }
+        if (lo == TABLE_FIRST_JD) { return CONVERT_RANGE; }
+        lo = lo - 64 < TABLE_FIRST_JD ? TABLE_FIRST_JD : lo - 64;
+    }
+    if (hi > TABLE_LAST_JD) { hi = TABLE_LAST_JD; }
+    for (;;) {
+        if (hi < lo) { hi = lo; }
+        if ((error = kyureki_key_from_jd(hi, tz, &key))) { return error; }
+        if (key >= target) { break; }
+        if (hi == TABLE_LAST_JD) { return CONVERT_RANGE; }
+        hi = hi + 64 > TABLE_LAST_JD ? TABLE_LAST_JD : hi + 64;
+    }
+
+    /* key(lo) < target <= key(hi) */
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if ((error = kyureki_key_from_jd(mid, tz, &key))) { return error; }
+        if (key < target) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if ((error = kyureki_key_from_jd(hi, tz, &key))) { return error; }
+    if (key == target) {
+        *tm0 = hi;
+        return 0;
+    }
+    /* 前後の日が同じ月ならば、その月にない日を指定している */
+    if (key >> 7 == target >> 7) { return CONVERT_DAY; }
+    if ((error = kyureki_key_from_jd(lo, tz, &key))) { return error; }
+    return key >> 7 == target >> 7 ? CONVERT_DAY : CONVERT_MONTH;
+}
+
+
+/* 朔日テーブルから旧暦の日付のユリウス日を得る
+ * estimate を含む月から目的の月まで項目をたどり、その月の朔日からの日数で求める。
+ * 月の途中で年が変わるなど、テーブルの月で決められないときは -1 を返す */
+static int
+kyureki_to_jd_table(MonthTable *table, int kyureki_year, int kyureki_month,
+                    int kyureki_leap, int kyureki_day, int estimate, int *tm0)
+{
+    long long target = KYUREKI_KEY(kyureki_year, kyureki_month, kyureki_leap, 0) >> 7;
+    long long key;
+    const MonthEntry *entry;
+    MonthEntry first;
+    TableCursor cursor;
+    MonthSpan span;
+    int step = 0, error, t;
+
+    if (estimate < TABLE_FIRST_JD) { estimate = TABLE_FIRST_JD; }
+    if (estimate > TABLE_LAST_JD) { estimate = TABLE_LAST_JD; }
+    if (!table_cursor_find(&cursor, table, estimate)) { return CONVERT_SOLVER; }
+    if ((error = table_cursor_month_first(&cursor))) { return error; }
+
+    for (;;) {
+        entry = TABLE_CURSOR_ENTRY(&cursor);
+        key = KYUREKI_KEY(kyureki_year_from_jd(entry->start, entry->month),
+                          entry->month, entry->leap, 0) >> 7;
+        if (key == target) { break; }
+        if (key < target) {
+            /* 戻ってきて行き過ぎたならば、その月はない */
+            if (step < 0) { return CONVERT_MONTH; }
+            step = 1;
+            if ((error = table_cursor_month(&cursor, &span))) { return error; }
+        } else {
+            if (step > 0) { return CONVERT_MONTH; }
+            step = -1;
+            if (!table_cursor_step(&cursor, -1)) {
+                return PyErr_Occurred() ? CONVERT_SOLVER : CONVERT_RANGE;
+            }
+            if ((error = table_cursor_month_first(&cursor))) { return error; }
+        }
+    }
+
+    /* 月の先頭がテーブルの先頭で切れているときは day0 が 0 でない */
+    first = *entry;
+    error = table_cursor_month(&cursor, &span);
+    if (error && error != CONVERT_RANGE) { return error; }
+    t = first.start - first.day0 + kyureki_day - 1;
+    if (t < span.start) { return CONVERT_RANGE; }
+    if (t >= span.start + span.days) {
+        return error == CONVERT_RANGE ? CONVERT_RANGE : CONVERT_DAY;
+    }
+    if (kyureki_year_from_jd(t, kyureki_month) != kyureki_year) { return -1; }
+
+    *tm0 = t;
+    return 0;
+}
+
+
+/* 比較用に旧暦を 1 つの整数にまとめる */
+static int
+kyureki_key_from_jd(int tm0, double tz, long long *key)
+{
+    int kyureki_year, kyureki_month, kyureki_leap, kyureki_day;
+
+    if (kyureki_from_jd(tm0, tz, &kyureki_year, &kyureki_month, &kyureki_leap,
+                        &kyureki_day)) { return CONVERT_SOLVER; }
+    *key = KYUREKI_KEY(kyureki_year, kyureki_month, kyureki_leap, kyureki_day);
+
+    return 0;
+}
+
+
+static int
+kyureki_window_from_jd(int tm0, double tz, KyurekiWindow *window)
+{
+    double tm;
+    double chu[4][2];
+    double saku[5];
+    int (*m)[3] = window->m;
+    int leap;
+    int i;
+    /* 朔と中気は日付 ((int) したもの) しか使わないので、 adaptive ならば早めに打ち切る */
+    int adaptive = solver_precision == PRECISION_ADAPTIVE;
+    STATS_START(start);
+
+    STATS_ADD(window_builds, 1);
+    tm = (double)tm0;
+
+    before_nibun_from_jd(tm, tz, &chu[0][0], &chu[0][1], adaptive);
+    for (i=1; i < 4; i++) {
+        chuki_from_jd(chu[i-1][0] + 32.0, tz, &chu[i][0], &chu[i][1], adaptive);
+    }
+
+    if (saku_from_jd(chu[0][0], tz, &saku[0], adaptive) == -1)
+        return -1;
+
+    for (i=1; i < 5; i++) {
+        if (saku_from_jd(saku[i-1] + 30.0, tz, &saku[i], adaptive) == -1)
+            return -1;
+        if (abs((int)saku[i - 1] - (int)saku[i]) <= 26) {
+            STATS_ADD(saku_resolves, 1);
+            if (saku_from_jd(saku[i-1] + 35.0, tz, &saku[i], adaptive) == -1)
+                return -1;
+        }
+    }
+
+    if ((int)(saku[1]) <= (int)(chu[0][0])) {
+        STATS_ADD(window_shifts, 1);
+        for (i=0; i < 4; i++)
+            saku[i] = saku[i+1];
+        if (saku_from_jd(saku[3] + 35.0, tz, &saku[i], adaptive) == -1)
+            return -1;
+    }
+    else if((int)saku[0] > (int)chu[0][0]) {
+        STATS_ADD(window_shifts, 1);
+        for (i=4; i > 0; i--)
+            saku[i] = saku[i-1];
+        if (saku_from_jd(saku[0] - 27.0, tz, &saku[i], adaptive) == -1)
+            return -1;
+    }
+
+    leap = ((int)saku[4] <= (int)chu[3][0]) ? 1 : 0;
+
+    m[0][0] = (int)(chu[0][1] / 30.0) + 2;
+    m[0][1] = 0;
+    m[0][2] = (int)saku[0];
+
+    for (i=1; i < 5; i++) {
+        if (leap == 1 && i != 1) {
+            if ((int)chu[i-1][0] <= (int)saku[i-1] ||
+                (int)chu[i-1][0] >= (int)saku[i]) {
+                m[i-1][0] = m[i-2][0];
+                m[i-1][1] = 1;
+                m[i-1][2] = (int)saku[i-1];
+                leap = 0;
+            }
+        }
+        m[i][0] = m[i-1][0] + 1;
+        if (m[i][0] > 12) {
+            m[i][0] -= 12;
+        }
+        m[i][1] = 0;
+        m[i][2] = (int)saku[i];
+    }
+
+    window->nibun = chu[0][1];
+    window->prev_nibun = chu[0][0];
+    window->next_nibun = chu[3][0];
+
+    STATS_END(window_ns, start);
+    return 0;
+}
+
+
+/* 朔日行列のうち tm0 を含む月の添字を求める */
+static int
+kyureki_window_index(const KyurekiWindow *window, int tm0)
+{
+    int i;
+
+    for (i=0; i < 5; i++) {
+        if (tm0 < window->m[i][2]) {
+            break;
+        }
+        else if (tm0 == window->m[i][2]) {
+            return i;
+        }
+    }
+
+    /* pure python 版にあわせ、 m[0] より前ならば m[-1] を用いる */
+    return (i == 0) ? 4 : i - 1;
+}
+
+
+/* tm0 と同じ朔日行列が得られる最初の日を求める */
+static int
+kyureki_window_start(const KyurekiWindow *window, int tm0, double tz)
+{
+    int start;
+
+    start = (int)ceil(window->prev_nibun);
+    if (start > tm0) {
+        start = tm0;
+    }
+    while (start < tm0 && nibun_longitude_from_jd(start, tz) != window->nibun) {
+        start++;
+    }
+    while (nibun_longitude_from_jd(start - 1, tz) == window->nibun) {
+        start--;
+    }
+
+    return start;
+}
+
+
+/* tm0 と同じ朔日行列が得られる最後の日の翌日を求める */
+static int
+kyureki_window_end(const KyurekiWindow *window, int tm0, double tz)
+{
+    int end;
+
+    end = (int)ceil(window->next_nibun);
+    if (end <= tm0) {
+        end = tm0 + 1;
+    }
+    while (end - 1 > tm0 && nibun_longitude_from_jd(end - 1, tz) != window->nibun) {
+        end--;
+    }
+    while (nibun_longitude_from_jd(end, tz) == window->nibun) {
+        end++;
+    }
+
+    return end;
+}
+
+
+/* before_nibun_from_jd が tm0 に対して探す二分二至の黄経 */
+static double
+nibun_longitude_from_jd(int tm0, double tz)
+{
+    double tm1, tm2, t, rm_sun;
+
+    tm2 = modf((double)tm0, &tm1);
+    tm2 -= tz;
+
+    t = (tm2 + 0.5) / 36525.0 + (tm1 - 2451545.0) / 36525.0;
+    rm_sun = longitude_of_sun(t);
+
+    return rm_sun - fmod(rm_sun, 90.0);
+}
+
+
+static int
+kyureki_year_from_jd(int tm0, int kyureki_month)
+{
+    int shinreki_year, shinreki_month;
+
+    jd2yearmonth((double)tm0, &shinreki_year, &shinreki_month);
+
+    /* 旧暦月が10以上でかつ新暦月より大きい場合には、まだ年を越していない */
+    if (kyureki_month > 9 && kyureki_month > shinreki_month)
+        return shinreki_year - 1;
+    return shinreki_year;
+}
+
+static void
+chuki_from_jd(double tm, double tz, double *chuki, double *longitude,
+              int adaptive)
+{
+    int iterations;
+    STATS_START(start);
+
+    if (solver == SOLVER_NEWTON) {
+        iterations = term_from_jd_newton(tm, tz, 30.0, chuki, longitude, adaptive);
+    } else {
+        iterations = term_from_jd_fixed(tm, tz, 30.0, chuki, longitude, adaptive);
+    }
+
+    STATS_ADD(chuki_calls, 1);
+    STATS_ADD(chuki_iterations, iterations);
+    STATS_END(chuki_ns, start);
+}
+
+
+static void
+before_nibun_from_jd(double tm, double tz, double *nibun, double *longitude,
+                     int adaptive)
+{
+    int iterations;
+    STATS_START(start);
+
+    if (solver == SOLVER_NEWTON) {
+        iterations = term_from_jd_newton(tm, tz, 90.0, nibun, longitude, adaptive);
+    } else {
+        iterations = term_from_jd_fixed(tm, tz, 90.0, nibun, longitude, adaptive);
+    }
+
+    STATS_ADD(before_nibun_calls, 1);
+    STATS_ADD(before_nibun_iterations, iterations);
+    STATS_END(before_nibun_ns, start);
+}
+
+
+/* 直前の二十四節気 (黄経 15 度ごと) の時刻を求める */
+static void
+sekki_from_jd(double tm, double tz, double *sekki, double *longitude)
+{
+    int iterations;
+    STATS_START(start);
+
+    if (solver == SOLVER_NEWTON) {
+        iterations = term_from_jd_newton(tm, tz, 15.0, sekki, longitude, 0);
+    } else {
+        iterations = term_from_jd_fixed(tm, tz, 15.0, sekki, longitude, 0);
+    }
+
+    STATS_ADD(sekki_calls, 1);
+    STATS_ADD(sekki_iterations, iterations);
+    STATS_END(sekki_ns, start);
+}
+
+
+/* chuki_from_jd, before_nibun_from_jd を平均の角速度で補正して解く
+ * degree は求める黄経の刻み (節気は 15 、中気は 30 、二分二至は 90) 。反復の回数を返す */
+static int
+term_from_jd_fixed(double tm, double tz, double degree,
+                   double *term, double *longitude, int adaptive)
+{
+    double tm1, tm2, t;
+    double rm_sun, rm_sun0;
+    double delta_rm, delta_t1, delta_t2;
+    double prev_delta = 0.0;
+    int iterations = 0;
+
+    tm2 = modf(tm, &tm1);
+    tm2 -= tz;
+
+    t = (tm2 + 0.5) / 36525.0 + (tm1 - 2451545.0) / 36525.0;
+    rm_sun = longitude_of_sun(t);
+    rm_sun0 = rm_sun - fmod(rm_sun, degree);
+
+    delta_t1 = 0.0;
+    delta_t2 = 1.0;
+
+    while (fabs(delta_t1 + delta_t2) > 1.0 / 86400.0) {
+        iterations++;
+        t = (tm2 + 0.5) / 36525.0 + (tm1 - 2451545.0)/ 36525.0;
+        rm_sun = longitude_of_sun(t);
+
+        delta_rm = rm_sun - rm_sun0;
+        if (delta_rm > 180.0) {
+            delta_rm -= 360.0;
+        }
+        else if (delta_rm < -180.0) {
+            delta_rm += 360.0;
+        }
+
+        delta_t2 = modf(delta_rm * 365.2 / 360.0, &delta_t1);
+
+        tm1 -= delta_t1;
+        tm2 -= delta_t2;
+
+        if (tm2 < 0.0) {
+            tm2 += 1.0;
+            tm1 -= 1.0;
+        }
+
+        if (adaptive && day_settled(tm1 + tm2 + tz, delta_t1 + delta_t2, &prev_delta)) {
+            STATS_ADD(adaptive_stops, 1);
+            break;
+        }
+    }
+
+    *term = tm1 + tm2 + tz;
+    *longitude = rm_sun0;
+    return iterations;
+}
+
+
+static int
+saku_from_jd(double tm, double tz, double *saku, int adaptive)
+{
+    int ret;
+    STATS_START(start);
+
+    if (solver == SOLVER_NEWTON) {
+        ret = saku_from_jd_newton(tm, tz, saku, adaptive);
+    } else {
+        ret = saku_from_jd_fixed(tm, tz, saku, adaptive);
+    }
+
+    STATS_ADD(saku_calls, 1);
+    if (ret == -1) { STATS_ADD(saku_failures, 1); }
+    STATS_END(saku_ns, start);
+    return ret;
+}
+
+
+/* 補正量 delta で求めた推定値 tm の日付が、 exact で反復を続けても変わらないならば真
+ * 補正量が前回 (*prev_delta) の半分以下に縮んでいれば残りの誤差は delta より小さいので、
+ * 日付の境目から十分離れているかを見る。春分の近くの朔のように補正が振動する間は打ち切らない */
+static int
+day_settled(double tm, double delta, double *prev_delta)
+{
+    double frac = tm - floor(tm);
+    double bound = fabs(delta) + ADAPTIVE_MARGIN;
+    int shrinking = fabs(delta) <= 0.5 * fabs(*prev_delta);
+
+    *prev_delta = delta;
+    return shrinking && frac > bound && 1.0 - frac > bound;
+}
+
+
+static int
+saku_from_jd_fixed(double tm, double tz, double *saku, int adaptive)
+{
+    double tm1, tm2, t;
+    double rm_sun, rm_moon;
+    double delta_rm, delta_t1, delta_t2;
+    double prev_delta = 0.0;
+    int lc;
+
+    tm2 = modf(tm, &tm1);
+
+    tm2 -= tz;
+
+    delta_t1 = 0.0;
+    delta_t2 = 1.0;
+
+    for (lc = 1; lc < 30; lc++) {
+        STATS_ADD(saku_iterations, 1);
+        t = (tm2 + 0.5) / 36525.0 + (tm1 - 2451545.0)/ 36525.0;
+        rm_sun = longitude_of_sun(t);
+        rm_moon = longitude_of_moon(t);
+
+        delta_rm = rm_moon - rm_sun;
+        if (lc == 1 && delta_rm < 0.0) {
+            delta_rm = normalize_angle(delta_rm);
+        }
+        else if (rm_sun >= 0.0 && rm_sun <= 20.0 && rm_moon >= 300.0) {
+            delta_rm = normalize_angle(delta_rm);
+            delta_rm = 360.0 - delta_rm;
+        }
+        else if (fabs(delta_rm) > 40.0) {
+            delta_rm = normalize_angle(delta_rm);
+        }
+
+        delta_t2 = modf(delta_rm * 29.530589 / 360.0, &delta_t1);
+
+        tm1 -= delta_t1;
+        tm2 -= delta_t2;
+
+        if (tm2 < 0.0) {
+            tm2 += 1.0;
+            tm1 -= 1.0;
+        }
+
+        /* 春分の近く (rm_sun が 0 から 20) は補正の仕方が変わって反復が振動しうるので打ち切らない */
+        if (adaptive && day_settled(tm1 + tm2 + tz, delta_t1 + delta_t2, &prev_delta) &&
+                rm_sun > 21.0 && rm_sun < 359.0) {
+            STATS_ADD(adaptive_stops, 1);
+            break;
+        }
+
+        if (fabs(delta_t1 + delta_t2) > 1.0 / 86400.0) {
+            if (lc == 15) {
+                STATS_ADD(saku_restarts, 1);
+                tm1 = tm - 26.0;
+                tm2 = 0.0;
+            }
+        }
+        else {
+            break;
+        }
+    }
+
+    if (lc >= 30) {
+        return -1;
+    }
+
+    *saku = tm1 + tm2 + tz;
+    return 0;
+}
+
+
+/* chuki_from_jd, before_nibun_from_jd を黄経の時間微分で補正して解く
+ * degree は求める黄経の刻み (節気は 15 、中気は 30 、二分二至は 90) 。反復の回数を返す */
+static int
+term_from_jd_newton(double tm, double tz, double degree,
+                    double *term, double *longitude, int adaptive)
+{
+    double tm1, tm2, t;
+    double rm_sun, rm_sun0, rate;
+    double delta_rm, delta_t1, delta_t2;
+    double prev_delta = 0.0;
+    int iterations = 0;
+
+    tm2 = modf(tm, &tm1);
+    tm2 -= tz;
+
+    t = (tm2 + 0.5) / 36525.0 + (tm1 - 2451545.0) / 36525.0;
+    rm_sun = longitude_of_sun(t);
+    rm_sun0 = rm_sun - fmod(rm_sun, degree);
+
+    delta_t1 = 0.0;
+    delta_t2 = 1.0;
+
+    while (fabs(delta_t1 + delta_t2) > 1.0 / 86400.0) {
+        iterations++;
+        t = (tm2 + 0.5) / 36525.0 + (tm1 - 2451545.0)/ 36525.0;
+        rm_sun = longitude_of_sun_with_rate(t, &rate);
+
+        delta_rm = rm_sun - rm_sun0;
+        if (delta_rm > 180.0) {
+            delta_rm -= 360.0;
+        }
+        else if (delta_rm < -180.0) {
+            delta_rm += 360.0;
+        }
+
+        delta_t2 = modf(delta_rm / rate, &delta_t1);
+
+        tm1 -= delta_t1;
+        tm2 -= delta_t2;
+
+        if (tm2 < 0.0) {
+            tm2 += 1.0;
+            tm1 -= 1.0;
+        }
+
+        if (adaptive && day_settled(tm1 + tm2 + tz, delta_t1 + delta_t2, &prev_delta)) {
+            STATS_ADD(adaptive_stops, 1);
+            break;
+        }
+    }
+
+    *term = tm1 + tm2 + tz;
+    *longitude = rm_sun0;
+    return iterations;
+}
+
+
+/* saku_from_jd を月と太陽の黄経差の時間微分で補正して解く */
+static int
+saku_from_jd_newton(double tm, double tz, double *saku, int adaptive)
+{
+    double tm1, tm2, t;
+    double rm_sun, rm_moon, rate_sun, rate_moon;
+    double delta_rm, delta_t1, delta_t2;
+    double prev_delta = 0.0;
+    int lc;
+
+    tm2 = modf(tm, &tm1);
+
+    tm2 -= tz;
+
+    delta_t1 = 0.0;
+    delta_t2 = 1.0;
+
+    for (lc = 1; lc < 30; lc++) {
+        STATS_ADD(saku_iterations, 1);
+        t = (tm2 + 0.5) / 36525.0 + (tm1 - 2451545.0)/ 36525.0;
+        rm_sun = longitude_of_sun_with_rate(t, &rate_sun);
+        rm_moon = longitude_of_moon_with_rate(t, &rate_moon);
+
+        delta_rm = rm_moon - rm_sun;
+        if (lc == 1 && delta_rm < 0.0) {
+            delta_rm = normalize_angle(delta_rm);
+        }
+        else if (rm_sun >= 0.0 && rm_sun <= 20.0 && rm_moon >= 300.0) {
+            delta_rm = normalize_angle(delta_rm);
+            delta_rm = 360.0 - delta_rm;
+        }
+        else if (fabs(delta_rm) > 40.0) {
+            delta_rm = normalize_angle(delta_rm);
+        }
+
+        /* 大きく動かす最初の補正は平均の角速度で行い、引き込み範囲から外れないようにする */
+        if (lc == 1 || lc == 16) {
+            delta_t2 = modf(delta_rm * 29.530589 / 360.0, &delta_t1);
+        } else {
+            delta_t2 = modf(delta_rm / (rate_moon - rate_sun), &delta_t1);
+        }
+
+        tm1 -= delta_t1;
+        tm2 -= delta_t2;
+
+        if (tm2 < 0.0) {
+            tm2 += 1.0;
+            tm1 -= 1.0;
+        }
+
+        /* 春分の近く (rm_sun が 0 から 20) は補正の仕方が変わって反復が振動しうるので打ち切らない */
+        if (adaptive && day_settled(tm1 + tm2 + tz, delta_t1 + delta_t2, &prev_delta) &&
+                rm_sun > 21.0 && rm_sun < 359.0) {
+            STATS_ADD(adaptive_stops, 1);
+            break;
+        }
+
+        if (fabs(delta_t1 + delta_t2) > 1.0 / 86400.0) {
+            if (lc == 15) {
+                STATS_ADD(saku_restarts, 1);
+                tm1 = tm - 26.0;
+                tm2 = 0.0;
+            }
+        }
+        else {
+            break;
+        }
+    }
+
+    if (lc >= 30) {
+        return -1;
+    }
+
+    *saku = tm1 + tm2 + tz;
+    return 0;
+}
+
+
+static double
+longitude_of_sun(double t)
+{
+    double ang, th;
+
+    STATS_ADD(sun_evals, 1);
+    th = series_sum(&sun_series, t, NULL);
+
+    ang = normalize_angle(35999.05 * t + 267.52);
+    th -= 0.0048 * t * cos(degToRad * ang);
+    th += 1.9147 * cos(degToRad * ang);
+
+    ang = normalize_angle(36000.7695 * t);
+    ang = normalize_angle(ang + 280.4659);
+    th = normalize_angle(th + ang);
+
+    return th;
+}
+
+
+static double
+longitude_of_moon(double t)
+{
+    double ang, th;
+
+    STATS_ADD(moon_evals, 1);
+    th = series_sum(&moon_series, t, NULL);
+
+    ang = normalize_angle(481267.8809 * t);
+    ang = normalize_angle(ang + 218.3162);
+    th = normalize_angle(th + ang);
+
+    return th;
+}
+
+
+
+/* 太陽の黄経と、その時間微分 (度 / 日) を求める */
+static double
+longitude_of_sun_with_rate(double t, double *rate)
+{
+    double ang, th, dth;
+
+    STATS_ADD(sun_evals, 1);
+    th = series_sum(&sun_series, t, &dth);
+    dth *= -degToRad;
+
+    ang = normalize_angle(35999.05 * t + 267.52);
+    th -= 0.0048 * t * cos(degToRad * ang);
+    th += 1.9147 * cos(degToRad * ang);
+    dth -= 0.0048 * cos(degToRad * ang);
+    dth -= (1.9147 - 0.0048 * t) * degToRad * 35999.05 * sin(degToRad * ang);
+
+    ang = normalize_angle(36000.7695 * t);
+    ang = normalize_angle(ang + 280.4659);
+    th = normalize_angle(th + ang);
+    dth += 36000.7695;
+
+    *rate = dth / 36525.0;
+    return th;
+}
+
+
+/* 月の黄経と、その時間微分 (度 / 日) を求める */
+static double
+longitude_of_moon_with_rate(double t, double *rate)
+{
+    double ang, th, dth;
+
+    STATS_ADD(moon_evals, 1);
+    th = series_sum(&moon_series, t, &dth);
+    dth *= -degToRad;
+
+    ang = normalize_angle(481267.8809 * t);
+    ang = normalize_angle(ang + 218.3162);
+    th = normalize_angle(th + ang);
+    dth += 481267.8809;
+
+    *rate = dth / 36525.0;
+    return th;
+}
+
+
+static void
+jd2yearmonth(double jd, int *year, int *month)
+{
+    double f0, f1, f2, f3, f4, f5, f6;
+    int i1, i3, i5, i6;
+
+    f0 = floor(jd + 68570.0);
+    f1 = floor(f0 / 36524.25);
+    f2 = f0 - floor(36524.25 * f1 + 0.75);
+    f3 = floor((f2 + 1.0) / 365.2425);
+    f4 = f2 - floor(365.25 * f3) + 31.0;
+    f5 = floor(f4 / 30.59);
+    f6 = floor(f5 / 11.0);
+
+    i1 = (int)f1;
+    i3 = (int)f3;
+    i5 = (int)f5;
+    i6 = (int)f6;
+
+    *year = 100 * (i1 - 49) + i3 + i6;
+    *month = i5 - 12 * i6 + 2;
+
+    return;
+}
+
+
+/* キャッシュにあれば *window に写して 1 を返す */
+static int
+window_cache_get(int tm0, double tz, KyurekiWindow *window)
+{
+    WindowCacheEntry *entries = window_cache.entries;
+    WindowCacheEntry hit;
+    Py_ssize_t i;
+    int found = 0;
+
+    if (!window_cache.lock) { return 0; }
+
+    PyThread_acquire_lock(window_cache.lock, WAIT_LOCK);
+    for (i = 0; i < window_cache.size; i++) {
+        if (entries[i].tz == tz && entries[i].start <= tm0 && tm0 < entries[i].end) {
+            hit = entries[i];
+            memmove(&entries[1], &entries[0], i * sizeof(WindowCacheEntry));
+            entries[0] = hit;
+            *window = hit.window;
+            found = 1;
+            break;
+        }
+    }
+    if (found) {
+        window_cache.hits++;
+    } else {
+        window_cache.misses++;
+    }
+    PyThread_release_lock(window_cache.lock);
+
+    return found;
+}
+
+
+static int
+window_cache_put(int tm0, double tz, const KyurekiWindow *window)
+{
+    WindowCacheEntry entry;
+    Py_ssize_t n;
+
+    if (!window_cache.lock || window_cache.maxsize <= 0) { return 0; }
+
+    entry.tz = tz;
+    entry.start = kyureki_window_start(window, tm0, tz);
+    entry.end = kyureki_window_end(window, tm0, tz);
+    entry.window = *window;
+
+    PyThread_acquire_lock(window_cache.lock, WAIT_LOCK);
+    if (window_cache.maxsize > 0) {
+        n = window_cache.size < window_cache.maxsize
+            ? window_cache.size : window_cache.maxsize - 1;
+        memmove(&window_cache.entries[1], &window_cache.entries[0],
+                n * sizeof(WindowCacheEntry));
+        window_cache.entries[0] = entry;
+        window_cache.size = n + 1;
+    }
+    PyThread_release_lock(window_cache.lock);
+
+    return 0;
+}
+
+
+/* window_cache のロックと領域を作る。 GIL を持って呼ぶ
+ * module_exec はモジュールを作るたびに呼ばれるが、作るのはプロセスで 1 度だけ
+ * 領域を確保してからロックを置くので、失敗しても次の呼び出しでやり直せる */
+static int
+window_cache_init(void)
+{
+    PyThread_type_lock lock;
+
+    if (window_cache.lock) { return 0; }
+
+    if (window_cache.maxsize > 0 && !window_cache.entries) {
+        window_cache.entries = PyMem_RawCalloc(window_cache.maxsize,
+                                               sizeof(WindowCacheEntry));
+        if (!window_cache.entries) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+    lock = PyThread_allocate_lock();
+    if (!lock) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    window_cache.lock = lock;
+    return 0;
+}
+
+
+static int
+window_cache_resize(Py_ssize_t maxsize)
+{
+    WindowCacheEntry *entries = NULL;
+
+    if (maxsize > 0) {
+        entries = PyMem_RawCalloc(maxsize, sizeof(WindowCacheEntry));
+        if (!entries) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+
+    PyThread_acquire_lock(window_cache.lock, WAIT_LOCK);
+    if (window_cache.size > maxsize) {
+        window_cache.size = maxsize;
+    }
+    if (window_cache.size) {
+        memcpy(entries, window_cache.entries,
+               window_cache.size * sizeof(WindowCacheEntry));
+    }
+    PyMem_RawFree(window_cache.entries);
+    window_cache.entries = entries;
+    window_cache.maxsize = maxsize;
+    PyThread_release_lock(window_cache.lock);
+
+    return 0;
+}
+
+
+static int
+month_table_lookup(MonthTable *table, int tm0, int *kyureki_year,
+                   int *kyureki_month, int *kyureki_leap, int *kyureki_day)
+{
+    const MonthEntry *entry;
+    int end;
+
+    STATS_ADD(table_lookups, 1);
+    entry = month_table_find(table, tm0, &end);
+    if (!entry) { return -1; }
+
+    *kyureki_month = entry->month;
+    *kyureki_leap = entry->leap;
+    *kyureki_day = tm0 - entry->start + entry->day0 + 1;
+    *kyureki_year = kyureki_year_from_jd(tm0, entry->month);
+
+    return 0;
+}
+
+
+/* tm0 を含む項目を探す。 *end にはその項目が終わる日 (jd) を入れる
+ * 区間がまだなければ作る。 GIL を持って呼ぶ */
+static const MonthEntry *
+month_table_find(MonthTable *table, int tm0, int *end)
+{
+    if (!month_table_segment(table, (tm0 - TABLE_FIRST_JD) / TABLE_SEGMENT_DAYS)) {
+        return NULL;
+    }
+    return month_table_peek(table, tm0, end);
+}
+
+
+/* month_table_find と同じだが区間を作らず、まだなければ NULL を返す。 GIL は不要 */
+static const MonthEntry *
+month_table_peek(const MonthTable *table, int tm0, int *end)
+{
+    const TableSegment *segment;
+    const MonthEntry *entries;
+    int index;
+    Py_ssize_t lo, hi, mid;
+
+    index = (tm0 - TABLE_FIRST_JD) / TABLE_SEGMENT_DAYS;
+    segment = &table->segments[index];
+    entries = SEGMENT_LOAD(segment->entries);
+    if (!entries) { return NULL; }
+
+    lo = 0;
+    hi = segment->n;
+    while (hi - lo > 1) {
+        mid = (lo + hi) / 2;
+        if (entries[mid].start <= tm0) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
     }
 
-    state = 0;
-    for (i=0; i < 5; i++) {
-        if (tm0 < m[i][2]) {
-            state = 1;
-            break;
-        }
-        else if (tm0 == m[i][2]) {
-            state = 2;
-            break;
+    if (lo + 1 < segment->n) {
+        *end = entries[lo + 1].start;
+    } else {
+        *end = TABLE_FIRST_JD + (index + 1) * TABLE_SEGMENT_DAYS;
+        if (*end > TABLE_LAST_JD + 1) {
+            *end = TABLE_LAST_JD + 1;
         }
     }
 
-    if (state == 0 || state == 1)
-        i -= 1;
+    return &entries[lo];
+}
 
-    *kyureki_month = m[i][0];
-    *kyureki_leap = m[i][1];
-    *kyureki_day = tm0 - m[i][2] + 1;
 
-    jd2yearmonth(tm, &shinreki_year, &shinreki_month);
+/* tm0 を含む項目に cursor を置いて返す。区間がなければ作る。 GIL を持って呼ぶ */
+static const MonthEntry *
+table_cursor_find(TableCursor *cursor, MonthTable *table, int tm0)
+{
+    const MonthEntry *entry;
+    int end;
+
+    entry = month_table_find(table, tm0, &end);
+    if (!entry) { return NULL; }
+    cursor->table = table;
+    cursor->index = (tm0 - TABLE_FIRST_JD) / TABLE_SEGMENT_DAYS;
+    cursor->i = entry - table->segments[cursor->index].entries;
+    return entry;
+}
 
-    *kyureki_year = shinreki_year;
-    if (*kyureki_month > 9 && *kyureki_month > shinreki_month)
-        *kyureki_year -= 1;
 
-    return 0;
+/* cursor を step (1 か -1) 項目進めて返す。区間がなければ作る。 GIL を持って呼ぶ
+ * テーブルの外に出るときは例外を設定せずに NULL を返し、 cursor は動かさない */
+static const MonthEntry *
+table_cursor_step(TableCursor *cursor, int step)
+{
+    const TableSegment *segment = &cursor->table->segments[cursor->index];
+    int index = cursor->index;
+    Py_ssize_t i = cursor->i + step;
+
+    while (i < 0 || i >= segment->n) {
+        index += step;
+        if (index < 0 || index >= TABLE_SEGMENTS) { return NULL; }
+        segment = month_table_segment(cursor->table, index);
+        if (!segment) { return NULL; }
+        i = step > 0 ? 0 : segment->n - 1;
+    }
+    cursor->index = index;
+    cursor->i = i;
+    return &segment->entries[i];
 }
 
-static void
-chuki_from_jd(double tm, double tz, double *chuki, double *longitude)
+
+/* cursor を月の最初の項目に戻す。テーブルの先頭より前に始まる月はそこで切る */
+static int
+table_cursor_month_first(TableCursor *cursor)
 {
-    double tm1, tm2, t;
-    double rm_sun, rm_sun0;
-    double delta_rm, delta_t1, delta_t2;
+    const MonthEntry *entry = TABLE_CURSOR_ENTRY(cursor), *prev;
+    TableCursor c;
+
+    while (entry->day0) {
+        c = *cursor;
+        prev = table_cursor_step(&c, -1);
+        if (!prev) { return PyErr_Occurred() ? CONVERT_SOLVER : 0; }
+        if (!SAME_MONTH(prev, entry)) { break; }
+        *cursor = c;
+        entry = prev;
+    }
+    return 0;
+}
 
-    tm2 = modf(tm, &tm1);
-    tm2 -= tz;
 
-    t = (tm2 + 0.5) / 36525.0 + (tm1 - 2451545.0) / 36525.0;
-    rm_sun = longitude_of_sun(t);
-    rm_sun0 = rm_sun - fmod(rm_sun, 30.0);
+/* 月の最初の項目にある cursor から、その月を span に入れて次の月の最初の項目に進める
+ * 次の月がテーブルにないときは、 span の日数をテーブルの末尾までとして CONVERT_RANGE */
+static int
+table_cursor_month(TableCursor *cursor, MonthSpan *span)
+{
+    const MonthEntry *entry = TABLE_CURSOR_ENTRY(cursor), *next;
+
+    span->month = entry->month;
+    span->leap = entry->leap;
+    span->start = entry->start;
+    do {
+        next = table_cursor_step(cursor, 1);
+        if (!next) {
+            span->days = TABLE_LAST_JD + 1 - span->start;
+            return PyErr_Occurred() ? CONVERT_SOLVER : CONVERT_RANGE;
+        }
+    } while (SAME_MONTH(next, entry));
+    span->days = next->start - span->start;
+    return 0;
+}
 
-    delta_t1 = 0.0;
-    delta_t2 = 1.0;
 
-    while (fabs(delta_t1 + delta_t2) > 1.0 / 86400.0) {
-        t = (tm2 + 0.5) / 36525.0 + (tm1 - 2451545.0)/ 36525.0;
-        rm_sun = longitude_of_sun(t);
+static int
+month_table_append(MonthEntry **entries, Py_ssize_t *n, Py_ssize_t *allocated,
+                   int start, int month, int leap, int saku)
+{
+    MonthEntry *entry;
 
-        delta_rm = rm_sun - rm_sun0;
-        if (delta_rm > 180.0) {
-            delta_rm -= 360.0;
-        }
-        else if (delta_rm < -180.0) {
-            delta_rm += 360.0;
+    if (*n > 0) {
+        entry = &(*entries)[*n - 1];
+        if (entry->month == month && entry->leap == leap &&
+            entry->start - entry->day0 == saku) {
+            return 0;
         }
+    }
 
-        delta_t2 = modf(delta_rm * 365.2 / 360.0, &delta_t1);
-
-        tm1 -= delta_t1;
-        tm2 -= delta_t2;
-
-        if (tm2 < 0.0) {
-            tm2 += 1.0;
-            tm1 -= 1.0;
+    if (*n == *allocated) {
+        Py_ssize_t size = *allocated ? *allocated * 2 : 1280;
+        entry = PyMem_Realloc(*entries, size * sizeof(MonthEntry));
+        if (!entry) {
+            PyErr_NoMemory();
+            return -1;
         }
+        *entries = entry;
+        *allocated = size;
     }
 
-    *chuki = tm1 + tm2 + tz;
-    *longitude = rm_sun0;
-    return;
+    entry = &(*entries)[(*n)++];
+    entry->start = start;
+    entry->month = (unsigned char)month;
+    entry->leap = (unsigned char)leap;
+    entry->day0 = (unsigned char)(start - saku);
+    entry->reserved = 0;
+    return 0;
 }
 
 
-static void
-before_nibun_from_jd(double tm, double tz, double *nibun, double *longitude)
+/* [first, last) の朔日テーブルを kyureki_from_jd と同じ手順で作る */
+static int
+month_table_build(double tz, int first, int last,
+                  MonthEntry **entries, Py_ssize_t *n)
 {
-    double tm1, tm2, t;
-    double rm_sun, rm_sun0;
-    double delta_rm, delta_t1, delta_t2;
+    KyurekiWindow window;
+    Py_ssize_t allocated = 0;
+    int tm0, end, start, stop, i;
+
+    *entries = NULL;
+    *n = 0;
+
+    tm0 = first;
+    while (tm0 < last) {
+        if (kyureki_window_from_jd(tm0, tz, &window) == -1) {
+            solver_error();
+            goto error;
+        }
+        end = kyureki_window_end(&window, tm0, tz);
+        if (end > last) {
+            end = last;
+        }
 
-    tm2 = modf(tm, &tm1);
+        for (i = kyureki_window_index(&window, tm0); i < 5; i++) {
+            start = window.m[i][2] > tm0 ? window.m[i][2] : tm0;
+            stop = (i < 4 && window.m[i+1][2] < end) ? window.m[i+1][2] : end;
+            if (start >= stop) { continue; }
+            if (month_table_append(entries, n, &allocated, start, window.m[i][0],
+                                   window.m[i][1], window.m[i][2])) { goto error; }
+        }
 
-    tm2 -= tz;
+        tm0 = end;
+    }
 
-    t = (tm2 + 0.5) / 36525.0 + (tm1 - 2451545.0) / 36525.0;
-    rm_sun = longitude_of_sun(t);
-    rm_sun0 = rm_sun - fmod(rm_sun, 90.0);
+    return 0;
+error:
+    PyMem_Free(*entries);
+    *entries = NULL;
+    *n = 0;
+    return -1;
+}
 
-    delta_t1 = 0.0;
-    delta_t2 = 1.0;
 
-    while (fabs(delta_t1 + delta_t2) > 1.0 / 86400.0) {
-        t = (tm2 + 0.5) / 36525.0 + (tm1 - 2451545.0)/ 36525.0;
-        rm_sun = longitude_of_sun(t);
+/* index 番目の区間を返す。なければ作り終えてから公開する。 GIL を持って呼ぶ */
+static TableSegment *
+month_table_segment(MonthTable *table, int index)
+{
+    TableSegment *segment = &table->segments[index];
+    MonthEntry *entries;
+    Py_ssize_t n;
+    int first, last;
+
+    if (SEGMENT_LOAD(segment->entries)) { return segment; }
+    STATS_START(start);
+
+    first = TABLE_FIRST_JD + index * TABLE_SEGMENT_DAYS;
+    last = first + TABLE_SEGMENT_DAYS;
+    if (last > TABLE_LAST_JD + 1) {
+        last = TABLE_LAST_JD + 1;
+    }
+    if (month_table_build(table->tz, first, last, &entries, &n)) { return NULL; }
+    segment->n = n;
+    SEGMENT_PUBLISH(segment->entries, entries);
 
-        delta_rm = rm_sun - rm_sun0;
-        if (delta_rm > 180.0) {
-            delta_rm -= 360.0;
-        }
-        else if (delta_rm < -180.0) {
-            delta_rm += 360.0;
-        }
+    STATS_ADD(table_builds, 1);
+    STATS_END(table_ns, start);
+    return segment;
+}
 
-        delta_t2 = modf(delta_rm * 365.2 / 360.0, &delta_t1);
 
-        tm1 -= delta_t1;
-        tm2 -= delta_t2;
+/* tz の朔日テーブルを返す。なければ作る。 GIL を持って呼ぶ
+ * 作れないときは NULL を返し、呼び出し側は window_cache を使う
+ * GIL を持たない変換スレッドは tz_tables を見ず、 ConvertTask.table を使う */
+static MonthTable *
+month_table_for(double tz)
+{
+    MonthTable *table;
+    int i;
 
-        if (tm2 < 0.0) {
-            tm2 += 1.0;
-            tm1 -= 1.0;
-        }
+    if (tz == jst_tz) { return &jst_table; }
+    for (i = 0; i < tz_tables_size; i++) {
+        if (tz_tables[i]->tz == tz) { return tz_tables[i]; }
+    }
+    if (tz != tz || tz_tables_size >= tz_tables_max) {
+        return NULL;
     }
 
-    *nibun = tm1 + tm2 + tz;
-    *longitude = rm_sun0;
-    return;
+    table = PyMem_Calloc(1, sizeof(MonthTable));
+    if (!table) { return NULL; }
+    table->tz = tz;
+    tz_tables[tz_tables_size++] = table;
+    return table;
 }
 
 
+/* GIL を解放した変換が走っているか */
 static int
-saku_from_jd(double tm, double tz, double *saku)
+month_tables_busy(void)
 {
-    double tm1, tm2, t;
-    double rm_sun, rm_moon;
-    double delta_rm, delta_t1, delta_t2;
-    int lc;
-
-    tm2 = modf(tm, &tm1);
-
-    tm2 -= tz;
-
-    delta_t1 = 0.0;
-    delta_t2 = 1.0;
-
-    for (lc = 1; lc < 30; lc++) {
-        t = (tm2 + 0.5) / 36525.0 + (tm1 - 2451545.0)/ 36525.0;
-        rm_sun = longitude_of_sun(t);
-        rm_moon = longitude_of_moon(t);
+    int i;
 
-        delta_rm = rm_moon - rm_sun;
-        if (lc == 1 && delta_rm < 0.0) {
-            delta_rm = normalize_angle(delta_rm);
-        }
-        else if (rm_sun >= 0.0 && rm_sun <= 20.0 && rm_moon >= 300.0) {
-            delta_rm = normalize_angle(delta_rm);
-            delta_rm = 360.0 - delta_rm;
-        }
-        else if (fabs(delta_rm) > 40.0) {
-            delta_rm = normalize_angle(delta_rm);
-        }
+    if (converts_running || jst_table.busy) { return 1; }
+    for (i = 0; i < tz_tables_size; i++) {
+        if (tz_tables[i]->busy) { return 1; }
+    }
+    return 0;
+}
 
-        delta_t2 = modf(delta_rm * 29.530589 / 360.0, &delta_t1);
 
-        tm1 -= delta_t1;
-        tm2 -= delta_t2;
+/* JST 以外の朔日テーブルを keep 個だけ残して捨てる */
+static void
+tz_tables_free(int keep)
+{
+    while (tz_tables_size > keep) {
+        tz_tables_size--;
+        month_table_clear(tz_tables[tz_tables_size]);
+        PyMem_Free(tz_tables[tz_tables_size]);
+        tz_tables[tz_tables_size] = NULL;
+    }
+}
 
-        if (tm2 < 0.0) {
-            tm2 += 1.0;
-            tm1 -= 1.0;
-        }
 
-        if (fabs(delta_t1 + delta_t2) > 1.0 / 86400.0) {
-            if (lc == 15) {
-                tm1 = tm - 26.0;
-                tm2 = 0.0;
-            }
-        }
-        else {
-            break;
+/* ordinals の日付を引くのに必要な区間をすべて作っておく */
+static int
+month_table_prepare(MonthTable *table, const IntBuffer *ordinals)
+{
+    char needed[TABLE_SEGMENTS] = {0};
+    Py_ssize_t n, i;
+    long long ordinal;
+    int index;
+
+    n = ordinals->view.len / ordinals->view.itemsize;
+    for (i = 0; i < n; i++) {
+        ordinal = int_buffer_load(ordinals, i);
+        if (ordinal >= ORDINAL_MIN && ordinal <= ORDINAL_MAX) {
+            needed[(ordinal + 1721424 - TABLE_FIRST_JD) / TABLE_SEGMENT_DAYS] = 1;
         }
     }
 
-    if (lc >= 30) {
-        PyErr_SetString(PyExc_ValueError, "");
-        return -1;
+    for (index = 0; index < TABLE_SEGMENTS; index++) {
+        if (needed[index] && !month_table_segment(table, index)) { return -1; }
     }
 
-    *saku = tm1 + tm2 + tz;
     return 0;
 }
 
 
-static double
-longitude_of_sun(double t)
+/* 朔の計算が収束しなかったことを例外にする。 GIL を持って呼ぶ */
+static void
+solver_error(void)
 {
-    double ang, th;
+    if (!PyErr_Occurred()) {
+        PyErr_SetString(PyExc_ValueError, "朔の計算が収束せず");
+    }
+}
 
-    ang = normalize_angle(31557.0 * t + 161.0);
-    th = .0004 * cos(degToRad * ang);
-    ang = normalize_angle(29930.0 * t + 48.0);
-    th += .0004 * cos(degToRad * ang);
-    ang = normalize_angle(2281.0 * t + 221.0);
-    th += .0005 * cos(degToRad * ang);
-    ang = normalize_angle(155.0 * t + 118.0);
-    th += .0005 * cos(degToRad * ang);
-    ang = normalize_angle(33718.0 * t + 316.0);
-    th += .0006 * cos(degToRad * ang);
-    ang = normalize_angle(9038.0 * t + 64.0);
-    th += .0007 * cos(degToRad * ang);
-    ang = normalize_angle(3035.0 * t + 110.0);
-    th += .0007 * cos(degToRad * ang);
-    ang = normalize_angle(65929.0 * t + 45.0);
-    th += .0007 * cos(degToRad * ang);
-    ang = normalize_angle(22519.0 * t + 352.0);
-    th += .0013 * cos(degToRad * ang);
-    ang = normalize_angle(45038.0 * t + 254.0);
-    th += .0015 * cos(degToRad * ang);
-    ang = normalize_angle(445267.0 * t + 208.0);
-    th += .0018 * cos(degToRad * ang);
-    ang = normalize_angle(19.0 * t + 159.0);
-    th += .0018 * cos(degToRad * ang);
-    ang = normalize_angle(32964.0 * t + 158.0);
-    th += .0020 * cos(degToRad * ang);
-    ang = normalize_angle(71998.1 * t + 265.1);
-    th += .0200 * cos(degToRad * ang);
 
-    ang = normalize_angle(35999.05 * t + 267.52);
-    th -= 0.0048 * t * cos(degToRad * ang);
-    th += 1.9147 * cos(degToRad * ang);
+static void
+month_table_clear(MonthTable *table)
+{
+    int i;
 
-    ang = normalize_angle(36000.7695 * t);
-    ang = normalize_angle(ang + 280.4659);
-    th = normalize_angle(th + ang);
+    for (i = 0; i < TABLE_SEGMENTS; i++) {
+        if (!table->map) { PyMem_Free(table->segments[i].entries); }
+        table->segments[i].entries = NULL;
+        table->segments[i].n = 0;
+    }
 
-    return th;
+    if (table->map) {
+#ifdef HAVE_MMAP
+        munmap(table->map, table->map_size);
+#else
+        PyMem_RawFree(table->map);
+#endif
+        table->map = NULL;
+        table->map_size = 0;
+    }
 }
 
 
-static double
-longitude_of_moon(double t)
+/* 朔日テーブルを全区間作り、ファイルに書き出す */
+static PyObject *
+qreki_dump_table(PyObject *module, PyObject *args, PyObject *kwargs)
 {
-    double ang, th;
-
-    ang = normalize_angle(2322131.0 * t + 191.0);
-    th = .0003 * cos(degToRad * ang);
-    ang = normalize_angle(4067.0 * t + 70.0);
-    th += .0003 * cos(degToRad * ang);
-    ang = normalize_angle(549197.0 * t + 220.0);
-    th += .0003 * cos(degToRad * ang);
-    ang = normalize_angle(1808933.0 * t + 58.0);
-    th += .0003 * cos(degToRad * ang);
-    ang = normalize_angle(349472.0 * t + 337.0);
-    th += .0003 * cos(degToRad * ang);
-    ang = normalize_angle(381404.0 * t + 354.0);
-    th += .0003 * cos(degToRad * ang);
-    ang = normalize_angle(958465.0 * t + 340.0);
-    th += .0003 * cos(degToRad * ang);
-    ang = normalize_angle(12006.0 * t + 187.0);
-    th += .0004 * cos(degToRad * ang);
-    ang = normalize_angle(39871.0 * t + 223.0);
-    th += .0004 * cos(degToRad * ang);
-    ang = normalize_angle(509131.0 * t + 242.0);
-    th += .0005 * cos(degToRad * ang);
-    ang = normalize_angle(1745069.0 * t + 24.0);
-    th += .0005 * cos(degToRad * ang);
-    ang = normalize_angle(1908795.0 * t + 90.0);
-    th += .0005 * cos(degToRad * ang);
-    ang = normalize_angle(2258267.0 * t + 156.0);
-    th += .0006 * cos(degToRad * ang);
-    ang = normalize_angle(111869.0 * t + 38.0);
-    th += .0006 * cos(degToRad * ang);
-    ang = normalize_angle(27864.0 * t + 127.0);
-    th += .0007 * cos(degToRad * ang);
-    ang = normalize_angle(485333.0 * t + 186.0);
-    th += .0007 * cos(degToRad * ang);
-    ang = normalize_angle(405201.0 * t + 50.0);
-    th += .0007 * cos(degToRad * ang);
-    ang = normalize_angle(790672.0 * t + 114.0);
-    th += .0007 * cos(degToRad * ang);
-    ang = normalize_angle(1403732.0 * t + 98.0);
-    th += .0008 * cos(degToRad * ang);
-    ang = normalize_angle(858602.0 * t + 129.0);
-    th += .0009 * cos(degToRad * ang);
-    ang = normalize_angle(1920802.0 * t + 186.0);
-    th += .0011 * cos(degToRad * ang);
-    ang = normalize_angle(1267871.0 * t + 249.0);
-    th += .0012 * cos(degToRad * ang);
-    ang = normalize_angle(1856938.0 * t + 152.0);
-    th += .0016 * cos(degToRad * ang);
-    ang = normalize_angle(401329.0 * t + 274.0);
-    th += .0018 * cos(degToRad * ang);
-    ang = normalize_angle(341337.0 * t + 16.0);
-    th += .0021 * cos(degToRad * ang);
-    ang = normalize_angle(71998.0 * t + 85.0);
-    th += .0021 * cos(degToRad * ang);
-    ang = normalize_angle(990397.0 * t + 357.0);
-    th += .0021 * cos(degToRad * ang);
-    ang = normalize_angle(818536.0 * t + 151.0);
-    th += .0022 * cos(degToRad * ang);
-    ang = normalize_angle(922466.0 * t + 163.0);
-    th += .0023 * cos(degToRad * ang);
-    ang = normalize_angle(99863.0 * t + 122.0);
-    th += .0024 * cos(degToRad * ang);
-    ang = normalize_angle(1379739.0 * t + 17.0);
-    th += .0026 * cos(degToRad * ang);
-    ang = normalize_angle(918399.0 * t + 182.0);
-    th += .0027 * cos(degToRad * ang);
-    ang = normalize_angle(1934.0 * t + 145.0);
-    th += .0028 * cos(degToRad * ang);
-    ang = normalize_angle(541062.0 * t + 259.0);
-    th += .0037 * cos(degToRad * ang);
-    ang = normalize_angle(1781068.0 * t + 21.0);
-    th += .0038 * cos(degToRad * ang);
-    ang = normalize_angle(133.0 * t + 29.0);
-    th += .0040 * cos(degToRad * ang);
-    ang = normalize_angle(1844932.0 * t + 56.0);
-    th += .0040 * cos(degToRad * ang);
-    ang = normalize_angle(1331734.0 * t + 283.0);
-    th += .0040 * cos(degToRad * ang);
-    ang = normalize_angle(481266.0 * t + 205.0);
-    th += .0050 * cos(degToRad * ang);
-    ang = normalize_angle(31932.0 * t + 107.0);
-    th += .0052 * cos(degToRad * ang);
-    ang = normalize_angle(926533.0 * t + 323.0);
-    th += .0068 * cos(degToRad * ang);
-    ang = normalize_angle(449334.0 * t + 188.0);
-    th += .0079 * cos(degToRad * ang);
-    ang = normalize_angle(826671.0 * t + 111.0);
-    th += .0085 * cos(degToRad * ang);
-    ang = normalize_angle(1431597.0 * t + 315.0);
-    th += .0100 * cos(degToRad * ang);
-    ang = normalize_angle(1303870.0 * t + 246.0);
-    th += .0107 * cos(degToRad * ang);
-    ang = normalize_angle(489205.0 * t + 142.0);
-    th += .0110 * cos(degToRad * ang);
-    ang = normalize_angle(1443603.0 * t + 52.0);
-    th += .0125 * cos(degToRad * ang);
-    ang = normalize_angle(75870.0 * t + 41.0);
-    th += .0154 * cos(degToRad * ang);
-    ang = normalize_angle(513197.9 * t + 222.5);
-    th += .0304 * cos(degToRad * ang);
-    ang = normalize_angle(445267.1 * t + 27.9);
-    th += .0347 * cos(degToRad * ang);
-    ang = normalize_angle(441199.8 * t + 47.4);
-    th += .0409 * cos(degToRad * ang);
-    ang = normalize_angle(854535.2 * t + 148.2);
-    th += .0458 * cos(degToRad * ang);
-    ang = normalize_angle(1367733.1 * t + 280.7);
-    th += .0533 * cos(degToRad * ang);
-    ang = normalize_angle(377336.3 * t + 13.2);
-    th += .0571 * cos(degToRad * ang);
-    ang = normalize_angle(63863.5 * t + 124.2);
-    th += .0588 * cos(degToRad * ang);
-    ang = normalize_angle(966404.0 * t + 276.5);
-    th += .1144 * cos(degToRad * ang);
-    ang = normalize_angle(35999.05 * t + 87.53);
-    th += .1851 * cos(degToRad * ang);
-    ang = normalize_angle(954397.74 * t + 179.93);
-    th += .2136 * cos(degToRad * ang);
-    ang = normalize_angle(890534.22 * t + 145.7);
-    th += .6583 * cos(degToRad * ang);
-    ang = normalize_angle(413335.35 * t + 10.74);
-    th += 1.2740 * cos(degToRad * ang);
-    ang = normalize_angle(477198.868 * t + 44.963);
-    th += 6.2888 * cos(degToRad * ang);
+    static char *kwlist[] = {"path", "tz", NULL};
+    PyObject *filename, *path;
+    double tz = jst_tz;
+    TableFileHeader header;
+    MonthEntry *entries[TABLE_SEGMENTS] = {NULL};
+    Py_ssize_t n;
+    TableSegment *segment;
+    MonthTable *table;
+    FILE *fp = NULL;
+    int i, first, last;
+    PyObject *ret = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|d", kwlist,
+                                     &filename, &tz)) { return NULL; }
+    if (!PyUnicode_FSConverter(filename, &path)) { return NULL; }
+    table = month_table_for(tz);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TABLE_FILE_MAGIC, sizeof(header.magic));
+    header.version = TABLE_FILE_VERSION;
+    header.byte_order = TABLE_FILE_BYTE_ORDER;
+    header.tz = tz;
+    header.first_jd = TABLE_FIRST_JD;
+    header.segment_days = TABLE_SEGMENT_DAYS;
+    header.segments = TABLE_SEGMENTS;
+    header.entry_size = sizeof(MonthEntry);
+
+    for (i = 0; i < TABLE_SEGMENTS; i++) {
+        if (table) {
+            segment = month_table_segment(table, i);
+            if (!segment) { goto cleanup; }
+            n = segment->n;
+        } else {
+            first = TABLE_FIRST_JD + i * TABLE_SEGMENT_DAYS;
+            last = first + TABLE_SEGMENT_DAYS;
+            if (last > TABLE_LAST_JD + 1) {
+                last = TABLE_LAST_JD + 1;
+            }
+            if (month_table_build(tz, first, last, &entries[i], &n)) {
+                goto cleanup;
+            }
+        }
+        header.counts[i] = (uint32_t)n;
+    }
 
-    ang = normalize_angle(481267.8809 * t);
-    ang = normalize_angle(ang + 218.3162);
-    th = normalize_angle(th + ang);
+    fp = fopen(PyBytes_AS_STRING(path), "wb");
+    if (!fp) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, filename);
+        goto cleanup;
+    }
+    if (fwrite(&header, sizeof(header), 1, fp) != 1) { goto write_error; }
+    for (i = 0; i < TABLE_SEGMENTS; i++) {
+        const MonthEntry *p = table ? table->segments[i].entries : entries[i];
+        if (fwrite(p, sizeof(MonthEntry), header.counts[i], fp) != header.counts[i]) {
+            goto write_error;
+        }
+    }
+    if (fclose(fp)) {
+        fp = NULL;
+        goto write_error;
+    }
+    fp = NULL;
 
-    return th;
+    Py_INCREF(Py_None);
+    ret = Py_None;
+    goto cleanup;
+write_error:
+    PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, filename);
+cleanup:
+    if (fp) { fclose(fp); }
+    for (i = 0; i < TABLE_SEGMENTS; i++) {
+        PyMem_Free(entries[i]);
+    }
+    Py_DECREF(path);
+    return ret;
 }
 
 
-static void
-jd2yearmonth(double jd, int *year, int *month)
+/* dump_table で書き出したファイルを読み込み専用でマップし、朔日テーブルとして使う
+ * 複数のプロセスで同じファイルを読み込めば、ページを共有できる */
+static PyObject *
+qreki_load_table(PyObject *module, PyObject *args)
 {
-    double f0, f1, f2, f3, f4, f5, f6;
-    int i1, i3, i5, i6;
+    PyObject *filename, *path;
+    void *map = NULL;
+    size_t size = 0;
+    const TableFileHeader *header;
+    const MonthEntry *entries;
+    MonthTable *table;
+    int i;
+#ifdef HAVE_MMAP
+    int fd;
+    struct stat st;
+#else
+    FILE *fp;
+    long length;
+#endif
+
+    if (!PyArg_ParseTuple(args, "O", &filename)) { return NULL; }
+    if (!PyUnicode_FSConverter(filename, &path)) { return NULL; }
+
+#ifdef HAVE_MMAP
+    errno = 0;
+    Py_BEGIN_ALLOW_THREADS
+    fd = open(PyBytes_AS_STRING(path), O_RDONLY);
+    if (fd != -1) {
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            size = (size_t)st.st_size;
+            map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (map == MAP_FAILED) { map = NULL; }
+        }
+        close(fd);
+    }
+    Py_END_ALLOW_THREADS
+    if (!map) {
+        if (errno) {
+            PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, filename);
+        } else {
+            PyErr_SetString(PyExc_ValueError, "not a qreki table file");
+        }
+        goto error;
+    }
+#else
+    fp = fopen(PyBytes_AS_STRING(path), "rb");
+    if (!fp) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, filename);
+        goto error;
+    }
+    if (fseek(fp, 0, SEEK_END) == 0 && (length = ftell(fp)) > 0 &&
+            fseek(fp, 0, SEEK_SET) == 0) {
+        size = (size_t)length;
+        map = PyMem_RawMalloc(size);
+        if (map && fread(map, 1, size, fp) != size) {
+            PyMem_RawFree(map);
+            map = NULL;
+        }
+    }
+    fclose(fp);
+    if (!map) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, filename);
+        goto error;
+    }
+#endif
+
+    header = map;
+    if (month_table_check(header, size)) { goto error; }
+    table = month_table_for(header->tz);
+    if (!table) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_ValueError, "too many timezone tables");
+        }
+        goto error;
+    }
+    if (table->busy) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "cannot load a table while from_ordinals is running");
+        goto error;
+    }
 
-    f0 = floor(jd + 68570.0);
-    f1 = floor(f0 / 36524.25);
-    f2 = f0 - floor(36524.25 * f1 + 0.75);
-    f3 = floor((f2 + 1.0) / 365.2425);
-    f4 = f2 - floor(365.25 * f3) + 31.0;
-    f5 = floor(f4 / 30.59);
-    f6 = floor(f5 / 11.0);
+    month_table_clear(table);
+    table->map = map;
+    table->map_size = size;
+    entries = (const MonthEntry *)(header + 1);
+    for (i = 0; i < TABLE_SEGMENTS; i++) {
+        table->segments[i].n = header->counts[i];
+        SEGMENT_PUBLISH(table->segments[i].entries, (MonthEntry *)entries);
+        entries += header->counts[i];
+    }
 
-    i1 = (int)f1;
-    i3 = (int)f3;
-    i5 = (int)f5;
-    i6 = (int)f6;
+    Py_DECREF(path);
+    Py_RETURN_NONE;
+error:
+    if (map) {
+#ifdef HAVE_MMAP
+        munmap(map, size);
+#else
+        PyMem_RawFree(map);
+#endif
+    }
+    Py_DECREF(path);
+    return NULL;
+}
 
-    *year = 100 * (i1 - 49) + i3 + i6;
-    *month = i5 - 12 * i6 + 2;
 
-    return;
+/* 読み込んだファイルが month_table_find でそのまま引けるか確かめる */
+static int
+month_table_check(const TableFileHeader *header, size_t size)
+{
+    const MonthEntry *entries;
+    size_t total = 0;
+    uint32_t k;
+    int i, first, last;
+
+    if (size < sizeof(TableFileHeader) ||
+            memcmp(header->magic, TABLE_FILE_MAGIC, sizeof(header->magic)) ||
+            header->version != TABLE_FILE_VERSION ||
+            header->byte_order != TABLE_FILE_BYTE_ORDER ||
+            header->first_jd != TABLE_FIRST_JD ||
+            header->segment_days != TABLE_SEGMENT_DAYS ||
+            header->segments != TABLE_SEGMENTS ||
+            header->entry_size != sizeof(MonthEntry)) {
+        goto error;
+    }
+    for (i = 0; i < TABLE_SEGMENTS; i++) {
+        if (header->counts[i] == 0) { goto error; }
+        total += header->counts[i];
+    }
+    if (size != sizeof(TableFileHeader) + total * sizeof(MonthEntry)) { goto error; }
+
+    entries = (const MonthEntry *)(header + 1);
+    for (i = 0; i < TABLE_SEGMENTS; i++) {
+        first = TABLE_FIRST_JD + i * TABLE_SEGMENT_DAYS;
+        last = first + TABLE_SEGMENT_DAYS;
+        if (entries[0].start != first) { goto error; }
+        for (k = 0; k < header->counts[i]; k++) {
+            if (entries[k].start >= last || entries[k].month < 1 ||
+                    entries[k].month > 12 || entries[k].leap > 1 ||
+                    entries[k].day0 > 29 ||
+                    (k > 0 && entries[k].start <= entries[k - 1].start)) {
+                goto error;
+            }
+        }
+        entries += header->counts[i];
+    }
+
+    return 0;
+error:
+    PyErr_SetString(PyExc_ValueError, "not a qreki table file");
+    return -1;
 }
 
 
@@ -801,14 +5811,45 @@ static int module_exec(PyObject *module)
     PyObject *rokuyou = NULL;
     PyObject *str_template = NULL;
     PyObject *str_leap_template = NULL;
+    PyObject *array_module = NULL;
+    qreki_state *state = PyModule_GetState(module);
+    int i;
+
+    if (series_init()) { goto cleanup; }
 
-    kyureki_type = PyType_FromSpec(&Kyureki_Type_spec);
+    if (window_cache_init()) { goto cleanup; }
+
+    state->free_max = FREE_LIST_MAX;
+    state->workers_max = THREAD_POOL_MAX;
+
+    kyureki_type = PyType_FromModuleAndSpec(module, &Kyureki_Type_spec, NULL);
     if (!kyureki_type) { goto cleanup; }
+    Py_INCREF(kyureki_type);
+    state->kyureki_type = kyureki_type;
+    ((PyTypeObject *)kyureki_type)->tp_vectorcall = Kyureki_vectorcall;
+
+    state->range_type = PyType_FromModuleAndSpec(module, &KyurekiRange_Type_spec, NULL);
+    if (!state->range_type) { goto cleanup; }
+
+    state->array_type = PyType_FromModuleAndSpec(module, &KyurekiArray_Type_spec, NULL);
+    if (!state->array_type) { goto cleanup; }
+    if (PyObject_SetAttrString(module, "KyurekiArray", state->array_type)) { goto cleanup; }
+
+    state->month_type = (PyObject *)PyStructSequence_NewType(&kyureki_month_desc);
+    if (!state->month_type) { goto cleanup; }
+    if (PyObject_SetAttrString(module, "KyurekiMonth", state->month_type)) { goto cleanup; }
 
     /* Kyureki.ROKUYOU */
     rokuyou = Py_BuildValue("ssssss", "大安", "赤口", "先勝", "友引", "先負", "仏滅");
     if (!rokuyou) { goto cleanup; }
+    for (i = 0; i < 6; i++) {
+        PyUnicode_InternInPlace(&PyTuple_GET_ITEM(rokuyou, i));
+    }
     if (PyObject_SetAttrString(kyureki_type, "ROKUYOU", rokuyou)) { goto cleanup; }
+    Py_INCREF(rokuyou);
+    state->rokuyou = rokuyou;
+    state->rokuyou_name = PyUnicode_InternFromString("ROKUYOU");
+    if (!state->rokuyou_name) { goto cleanup; }
 
     /* Kyureki._str_template */
     str_template = PyUnicode_FromString("{:d}年{:d}月{:d}日");
@@ -819,11 +5860,32 @@ static int module_exec(PyObject *module)
     str_leap_template = PyUnicode_FromString("{:d}年閏{:d}月{:d}日");
     if (!str_leap_template) { goto cleanup; }
     if (PyObject_SetAttrString(kyureki_type, "_str_leap_template", str_leap_template)) { goto cleanup; }
+    Py_INCREF(str_template);
+    state->str_template = str_template;
+    Py_INCREF(str_leap_template);
+    state->str_leap_template = str_leap_template;
+    state->str_template_name = PyUnicode_InternFromString("_str_template");
+    if (!state->str_template_name) { goto cleanup; }
+    state->str_leap_template_name = PyUnicode_InternFromString("_str_leap_template");
+    if (!state->str_leap_template_name) { goto cleanup; }
 
     if (PyObject_SetAttrString(module, "Kyureki", kyureki_type)) { goto cleanup; }
 
+    /* from_ordinals の出力用 */
+    array_module = PyImport_ImportModule("array");
+    if (!array_module) { goto cleanup; }
+    state->array_h = PyObject_CallMethod(array_module, "array", "s[i]", "H", 0);
+    if (!state->array_h) { goto cleanup; }
+    state->array_b = PyObject_CallMethod(array_module, "array", "s[i]", "B", 0);
+    if (!state->array_b) { goto cleanup; }
+    state->array_i = PyObject_CallMethod(array_module, "array", "s[i]", "i", 0);
+    if (!state->array_i) { goto cleanup; }
+    state->array_d = PyObject_CallMethod(array_module, "array", "s[d]", "d", 0.0);
+    if (!state->array_d) { goto cleanup; }
+
     ret = 0;
 cleanup:
+    Py_XDECREF(array_module);
     Py_XDECREF(str_leap_template);
     Py_XDECREF(str_template);
     Py_XDECREF(rokuyou);
@@ -834,6 +5896,59 @@ cleanup:
 }
 
 
+static int
+module_traverse(PyObject *module, visitproc visit, void *arg)
+{
+    qreki_state *state = PyModule_GetState(module);
+    Py_VISIT(state->kyureki_type);
+    Py_VISIT(state->range_type);
+    Py_VISIT(state->array_h);
+    Py_VISIT(state->array_b);
+    Py_VISIT(state->array_i);
+    Py_VISIT(state->array_d);
+    Py_VISIT(state->rokuyou);
+    Py_VISIT(state->rokuyou_name);
+    Py_VISIT(state->month_type);
+    Py_VISIT(state->array_type);
+    Py_VISIT(state->str_template);
+    Py_VISIT(state->str_leap_template);
+    Py_VISIT(state->str_template_name);
+    Py_VISIT(state->str_leap_template_name);
+    return 0;
+}
+
+
+static int
+module_clear(PyObject *module)
+{
+    qreki_state *state = PyModule_GetState(module);
+    Py_CLEAR(state->kyureki_type);
+    Py_CLEAR(state->range_type);
+    Py_CLEAR(state->array_h);
+    Py_CLEAR(state->array_b);
+    Py_CLEAR(state->array_i);
+    Py_CLEAR(state->array_d);
+    Py_CLEAR(state->rokuyou);
+    Py_CLEAR(state->rokuyou_name);
+    Py_CLEAR(state->month_type);
+    Py_CLEAR(state->array_type);
+    Py_CLEAR(state->str_template);
+    Py_CLEAR(state->str_leap_template);
+    Py_CLEAR(state->str_template_name);
+    Py_CLEAR(state->str_leap_template_name);
+    free_list_trim(state, 0);
+    thread_pool_trim(state, 0);
+    return 0;
+}
+
+
+static void
+module_free(void *module)
+{
+    module_clear((PyObject *)module);
+}
+
+
 static PyModuleDef_Slot module_slots[] = {
     {Py_mod_exec, module_exec},
     {0, NULL}
@@ -843,7 +5958,12 @@ static PyModuleDef_Slot module_slots[] = {
 static struct PyModuleDef qreki_module = {
     PyModuleDef_HEAD_INIT,
     .m_name = "_qreki",
+    .m_size = sizeof(qreki_state),
+    .m_methods = module_methods,
     .m_slots = module_slots,
+    .m_traverse = module_traverse,
+    .m_clear = module_clear,
+    .m_free = module_free,
 };
 
 
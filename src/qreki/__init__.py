@@ -41,11 +41,21 @@ http://d.hatena.ne.jp/fgshun/
 """
 
 
-__all__ = ['ORIGINAL_VERSION', 'ORIGINAL_VERSION_INFO', 'VERSION',
-           'VERSION_INFO', 'Kyureki', 'rokuyou_from_date',
-           'rokuyou_from_ymd']
-
-from qreki.qreki import Kyureki, rokuyou_from_date, rokuyou_from_ymd
+__all__ = ['ORIGINAL_VERSION', 'ORIGINAL_VERSION_INFO', 'SEKKI', 'VERSION',
+           'VERSION_INFO', 'Kyureki', 'KyurekiArray', 'KyurekiMonth',
+           'find_dates', 'find_ordinals', 'format_kyureki', 'from_ordinals',
+           'moon_age', 'moon_age_from_ordinals', 'rokuyou_from_date',
+           'rokuyou_from_ordinal', 'rokuyou_from_ordinals', 'rokuyou_from_ymd',
+           'sekki', 'sekki_from_ordinals', 'sekki_of_year', 'to_ordinals',
+           'year_calendar']
+
+from qreki.qreki import (SEKKI, Kyureki, KyurekiArray, KyurekiMonth,
+                         find_dates, find_ordinals, format_kyureki,
+                         from_ordinals, moon_age, moon_age_from_ordinals,
+                         rokuyou_from_date, rokuyou_from_ordinal,
+                         rokuyou_from_ordinals, rokuyou_from_ymd, sekki,
+                         sekki_from_ordinals, sekki_of_year, to_ordinals,
+                         year_calendar)
 
 VERSION_INFO: tuple[int, int, int] = (0, 6, 0)
 VERSION: str = '.'.join(map(str, VERSION_INFO))
@@ -1,7 +1,16 @@
 import argparse
+import array
+import csv
 import datetime
+import functools
+import io
+import itertools
+import sys
 
-from qreki import VERSION, Kyureki
+from qreki import VERSION, Kyureki, from_ordinals
+from qreki.qreki import TZ
+
+STREAM_CHUNK = 65536  # --stream でまとめて変換する行 (CSV ではレコード) の数
 
 
 def _print_date(shinreki, kyureki):
@@ -9,6 +18,162 @@ def _print_date(shinreki, kyureki):
           shinreki, kyureki))
 
 
+def _print_range(start, stop):
+    d = start
+    d1 = datetime.timedelta(1)
+    for k in Kyureki.range(start, stop):
+        _print_date(d, k)
+        d += d1
+
+
+@functools.lru_cache(maxsize=4096)
+def _parse_ordinal(text):
+    return datetime.date.fromisoformat(text).toordinal()
+
+
+def _convert_rows(rows, column, tz, threads, skip_invalid, linenos):
+    """rows を変換した出力を返す
+
+    column が None ならば rows は行の文字列で各行が日付、そうでなければ
+    rows は CSV のレコードで column 列目が日付。
+    結果として旧暦年, 旧暦月, 閏月フラグ, 旧暦日, 六曜を行の末尾に加える。
+    linenos は各 rows の行番号で、エラーの表示に使う。"""
+    if column is None:
+        rows = [line.strip() for line in rows]
+        fields = rows
+    else:
+        fields = [row[column] if len(row) > column else '' for row in rows]
+
+    ordinals = array.array('i')
+    kept = []
+    for i, field in enumerate(fields):
+        if column is None and not field:
+            continue
+        try:
+            # 日時が続いていてもよい (2017-10-17T12:00:00 など)
+            ordinals.append(_parse_ordinal(field.strip()[:10]))
+        except ValueError:
+            message = 'line {}: invalid date {!r}'.format(linenos[i], field)
+            if not skip_invalid:
+                raise ValueError(message) from None
+            print(message, file=sys.stderr)
+            continue
+        kept.append(rows[i])
+
+    year, month, leap_month, day, rokuyou = from_ordinals(
+            ordinals, tz, threads=threads)
+    names = Kyureki.ROKUYOU
+
+    if column is None:
+        # 同じ日付が続くことが多いので、加える部分は日付ごとに 1 度だけ作る
+        suffixes = {}
+        parts = []
+        for i, row in enumerate(kept):
+            suffix = suffixes.get(ordinals[i])
+            if suffix is None:
+                suffix = suffixes[ordinals[i]] = ',{},{},{},{},{}\n'.format(
+                        year[i], month[i], leap_month[i], day[i],
+                        names[rokuyou[i]])
+            parts.append(row)
+            parts.append(suffix)
+        return ''.join(parts)
+
+    out = io.StringIO()
+    writer = csv.writer(out, lineterminator='\n')
+    for i, row in enumerate(kept):
+        writer.writerow(row + [year[i], month[i], leap_month[i], day[i],
+                               names[rokuyou[i]]])
+    return out.getvalue()
+
+
+def _read_chunks(paths, header, column):
+    """(行番号の列, 行のリスト) を STREAM_CHUNK 行ずつ返す
+
+    column を指定したときは 1 つの csv.reader で読み、行の代わりに空でない
+    レコードを返す。レコードは改行を含むことがあるので、行番号は各レコードの
+    先頭の行とする。見出し行は列名を加えて (None, [出力する行]) として返す。"""
+    names = ['kyureki_year', 'kyureki_month', 'leap_month', 'kyureki_day',
+             'rokuyou']
+    for path in paths:
+        if path == '-':
+            f = sys.stdin
+        else:
+            f = open(path, encoding='utf-8', newline='')
+        try:
+            if column is None:
+                lineno = 1
+                if header:
+                    line = f.readline()
+                    lineno += 1
+                    if line:
+                        yield None, [','.join([line.strip()] + names) + '\n']
+                while True:
+                    lines = list(itertools.islice(f, STREAM_CHUNK))
+                    if not lines:
+                        break
+                    yield range(lineno, lineno + len(lines)), lines
+                    lineno += len(lines)
+                continue
+
+            reader = csv.reader(f)
+            if header:
+                row = next(reader, None)
+                if row is not None:
+                    out = io.StringIO()
+                    csv.writer(out, lineterminator='\n').writerow(row + names)
+                    yield None, [out.getvalue()]
+            linenos = []
+            rows = []
+            lineno = reader.line_num + 1
+            for row in reader:
+                if row:
+                    linenos.append(lineno)
+                    rows.append(row)
+                lineno = reader.line_num + 1
+                if len(rows) == STREAM_CHUNK:
+                    yield linenos, rows
+                    linenos = []
+                    rows = []
+            if rows:
+                yield linenos, rows
+        finally:
+            if f is not sys.stdin:
+                f.close()
+
+
+def _stream(args):
+    """ファイルまたは標準入力の日付を旧暦に変換して書き出す
+
+    変換はまとめて from_ordinals で行う。 --threads は from_ordinals に渡し、
+    --processes を指定するとチャンクごとに別プロセスで変換する。"""
+    convert = functools.partial(_convert_rows, column=args.column, tz=args.tz,
+                                threads=args.threads,
+                                skip_invalid=args.skip_invalid)
+    chunks = _read_chunks(args.files or ['-'], args.header, args.column)
+    items = ((convert, chunk) for chunk in chunks)
+
+    try:
+        if args.processes > 1:
+            import multiprocessing
+            with multiprocessing.Pool(args.processes) as pool:
+                for text in pool.imap(_convert_chunk, items):
+                    sys.stdout.write(text)
+        else:
+            for text in map(_convert_chunk, items):
+                sys.stdout.write(text)
+    except ValueError as e:
+        sys.stdout.flush()
+        sys.exit(str(e))
+    sys.stdout.flush()
+
+
+def _convert_chunk(item):
+    convert, (linenos, rows) = item
+    if linenos is None:
+        return ''.join(rows)
+    return convert(rows, linenos=linenos)
+
+
 def main():
     parser = argparse.ArgumentParser()
     parser.add_argument('year', nargs='?', type=int)
@@ -17,28 +182,56 @@ def main():
     parser.add_argument('--version',
                         action='version',
                         version='%(prog)s ' + VERSION)
+    parser.add_argument('--dump-table', metavar='FILE',
+                        help='朔日テーブルを FILE に書き出す (C 拡張が必要)')
+    parser.add_argument('--tz', type=float, default=TZ,
+                        help='--dump-table, --stream のタイムゾーン (日単位)')
+
+    stream = parser.add_argument_group(
+            'stream',
+            '日付を 1 行ずつ読み、 旧暦年, 旧暦月, 閏月フラグ, 旧暦日, 六曜 を'
+            '加えた CSV を書き出す')
+    stream.add_argument('--stream', nargs='*', metavar='FILE', dest='files',
+                        help='FILE (省略時や - は標準入力) を変換する')
+    stream.add_argument('--column', type=int, metavar='N',
+                        help='入力を CSV とみなし、 N 列目 (0 から数える) の日付を使う')
+    stream.add_argument('--header', action='store_true',
+                        help='各ファイルの 1 行目を見出しとして扱う')
+    stream.add_argument('--skip-invalid', action='store_true',
+                        help='日付として読めない行を標準エラーに示して読み飛ばす')
+    stream.add_argument('--threads', type=int, default=1,
+                        help='from_ordinals のスレッド数')
+    stream.add_argument('--processes', type=int, default=1,
+                        help='変換に使うプロセス数')
     args = parser.parse_args()
 
-    if args.year is None:
+    if args.dump_table is not None:
+        try:
+            import qreki._qreki
+        except ImportError:
+            sys.exit('--dump-table requires the C extension')
+        qreki._qreki.dump_table(args.dump_table, args.tz)
+
+    elif args.files is not None:
+        _stream(args)
+
+    elif args.year is None:
         d = datetime.date.today()
         k = Kyureki.from_date(d)
         _print_date(d, k)
 
     elif args.month is None:
-        d = datetime.date(args.year, 1, 1)
-        d1 = datetime.timedelta(1)
-        while d.year == args.year:
-            k = Kyureki.from_date(d)
-            _print_date(d, k)
-            d += d1
+        start = datetime.date(args.year, 1, 1)
+        stop = datetime.date(args.year + 1, 1, 1)
+        _print_range(start, stop)
 
     elif args.day is None:
-        d = datetime.date(args.year, args.month, 1)
-        d1 = datetime.timedelta(1)
-        while d.month == args.month:
-            k = Kyureki.from_date(d)
-            _print_date(d, k)
-            d += d1
+        start = datetime.date(args.year, args.month, 1)
+        if args.month == 12:
+            stop = datetime.date(args.year + 1, 1, 1)
+        else:
+            stop = datetime.date(args.year, args.month + 1, 1)
+        _print_range(start, stop)
 
     else:
         d = datetime.date(args.year, args.month, args.day)
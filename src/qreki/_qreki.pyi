@@ -1,6 +1,6 @@
 import datetime
-from collections.abc import Sequence
-from typing import ClassVar
+from collections.abc import Iterable, Iterator, Sequence
+from typing import Any, ClassVar, Literal, Optional, overload
 
 class Kyureki:
     ROKUYOU: ClassVar[Sequence[str]]
@@ -16,6 +16,45 @@ class Kyureki:
     def from_date(cls, date: datetime.date, tz: float = ...) -> Kyureki:
         ...
 
+    @classmethod
+    def from_key(cls, key: int) -> Kyureki:
+        ...
+
+    @classmethod
+    def from_ordinal(cls, ordinal: int, tz: float = ...) -> Kyureki:
+        ...
+
+    @classmethod
+    def range(cls, start: datetime.date, stop: datetime.date,
+              tz: float = ...) -> Iterator[Kyureki]:
+        ...
+
+    def to_ordinal(self, tz: float = ...) -> int:
+        ...
+
+    def to_date(self, tz: float = ...) -> datetime.date:
+        ...
+
+    def add_days(self, days: int, tz: float = ...) -> Kyureki:
+        ...
+
+    def add_months(self, months: int, tz: float = ...) -> Kyureki:
+        ...
+
+    def __add__(self, other: int) -> Kyureki:
+        ...
+
+    def __radd__(self, other: int) -> Kyureki:
+        ...
+
+    @overload
+    def __sub__(self, other: int) -> Kyureki:
+        ...
+
+    @overload
+    def __sub__(self, other: Kyureki) -> int:
+        ...
+
     @property
     def year(self) -> int:
         ...
@@ -32,6 +71,10 @@ class Kyureki:
     def day(self) -> int:
         ...
 
+    @property
+    def key(self) -> int:
+        ...
+
     @property
     def rokuyou(self) -> str:
         ...
@@ -47,3 +90,218 @@ class Kyureki:
 
     def __ge__(self, other: Kyureki) -> bool:
         ...
+
+
+def from_ordinals(ordinals: Any, tz: float = ..., *,
+                  year: Optional[Any] = ...,
+                  month: Optional[Any] = ...,
+                  leap_month: Optional[Any] = ...,
+                  day: Optional[Any] = ...,
+                  rokuyou: Optional[Any] = ...,
+                  threads: int = ...) -> tuple[Any, Any, Any, Any, Any]:
+    ...
+
+
+def to_ordinals(year: Any, month: Any, leap_month: Any, day: Any,
+                tz: float = ..., *, out: Optional[Any] = ...) -> Any:
+    ...
+
+
+def rokuyou_from_date(date: datetime.date, tz: float = ...) -> str:
+    ...
+
+
+def rokuyou_from_ordinal(ordinal: int, tz: float = ...) -> str:
+    ...
+
+
+def rokuyou_from_ordinals(ordinals: Any, tz: float = ..., *,
+                          out: Optional[Any] = ...) -> Any:
+    ...
+
+
+def dump_table(path: str, tz: float = ...) -> None:
+    ...
+
+
+def load_table(path: str) -> None:
+    ...
+
+
+def sekki(start: datetime.date, stop: datetime.date,
+          tz: float = ...) -> list[tuple[int, datetime.datetime]]:
+    ...
+
+
+def sekki_of_year(year: int, tz: float = ...) -> list[tuple[int, datetime.datetime]]:
+    ...
+
+
+def sekki_from_ordinals(ordinals: Any, tz: float = ..., *,
+                        out: Optional[Any] = ...) -> Any:
+    ...
+
+
+def moon_age(date: datetime.date, tz: float = ...) -> float:
+    ...
+
+
+def moon_age_from_ordinals(ordinals: Any, tz: float = ..., *, hour: float = ...,
+                           out: Optional[Any] = ...) -> Any:
+    ...
+
+
+class KyurekiMonth(tuple[int, int, datetime.date, int]):
+    @property
+    def month(self) -> int:
+        ...
+
+    @property
+    def leap_month(self) -> int:
+        ...
+
+    @property
+    def start(self) -> datetime.date:
+        ...
+
+    @property
+    def days(self) -> int:
+        ...
+
+
+def year_calendar(year: int, tz: float = ...) -> tuple[KyurekiMonth, ...]:
+    ...
+
+
+def find_ordinals(start: datetime.date, stop: datetime.date, tz: float = ..., *,
+                  rokuyou: Any = ..., day: Any = ..., month: Any = ...,
+                  leap_month: Any = ..., weekday: Any = ...) -> Any:
+    ...
+
+
+def find_dates(start: datetime.date, stop: datetime.date, tz: float = ..., *,
+               rokuyou: Any = ..., day: Any = ..., month: Any = ...,
+               leap_month: Any = ..., weekday: Any = ...) -> list[datetime.date]:
+    ...
+
+
+@overload
+def format_kyureki(values: Iterable[Any], sep: str = ..., *,
+                   as_bytes: Literal[False] = ...) -> str:
+    ...
+
+
+@overload
+def format_kyureki(values: Iterable[Any], sep: str = ..., *,
+                   as_bytes: Literal[True]) -> bytes:
+    ...
+
+
+class KyurekiArray:
+    # バッファプロトコルを持つのは各列の memoryview だけで、KyurekiArray 自体は持たない
+    year: memoryview
+    month: memoryview
+    leap_month: memoryview
+    day: memoryview
+
+    def __init__(self, year: Any, month: Any, leap_month: Any, day: Any) -> None:
+        ...
+
+    @classmethod
+    def from_ordinals(cls, ordinals: Any, tz: float = ..., *,
+                      threads: int = ...) -> KyurekiArray:
+        ...
+
+    def __len__(self) -> int:
+        ...
+
+    @overload
+    def __getitem__(self, key: int) -> Kyureki:
+        ...
+
+    @overload
+    def __getitem__(self, key: slice) -> KyurekiArray:
+        ...
+
+    def rokuyou(self, *, out: Optional[Any] = ...) -> Any:
+        ...
+
+
+def window_cache_info() -> tuple[int, int, int, int]:
+    ...
+
+
+def window_cache_clear() -> None:
+    ...
+
+
+def set_window_cache_size(maxsize: int) -> None:
+    ...
+
+
+def tz_tables_info() -> tuple[tuple[float, ...], int]:
+    ...
+
+
+def tz_tables_clear() -> None:
+    ...
+
+
+def set_tz_tables_size(maxsize: int) -> None:
+    ...
+
+
+def free_list_info() -> tuple[int, int]:
+    ...
+
+
+def free_list_clear() -> None:
+    ...
+
+
+def set_free_list_size(maxsize: int) -> None:
+    ...
+
+
+def thread_pool_info() -> tuple[int, int]:
+    ...
+
+
+def thread_pool_clear() -> None:
+    ...
+
+
+def set_thread_pool_size(maxsize: int) -> None:
+    ...
+
+
+def stats() -> dict[str, int] | None:
+    ...
+
+
+def reset_stats() -> None:
+    ...
+
+
+def series_kernel() -> str:
+    ...
+
+
+def set_series_kernel(name: str) -> None:
+    ...
+
+
+def solver() -> str:
+    ...
+
+
+def set_solver(name: str) -> None:
+    ...
+
+
+def solver_precision() -> str:
+    ...
+
+
+def set_solver_precision(name: str) -> None:
+    ...
@@ -1,15 +1,36 @@
 from __future__ import annotations
 
+import array
 import datetime
 import math
-from typing import Sequence
+import os
+import pickle
+import warnings
+from typing import (Any, Iterable, Iterator, NamedTuple, Optional, Sequence,
+                    Union)
+
+# スピードアップ用の C 言語版。あれば各クラス、関数をそちらに差し替え、
+# 純 Python 版は先頭に _ を付けた名前で残す
+try:
+    from qreki import _qreki
+except ImportError:
+    _qreki = None  # type: ignore
 
 DEG_TO_RAD: float = math.pi / 180.0  # （角度の）度からラジアンに変換する係数
 TZ: float = 0.375  # +9.0/24.0 (JST)
 
+# 二十四節気。添字は太陽の黄経 / 15 度で、春分 (黄経 0 度) から始まる
+SEKKI: Sequence[str] = ('春分', '清明', '穀雨', '立夏', '小満', '芒種',
+                        '夏至', '小暑', '大暑', '立秋', '処暑', '白露',
+                        '秋分', '寒露', '霜降', '立冬', '小雪', '大雪',
+                        '冬至', '小寒', '大寒', '立春', '雨水', '啓蟄')
+
 
 class Kyureki:
-    """旧暦を表すクラス"""
+    """旧暦を表すクラス
+
+    year は 0..65535, month は 0..255, leap_month は 0 か 1, day は 0..127 。
+    key に詰められない値は ValueError とする。"""
 
     __slots__ = ('_year', '_month', '_leap_month', '_day')
 
@@ -20,6 +41,15 @@ class Kyureki:
     _day: int
 
     def __new__(cls, year: int, month: int, leap_month: int, day: int) -> Kyureki:
+        # key に詰められない値は受け付けない。 C 言語版と同じ範囲
+        if not 0 <= year <= 0xFFFF:
+            raise ValueError('year must be in 0..65535')
+        if not 0 <= month <= 0xFF:
+            raise ValueError('month must be in 0..255')
+        if leap_month not in (0, 1):
+            raise ValueError('leap_month must be 0 or 1')
+        if not 0 <= day <= 127:
+            raise ValueError('day must be in 0..127')
         self = super().__new__(cls)
         self._year = year
         self._month = month
@@ -41,6 +71,82 @@ class Kyureki:
         kyureki = _kyureki_from_date(date, tz)
         return cls(*kyureki)
 
+    @classmethod
+    def from_key(cls, key: int) -> Kyureki:
+        """Kyureki.key の値より旧暦を得る"""
+        if not 0 <= key <= 0xFFFFFFFF:
+            raise ValueError('key {:d} is out of range'.format(key))
+        return cls(key >> 16, (key >> 8) & 0xFF, (key >> 7) & 1, key & 0x7F)
+
+    @classmethod
+    def from_ordinal(cls, ordinal: int, tz: float = TZ) -> Kyureki:
+        """新暦の序数 (datetime.date.toordinal() の値) より旧暦を得る"""
+        date = datetime.date.fromordinal(ordinal)
+        return cls.from_date(date, tz)
+
+    @classmethod
+    def range(cls, start: datetime.date, stop: datetime.date,
+              tz: float = TZ) -> Iterator[Kyureki]:
+        """start 以上 stop 未満の新暦の各日に対応する旧暦を順に得る"""
+        for ordinal in range(start.toordinal(), stop.toordinal()):
+            date = datetime.date.fromordinal(ordinal)
+            yield cls.from_date(date, tz)
+
+    def to_ordinal(self, tz: float = TZ) -> int:
+        """対応する新暦の序数 (datetime.date.toordinal() の値) を得る
+
+        存在しない閏月や、小の月の 30 日などは ValueError とする。"""
+        return _kyureki_to_ordinal(
+                self._year, self._month, self._leap_month, self._day, tz)
+
+    def to_date(self, tz: float = TZ) -> datetime.date:
+        """対応する新暦を datetime.date で得る"""
+        return datetime.date.fromordinal(self.to_ordinal(tz))
+
+    def add_days(self, days: int, tz: float = TZ) -> Kyureki:
+        """新暦で days 日後の旧暦を得る"""
+        ordinal = self.to_ordinal(tz) + days
+        if not 1 <= ordinal <= datetime.date.max.toordinal():
+            raise ValueError('date is out of range')
+        return type(self).from_ordinal(ordinal, tz)
+
+    def add_months(self, months: int, tz: float = TZ) -> Kyureki:
+        """months か月後の同じ日の旧暦を得る
+
+        閏月も 1 か月と数える。その月にない日 (小の月の 30 日) は月末とする。"""
+        ordinal = self.to_ordinal(tz)
+        if not -130000 <= months <= 130000:
+            raise ValueError('date is out of range')
+        key = _kyureki_key(self._year, self._month, self._leap_month, self._day)
+        start = _month_start(ordinal, key, tz)
+        key = _kyureki_key_from_ordinal(start, tz)
+        for _ in range(months):
+            start = _month_end(start, key, tz)
+            key = _kyureki_key_from_ordinal(start, tz)
+        for _ in range(-months):
+            key = _kyureki_key_from_ordinal(start - 1, tz)
+            start = _month_start(start - 1, key, tz)
+            key = _kyureki_key_from_ordinal(start, tz)
+        days = _month_end(start, key, tz) - start
+        return type(self).from_ordinal(start + min(self._day, days) - 1, tz)
+
+    def __add__(self, other: int) -> Kyureki:
+        if not isinstance(other, int) or isinstance(other, bool):
+            return NotImplemented
+        return self.add_days(other)
+
+    __radd__ = __add__
+
+    def __sub__(self, other: Any) -> Any:
+        """Kyureki - int は日数を戻し、 Kyureki - Kyureki は日数の差を得る"""
+        if isinstance(other, bool):
+            return NotImplemented
+        if isinstance(other, int):
+            return self.add_days(-other)
+        if not isinstance(other, type(self)):
+            return NotImplemented
+        return self.to_ordinal() - other.to_ordinal()
+
     @property
     def year(self) -> int:
         """旧暦の年"""
@@ -63,6 +169,15 @@ class Kyureki:
         """旧暦の日"""
         return self._day
 
+    @property
+    def key(self) -> int:
+        """年, 月, 閏月, 日の順に比較できる整数
+
+        year << 16 | month << 8 | leap_month << 7 | day 。
+        比較とハッシュ値はこの値による。"""
+        return _kyureki_key(self._year, self._month, self._leap_month,
+                            self._day)
+
     @property
     def rokuyou(self) -> str:
         """六曜を得る
@@ -85,95 +200,35 @@ class Kyureki:
     def __lt__(self, other: Kyureki) -> bool:
         if not isinstance(other, type(self)):
             return NotImplemented
-
-        if (self._year < other._year):
-            return True
-        if (self._year > other._year):
-            return False
-        if (self._month < other._month):
-            return True
-        if (self._month > other._month):
-            return False
-        if (self._leap_month < other._leap_month):
-            return True
-        if (self._leap_month > other._leap_month):
-            return False
-        return self._day < other._day
+        return self.key < other.key
 
     def __le__(self, other: Kyureki) -> bool:
         if not isinstance(other, type(self)):
             return NotImplemented
-
-        if (self._year < other._year):
-            return True
-        if (self._year > other._year):
-            return False
-        if (self._month < other._month):
-            return True
-        if (self._month > other._month):
-            return False
-        if (self._leap_month < other._leap_month):
-            return True
-        if (self._leap_month > other._leap_month):
-            return False
-        return self._day <= other._day
+        return self.key <= other.key
 
     def __eq__(self, other: object) -> bool:
         if not isinstance(other, type(self)):
             return NotImplemented
-
-        return (self._year == other._year and
-                self._month == other._month and
-                self._leap_month == other._leap_month and
-                self._day == other._day)
+        return self.key == other.key
 
     def __ne__(self, other: object) -> bool:
         if not isinstance(other, type(self)):
             return NotImplemented
-
-        return (self._year != other._year or
-                self._month != other._month or
-                self._leap_month != other._leap_month or
-                self._day != other._day)
+        return self.key != other.key
 
     def __gt__(self, other: Kyureki) -> bool:
         if not isinstance(other, type(self)):
             return NotImplemented
-
-        if (self._year > other._year):
-            return True
-        if (self._year < other._year):
-            return False
-        if (self._month > other._month):
-            return True
-        if (self._month < other._month):
-            return False
-        if (self._leap_month > other._leap_month):
-            return True
-        if (self._leap_month < other._leap_month):
-            return False
-        return self._day > other._day
+        return self.key > other.key
 
     def __ge__(self, other: Kyureki) -> bool:
         if not isinstance(other, type(self)):
             return NotImplemented
-
-        if (self._year > other._year):
-            return True
-        if (self._year < other._year):
-            return False
-        if (self._month > other._month):
-            return True
-        if (self._month < other._month):
-            return False
-        if (self._leap_month > other._leap_month):
-            return True
-        if (self._leap_month < other._leap_month):
-            return False
-        return self._day >= other._day
+        return self.key >= other.key
 
     def __hash__(self) -> int:
-        return hash((self._year, self._month, self._leap_month, self._day))
+        return hash(self.key)
 
 
 def _kyureki_from_date(date: datetime.date, tz: float):
@@ -297,6 +352,73 @@ def _kyureki_from_date(date: datetime.date, tz: float):
     return kyureki_year, kyureki_month, kyureki_leap, kyureki_day
 
 
+def _kyureki_key(year: int, month: int, leap_month: int, day: int) -> int:
+    """年, 月, 閏月, 日の順に比較できる整数 (Kyureki.key と同じ値)"""
+    return year << 16 | month << 8 | leap_month << 7 | day
+
+
+def _kyureki_to_ordinal(year: int, month: int, leap_month: int, day: int,
+                        tz: float) -> int:
+    """旧暦に対応する、新暦の序数を求める
+
+    旧暦は新暦に対して単調に増えるので、見積もった範囲を二分探索する。
+    月の切り替わりで日が飛ぶことがあるため、月初からの日数では求めない。"""
+    if not 1 <= month <= 12 or leap_month not in (0, 1):
+        raise ValueError('no such kyureki month')
+    if not 1 <= day <= 30:
+        raise ValueError('day is out of range for month')
+    target = _kyureki_key(year, month, leap_month, day)
+    first = datetime.date.min.toordinal()
+    last = datetime.date.max.toordinal()
+
+    def key(ordinal: int) -> int:
+        date = datetime.date.fromordinal(ordinal)
+        return _kyureki_key(*_kyureki_from_date(date, tz))
+
+    # 旧暦の正月はおおむね新暦の 1 月下旬から 2 月中旬
+    y = year - 1
+    lo = (y * 365 + y // 4 - y // 100 + y // 400 + 1
+          + int((month - 1) * 29.530589) - 30)
+    hi = lo + 150
+
+    lo = max(lo, first)
+    while True:
+        if lo > last:
+            raise ValueError('date is out of range')
+        k = key(lo)
+        if k == target:
+            return lo
+        if k < target:
+            break
+        if lo == first:
+            raise ValueError('date is out of range')
+        lo = max(lo - 64, first)
+    hi = min(hi, last)
+    while True:
+        hi = max(hi, lo)
+        if key(hi) >= target:
+            break
+        if hi == last:
+            raise ValueError('date is out of range')
+        hi = min(hi + 64, last)
+
+    # key(lo) < target <= key(hi)
+    while hi - lo > 1:
+        mid = lo + (hi - lo) // 2
+        if key(mid) < target:
+            lo = mid
+        else:
+            hi = mid
+
+    k = key(hi)
+    if k == target:
+        return hi
+    # 前後の日が同じ月ならば、その月にない日を指定している
+    if k >> 7 == target >> 7 or key(lo) >> 7 == target >> 7:
+        raise ValueError('day is out of range for month')
+    raise ValueError('no such kyureki month')
+
+
 def _chuki_from_jd(tm: float, tz: float):
     """中気の時刻を求める
 
@@ -306,58 +428,42 @@ def _chuki_from_jd(tm: float, tz: float):
     戻り値:
         中気の時刻（ローカル補正込みのユリウス通日）と
         その時の黄経のタプル"""
-    # 時刻引数を分解する
-    tm2, tm1 = math.modf(tm)
-
-    # JST ==> DT （補正時刻=0.0sec と仮定して計算）
-    tm2 -= tz
+    return _term_from_jd(tm, tz, 30.0)
 
-    # 中気の黄経 λsun0 を求める
-    t = (tm2 + 0.5) / 36525.0 + (tm1 - 2451545.0) / 36525.0
-    rm_sun = _longitude_of_sun(t)
-    rm_sun0 = rm_sun - rm_sun % 30.0
-
-    # 繰り返し計算によって中気の時刻を計算する
-    # （誤差が±1.0 sec以内になったら打ち切る。）
-    delta_t1 = 0.0
-    delta_t2 = 1.0
-    while abs(delta_t1 + delta_t2) > 1.0 / 86400.0:
-        # λsun を計算
-        t = (tm2 + 0.5) / 36525.0 + (tm1 - 2451545.0) / 36525.0
-        rm_sun = _longitude_of_sun(t)
 
-        # 黄経差 Δλ＝λsun －λsun0
-        delta_rm = rm_sun - rm_sun0
+def _before_nibun_from_jd(tm: float, tz: float):
+    """直前の二分二至の時刻を求める
 
-        # Δλの引き込み範囲（±180°）を逸脱した場合には、補正を行う
-        if delta_rm > 180.0:
-            delta_rm -= 360.0
-        elif delta_rm < -180.0:
-            delta_rm += 360.0
+    引数:
+        tm: 計算対象となる時刻（ローカル補正込みのユリウス通日）
+        tz: タイムゾーン
+    戻り値:
+        二分二至の時刻（ローカル補正込みのユリウス通日）と
+        その時の黄経のタプル"""
+    return _term_from_jd(tm, tz, 90.0)
 
-        # 時刻引数の補正値 Δt
-        # delta_t = delta_rm * 365.2 / 360.0;
-        delta_t2, delta_t1 = math.modf(delta_rm * 365.2 / 360.0)
 
-        # 時刻引数の補正
-        # tm -= delta_t;
-        tm1 -= delta_t1
-        tm2 -= delta_t2
-        if tm2 < 0.0:
-            tm2 += 1.0
-            tm1 -= 1.0
+def _sekki_from_jd(tm: float, tz: float):
+    """直前の二十四節気の時刻を求める
 
-    return (tm1 + tm2 + tz, rm_sun0)
+    引数:
+        tm: 計算対象となる時刻（ローカル補正込みのユリウス通日）
+        tz: タイムゾーン
+    戻り値:
+        節気の時刻（ローカル補正込みのユリウス通日）と
+        その時の黄経のタプル"""
+    return _term_from_jd(tm, tz, 15.0)
 
 
-def _before_nibun_from_jd(tm: float, tz: float):
-    """直前の二分二至の時刻を求める
+def _term_from_jd(tm: float, tz: float, degree: float):
+    """直前の、太陽の黄経が degree 度の倍数となる時刻を求める
 
     引数:
         tm: 計算対象となる時刻（ローカル補正込みのユリウス通日）
         tz: タイムゾーン
+        degree: 黄経の刻み。節気は 15 、中気は 30 、二分二至は 90
     戻り値:
-        二分二至の時刻（ローカル補正込みのユリウス通日）と
+        その時刻（ローカル補正込みのユリウス通日）と
         その時の黄経のタプル"""
     # 時刻引数を分解する
     tm2, tm1 = math.modf(tm)
@@ -365,16 +471,16 @@ def _before_nibun_from_jd(tm: float, tz: float):
     # JST ==> DT （補正時刻=0.0sec と仮定して計算）
     tm2 -= tz
 
-    # 直前の二分二至の黄経 λsun0 を求める
+    # 直前の degree 度の倍数の黄経 λsun0 を求める
     t = (tm2 + 0.5) / 36525.0 + (tm1 - 2451545.0) / 36525.0
     rm_sun = _longitude_of_sun(t)
-    rm_sun0 = rm_sun - rm_sun % 90.0
+    rm_sun0 = rm_sun - rm_sun % degree
 
-    # 繰り返し計算によって直前の二分二至の時刻を計算する
+    # 繰り返し計算によって λsun0 となる時刻を計算する
     # （誤差が±1.0 sec以内になったら打ち切る。）
     delta_t1 = 0.0
     delta_t2 = 1.0
-    while abs(delta_t1 + delta_t2) > (1.0 / 86400.0):
+    while abs(delta_t1 + delta_t2) > 1.0 / 86400.0:
         # λsun を計算
         t = (tm2 + 0.5) / 36525.0 + (tm1 - 2451545.0) / 36525.0
         rm_sun = _longitude_of_sun(t)
@@ -672,13 +778,106 @@ def _longitude_of_moon(t: float):
     return th
 
 
-# スピードアップ用の C 言語版が存在すればそちらを使う
+def from_ordinals(ordinals: Any, tz: float = TZ, *,
+                  year: Optional[Any] = None,
+                  month: Optional[Any] = None,
+                  leap_month: Optional[Any] = None,
+                  day: Optional[Any] = None,
+                  rokuyou: Optional[Any] = None,
+                  threads: int = 1) -> tuple[Any, Any, Any, Any, Any]:
+    """新暦の序数の列から旧暦の列を得る
+
+    引数:
+        ordinals: date.toordinal() の値を並べた、バッファプロトコルを
+            サポートするオブジェクト (array.array, memoryview など)。
+            bytes のような型のないバッファは native int の並びとみなす。
+        tz: タイムゾーン
+        year, month, leap_month, day, rokuyou: 結果の書き込み先。
+            省略すると新しい array.array を作る。
+        threads: 変換に使うスレッド数。 C 拡張では GIL を解放して
+            入力を分割し並列に変換する。この実装では無視する。
+    戻り値:
+        (旧暦年, 旧暦月, 閏月フラグ, 旧暦日, 六曜の添字) の 5 つのバッファ"""
+    if threads < 1:
+        raise ValueError('threads must be at least 1')
+    view = memoryview(ordinals)
+    if view.itemsize == 1:
+        view = view.cast('B').cast('i')
+    n = len(view)
+
+    outputs = []
+    for name, out, typecode in (('year', year, 'H'),
+                                ('month', month, 'B'),
+                                ('leap_month', leap_month, 'B'),
+                                ('day', day, 'B'),
+                                ('rokuyou', rokuyou, 'B')):
+        if out is None:
+            out = array.array(typecode, [0]) * n
+        elif len(memoryview(out)) < n:
+            raise ValueError('{} is shorter than ordinals'.format(name))
+        outputs.append(out)
+    views = [memoryview(out) for out in outputs]
+
+    for i, ordinal in enumerate(view):
+        date = datetime.date.fromordinal(ordinal)
+        y, m, leap, d = _kyureki_from_date(date, tz)
+        views[0][i] = y
+        views[1][i] = m
+        views[2][i] = leap
+        views[3][i] = d
+        views[4][i] = (m + d) % 6
+
+    return tuple(outputs)  # type: ignore
+
+
+def to_ordinals(year: Any, month: Any, leap_month: Any, day: Any,
+                tz: float = TZ, *, out: Optional[Any] = None) -> Any:
+    """旧暦の列から新暦の序数の列を得る
+
+    引数:
+        year, month, leap_month, day: 旧暦年, 旧暦月, 閏月フラグ, 旧暦日を
+            並べた、同じ長さのバッファ。 from_ordinals の戻り値をそのまま渡せる。
+        tz: タイムゾーン
+        out: 結果の書き込み先。 4 バイト以上の整数のバッファ。
+            省略すると新しい array.array('i') を作る。
+    戻り値:
+        date.toordinal() の値を並べたバッファ"""
+    views = [memoryview(v) for v in (year, month, leap_month, day)]
+    n = len(views[0])
+    for name, view in zip(('month', 'leap_month', 'day'), views[1:]):
+        if len(view) != n:
+            raise ValueError('{} and year differ in length'.format(name))
+
+    if out is None:
+        out = array.array('i', [0]) * n
+    elif len(memoryview(out)) < n:
+        raise ValueError('out is shorter than the input')
+    out_view = memoryview(out)
+
+    for i in range(n):
+        try:
+            out_view[i] = _kyureki_to_ordinal(
+                    views[0][i], views[1][i], views[2][i], views[3][i], tz)
+        except ValueError as e:
+            raise ValueError('index {}: {}'.format(i, e)) from None
+
+    return out
+
+
 _Kyureki = Kyureki
-try:
-    import qreki._qreki
-    Kyureki = qreki._qreki.Kyureki  # type: ignore
-except ImportError:
-    pass
+_from_ordinals = from_ordinals
+_to_ordinals = to_ordinals
+Kyureki = _qreki.Kyureki if _qreki else _Kyureki  # type: ignore
+from_ordinals = _qreki.from_ordinals if _qreki else _from_ordinals  # type: ignore
+to_ordinals = _qreki.to_ordinals if _qreki else _to_ordinals  # type: ignore
+
+# python -m qreki --dump-table で作ったファイルがあれば、それを共有して使う
+# 読めなければ警告して、必要になった区間から作るテーブルを使う
+if _qreki and os.environ.get('QREKI_TABLE'):
+    try:
+        _qreki.load_table(os.environ['QREKI_TABLE'])
+    except (OSError, ValueError) as e:
+        warnings.warn('QREKI_TABLE is ignored: {}'.format(e), RuntimeWarning)
 
 
 def rokuyou_from_ymd(year: int, month: int, day: int) -> str:
@@ -693,14 +892,14 @@ def rokuyou_from_ymd(year: int, month: int, day: int) -> str:
     旧暦も必要とする場合、 Kyureki.from_ymd(year, month, day) で
     旧暦オブジェクトをつくり、
     これの rokuyou() メソッドを呼ぶほうが効率がよい。"""
-    kyureki = Kyureki.from_ymd(year, month, day)
-    return kyureki.rokuyou
+    return rokuyou_from_date(datetime.date(year, month, day))
 
 
-def rokuyou_from_date(date: datetime.date) -> str:
+def rokuyou_from_date(date: datetime.date, tz: float = TZ) -> str:
     """六曜算出ショートカット
     引数:
         datetime.date （新暦）
+        tz: タイムゾーン
     戻り値:
         六曜 (大安, 赤口, 先勝, 友引, 先負, 仏滅) の文字列
 
@@ -708,5 +907,488 @@ def rokuyou_from_date(date: datetime.date) -> str:
     旧暦も必要とする場合、 Kyureki.from_date(date) で
     旧暦オブジェクトをつくり、
     これの rokuyou() メソッドを呼ぶほうが効率がよい。"""
-    kyureki = Kyureki.from_date(date)
-    return kyureki.rokuyou
+    _, m, _, d = _kyureki_from_date(date, tz)
+    return _Kyureki.ROKUYOU[(m + d) % 6]
+
+
+def rokuyou_from_ordinal(ordinal: int, tz: float = TZ) -> str:
+    """六曜算出ショートカット
+    引数:
+        ordinal: datetime.date.toordinal() の値 （新暦）
+        tz: タイムゾーン
+    戻り値:
+        六曜 (大安, 赤口, 先勝, 友引, 先負, 仏滅) の文字列"""
+    return rokuyou_from_date(datetime.date.fromordinal(ordinal), tz)
+
+
+def rokuyou_from_ordinals(ordinals: Any, tz: float = TZ, *,
+                          out: Optional[Any] = None) -> Any:
+    """新暦の序数の列から六曜の列を得る
+
+    引数:
+        ordinals: from_ordinals と同じ
+        tz: タイムゾーン
+        out: 結果の書き込み先。省略すると新しい array.array('B') を作る。
+    戻り値:
+        六曜の添字 (Kyureki.ROKUYOU の何番目か) を並べたバッファ"""
+    view = memoryview(ordinals)
+    if view.itemsize == 1:
+        view = view.cast('B').cast('i')
+    n = len(view)
+
+    if out is None:
+        out = array.array('B', [0]) * n
+    elif len(memoryview(out)) < n:
+        raise ValueError('out is shorter than the input')
+    out_view = memoryview(out)
+
+    for i, ordinal in enumerate(view):
+        date = datetime.date.fromordinal(ordinal)
+        _, m, _, d = _kyureki_from_date(date, tz)
+        out_view[i] = (m + d) % 6
+
+    return out
+
+
+_rokuyou_from_date = rokuyou_from_date
+_rokuyou_from_ordinal = rokuyou_from_ordinal
+_rokuyou_from_ordinals = rokuyou_from_ordinals
+rokuyou_from_date = _qreki.rokuyou_from_date if _qreki else _rokuyou_from_date  # type: ignore
+rokuyou_from_ordinal = _qreki.rokuyou_from_ordinal if _qreki else _rokuyou_from_ordinal  # type: ignore
+rokuyou_from_ordinals = _qreki.rokuyou_from_ordinals if _qreki else _rokuyou_from_ordinals  # type: ignore
+
+
+def _sekki_between(first: int, stop: int,
+                   tz: float) -> list[tuple[int, datetime.datetime]]:
+    """[first, stop) の日 (date.toordinal() の値) にある節気を求める
+
+    次の節気は直前の節気の 16 日後を初期値として求める。"""
+    ret = []
+    tm, longitude = _sekki_from_jd(first + 1721424, tz)
+    while math.floor(tm) - 1721424 < stop:
+        if math.floor(tm) - 1721424 >= first:
+            ret.append((round(longitude / 15.0) % 24, _sekki_instant(tm)))
+        tm, longitude = _sekki_from_jd(tm + 16.0, tz)
+    return ret
+
+
+def _sekki_instant(tm: float) -> datetime.datetime:
+    """節気の時刻 tm (ローカル補正込みのユリウス通日) を秒に丸めた datetime にする"""
+    day = math.floor(tm)
+    seconds = math.floor((tm - day) * 86400.0 + 0.5)
+    return (datetime.datetime.fromordinal(day - 1721424) +
+            datetime.timedelta(seconds=seconds))
+
+
+def sekki(start: datetime.date, stop: datetime.date,
+          tz: float = TZ) -> list[tuple[int, datetime.datetime]]:
+    """二十四節気の時刻を求める
+
+    引数:
+        start, stop: 新暦の期間。 start 以降 stop より前の日にある節気を求める
+        tz: タイムゾーン
+    戻り値:
+        (節気の添字, 時刻) のリスト。添字は SEKKI の何番目か。
+        時刻はタイムゾーン tz の datetime (tzinfo なし) で、秒に丸めてある"""
+    return _sekki_between(start.toordinal(), stop.toordinal(), tz)
+
+
+def sekki_of_year(year: int,
+                  tz: float = TZ) -> list[tuple[int, datetime.datetime]]:
+    """新暦 year 年の二十四節気の時刻を求める
+
+    戻り値は sekki と同じ。小寒から冬至までの 24 件になる。"""
+    first = datetime.date(year, 1, 1).toordinal()
+    last = datetime.date(year, 12, 31).toordinal()
+    return _sekki_between(first, last + 1, tz)
+
+
+def sekki_from_ordinals(ordinals: Any, tz: float = TZ, *,
+                        out: Optional[Any] = None) -> Any:
+    """新暦の序数の列から、それぞれの日が属する節気の列を得る
+
+    節気の時刻を含む日から、次の節気の前日までをその節気の期間とする。
+
+    引数:
+        ordinals: from_ordinals と同じ
+        tz: タイムゾーン
+        out: 結果の書き込み先。省略すると新しい array.array('B') を作る。
+    戻り値:
+        節気の添字 (SEKKI の何番目か) を並べたバッファ"""
+    view = memoryview(ordinals)
+    if view.itemsize == 1:
+        view = view.cast('B').cast('i')
+    n = len(view)
+
+    if out is None:
+        out = array.array('B', [0]) * n
+    elif len(memoryview(out)) < n:
+        raise ValueError('out is shorter than the input')
+    out_view = memoryview(out)
+
+    # 隣りあう日付は同じ期間であることが多いので、直前の期間を覚えておく
+    start = end = index = 0
+    for i, ordinal in enumerate(view):
+        if not 1 <= ordinal <= datetime.date.max.toordinal():
+            raise ValueError('ordinal {} is out of range'.format(ordinal))
+        if not start <= ordinal < end:
+            # その日の終わりより前の節気と、その次の節気
+            tm, longitude = _sekki_from_jd(ordinal + 1721425, tz)
+            index = round(longitude / 15.0) % 24
+            start = math.floor(tm) - 1721424
+            end = math.floor(_sekki_from_jd(tm + 16.0, tz)[0]) - 1721424
+        out_view[i] = index
+
+    return out
+
+
+_sekki = sekki
+_sekki_of_year = sekki_of_year
+_sekki_from_ordinals = sekki_from_ordinals
+sekki = _qreki.sekki if _qreki else _sekki  # type: ignore
+sekki_of_year = _qreki.sekki_of_year if _qreki else _sekki_of_year  # type: ignore
+sekki_from_ordinals = _qreki.sekki_from_ordinals if _qreki else _sekki_from_ordinals  # type: ignore
+
+
+def _moon_age_from_jd(tm: float, tz: float,
+                      span: list[float]) -> float:
+    """時刻 tm (ローカル補正込みのユリウス通日) の月齢 (直前の朔からの日数) を求める
+
+    span は最後に使った前後の朔 [start, end] 。その間にあればそのまま使い、
+    次の朔の間ならばその終わりから 1 つだけ解く。"""
+    if not span[0] <= tm < span[1]:
+        if span[1] <= tm < span[1] + 29.0:
+            start = span[1]
+        else:
+            start = _saku_from_jd(tm, tz)
+            if start > tm:
+                start = _saku_from_jd(start - 15.0, tz)
+        while True:
+            end = _saku_from_jd(start + 30.0, tz)
+            if end - start <= 26.0:
+                end = _saku_from_jd(start + 35.0, tz)
+            if tm < end:
+                break
+            start = end
+        span[:] = [start, end]
+    return tm - span[0]
+
+
+def moon_age(date: datetime.date, tz: float = TZ) -> float:
+    """月齢を求める
+
+    引数:
+        date: datetime.date ならばその日の正午、 datetime.datetime ならば
+            その時刻 (タイムゾーン tz とみなす) の月齢を求める
+        tz: タイムゾーン
+    戻り値:
+        直前の朔からの日数"""
+    tm = date.toordinal() + 1721424
+    if isinstance(date, datetime.datetime):
+        tm += (date.hour * 3600 + date.minute * 60 + date.second +
+               date.microsecond / 1e6) / 86400.0
+    else:
+        tm += 0.5
+    return _moon_age_from_jd(tm, tz, [0.0, 0.0])
+
+
+def moon_age_from_ordinals(ordinals: Any, tz: float = TZ, *,
+                           hour: float = 12.0,
+                           out: Optional[Any] = None) -> Any:
+    """新暦の序数の列から月齢の列を得る
+
+    前後の朔の間は月齢を日数の差で求めるので、日付順に並べると
+    朔を解く回数は 1 か月に 1 回ほどになる。
+
+    引数:
+        ordinals: from_ordinals と同じ
+        tz: タイムゾーン
+        hour: 月齢を求める時刻。既定は正午
+        out: 結果の書き込み先。省略すると新しい array.array('d') を作る。
+    戻り値:
+        月齢を並べたバッファ"""
+    if not 0.0 <= hour < 24.0:
+        raise ValueError('hour must be in [0, 24)')
+    view = memoryview(ordinals)
+    if view.itemsize == 1:
+        view = view.cast('B').cast('i')
+    n = len(view)
+
+    if out is None:
+        out = array.array('d', [0.0]) * n
+    elif len(memoryview(out)) < n:
+        raise ValueError('out is shorter than the input')
+    out_view = memoryview(out)
+
+    span = [0.0, 0.0]
+    for i, ordinal in enumerate(view):
+        if not 1 <= ordinal <= datetime.date.max.toordinal():
+            raise ValueError('ordinal {} is out of range'.format(ordinal))
+        out_view[i] = _moon_age_from_jd(ordinal + 1721424 + hour / 24.0, tz, span)
+
+    return out
+
+
+_moon_age = moon_age
+_moon_age_from_ordinals = moon_age_from_ordinals
+moon_age = _qreki.moon_age if _qreki else _moon_age  # type: ignore
+moon_age_from_ordinals = _qreki.moon_age_from_ordinals if _qreki else _moon_age_from_ordinals  # type: ignore
+
+
+class KyurekiMonth(NamedTuple):
+    """旧暦の 1 か月 (year_calendar の要素)"""
+    month: int
+    leap_month: int
+    start: datetime.date
+    days: int
+
+
+def _kyureki_key_from_ordinal(ordinal: int, tz: float) -> int:
+    if not 1 <= ordinal <= datetime.date.max.toordinal():
+        raise ValueError('date is out of range')
+    date = datetime.date.fromordinal(ordinal)
+    return _kyureki_key(*_kyureki_from_date(date, tz))
+
+
+def _month_end(ordinal: int, key: int, tz: float) -> int:
+    """ordinal (旧暦 key) を含む月の次の月の先頭の序数を求める
+
+    月の長さはほとんど 29 日か 30 日なので、月初から 29 日後の前後だけを調べる。"""
+    end = max(ordinal - (key & 0x7F) + 30, ordinal + 1)
+    while _kyureki_key_from_ordinal(end, tz) >> 7 == key >> 7:
+        end += 1
+    while end - 1 > ordinal and \
+            _kyureki_key_from_ordinal(end - 1, tz) >> 7 != key >> 7:
+        end -= 1
+    return end
+
+
+def _month_start(ordinal: int, key: int, tz: float) -> int:
+    """ordinal (旧暦 key) を含む月の先頭の序数を求める"""
+    start = max(min(ordinal - (key & 0x7F) + 1, ordinal), 1)
+    while start > 1 and \
+            _kyureki_key_from_ordinal(start - 1, tz) >> 7 == key >> 7:
+        start -= 1
+    while start < ordinal and \
+            _kyureki_key_from_ordinal(start, tz) >> 7 != key >> 7:
+        start += 1
+    return start
+
+
+def year_calendar(year: int, tz: float = TZ) -> tuple[KyurekiMonth, ...]:
+    """旧暦の 1 年の月の並びを得る
+
+    引数:
+        year: 旧暦年
+        tz: タイムゾーン
+    戻り値:
+        正月から順に KyurekiMonth (月, 閏月フラグ, 月初の新暦, 日数) を
+        並べたタプル。閏月は同じ月の平月の次に置く。"""
+    # 新暦の 1 月 1 日は前年の 11 月か 12 月なので、そこから 1 か月ずつ進める
+    ordinal = datetime.date(year, 1, 1).toordinal()
+    first = _kyureki_key(year, 1, 0, 0)
+    months = []
+    while True:
+        key = _kyureki_key_from_ordinal(ordinal, tz)
+        if key >> 16 > year:
+            break
+        end = _month_end(ordinal, key, tz)
+        if key >= first:
+            months.append(_KyurekiMonth((key >> 8) & 0xFF, (key >> 7) & 1,
+                                        datetime.date.fromordinal(ordinal),
+                                        end - ordinal))
+        ordinal = end
+    if not months:
+        raise ValueError('date is out of range')
+    return tuple(months)
+
+
+_KyurekiMonth = KyurekiMonth
+_year_calendar = year_calendar
+KyurekiMonth = _qreki.KyurekiMonth if _qreki else _KyurekiMonth  # type: ignore
+year_calendar = _qreki.year_calendar if _qreki else _year_calendar  # type: ignore
+
+
+class KyurekiArray:
+    """旧暦の列
+
+    年 ('H'), 月, 閏月フラグ, 日 ('B') の 4 つのバッファを列として持つ。
+    渡したバッファはコピーせずに読み出し専用の memoryview として参照する。
+    要素を取り出すと Kyureki を作り、スライスは列を共有する。
+    KyurekiArray 自体はバッファプロトコルを持たない。 numpy などへは
+    year, month, leap_month, day の各 memoryview を渡す。"""
+
+    __slots__ = ('_columns',)
+
+    def __init__(self, year: Any, month: Any, leap_month: Any, day: Any):
+        columns = []
+        for name, obj, fmt in (('year', year, 'H'), ('month', month, 'B'),
+                               ('leap_month', leap_month, 'B'),
+                               ('day', day, 'B')):
+            view = memoryview(obj)
+            if view.ndim != 1:
+                raise TypeError('{} must be a 1-dimensional buffer'.format(name))
+            if view.format != fmt:
+                # pickle から受け取る bytes などは fmt の並びとみなす
+                if view.itemsize != 1:
+                    raise TypeError("{} must be a buffer of '{}' or bytes".format(
+                            name, fmt))
+                view = view.cast(fmt)
+            if columns and len(view) != len(columns[0]):
+                raise ValueError('{} and year differ in length'.format(name))
+            columns.append(view.toreadonly())
+        self._columns = tuple(columns)
+
+    @classmethod
+    def from_ordinals(cls, ordinals: Any, tz: float = TZ,
+                      **kwargs: Any) -> KyurekiArray:
+        """from_ordinals の結果から作る"""
+        return cls(*from_ordinals(ordinals, tz, **kwargs)[:4])
+
+    @property
+    def year(self) -> memoryview:
+        """旧暦の年"""
+        return self._columns[0]
+
+    @property
+    def month(self) -> memoryview:
+        """旧暦の月"""
+        return self._columns[1]
+
+    @property
+    def leap_month(self) -> memoryview:
+        """閏月フラグ"""
+        return self._columns[2]
+
+    @property
+    def day(self) -> memoryview:
+        """旧暦の日"""
+        return self._columns[3]
+
+    def __len__(self) -> int:
+        return len(self._columns[0])
+
+    def __getitem__(self, key: Any) -> Any:
+        if isinstance(key, slice):
+            return type(self)(*(c[key] for c in self._columns))
+        return _Kyureki(*(c[key] for c in self._columns))
+
+    def rokuyou(self, *, out: Optional[Any] = None) -> Any:
+        """六曜の添字 (Kyureki.ROKUYOU の何番目か) を並べたバッファを得る"""
+        n = len(self)
+        if out is None:
+            out = array.array('B', [0]) * n
+        elif len(memoryview(out)) < n:
+            raise ValueError('out is shorter than the input')
+        out_view = memoryview(out)
+        for i, (m, d) in enumerate(zip(self._columns[1], self._columns[3])):
+            out_view[i] = (m + d) % 6
+        return out
+
+    def __reduce_ex__(self, protocol: Any) -> Any:
+        # protocol 5 以上では各列を PickleBuffer で渡し、 out-of-band で送れるようにする
+        columns = []
+        for c in self._columns:
+            if protocol < 5:
+                columns.append(c.tobytes())
+            elif c.c_contiguous:
+                columns.append(pickle.PickleBuffer(c))
+            else:
+                columns.append(pickle.PickleBuffer(c.tobytes()))
+        return _kyureki_array, tuple(columns)
+
+    def __repr__(self) -> str:
+        return '<{} of {}>'.format(type(self).__qualname__, len(self))
+
+
+def _kyureki_array(*columns: Any) -> KyurekiArray:
+    # C 言語版があっても、純 Python 版を pickle したものはそのまま戻す
+    return _KyurekiArray(*columns)
+
+
+_KyurekiArray = KyurekiArray
+KyurekiArray = _qreki.KyurekiArray if _qreki else _KyurekiArray  # type: ignore
+
+
+def _query_values(value: Any, name: str, lo: int, hi: int) -> Optional[set]:
+    """find_dates の条件を値の集合にする。 None ならば条件なし"""
+    if value is None:
+        return None
+    if isinstance(value, (int, str)):
+        value = [value]
+    values = set()
+    for v in value:
+        if name == 'rokuyou' and isinstance(v, str):
+            if v not in _Kyureki.ROKUYOU:
+                raise ValueError('unknown rokuyou {!r}'.format(v))
+            v = _Kyureki.ROKUYOU.index(v)
+        if not lo <= v <= hi:
+            raise ValueError('{} must be in {}..{}'.format(name, lo, hi))
+        values.add(v)
+    return values
+
+
+def find_ordinals(start: datetime.date, stop: datetime.date,
+                  tz: float = TZ, *,
+                  rokuyou: Any = None,
+                  day: Any = None,
+                  month: Any = None,
+                  leap_month: Any = None,
+                  weekday: Any = None) -> Any:
+    """start 以上 stop 未満の新暦の日のうち、条件に合う日の序数を得る
+
+    引数:
+        start, stop: 新暦の範囲
+        tz: タイムゾーン
+        rokuyou: 六曜。添字 (Kyureki.ROKUYOU の何番目か) か '大安' などの文字列
+        day, month, leap_month: 旧暦の日, 月, 閏月フラグ
+        weekday: 新暦の曜日 (date.weekday() の値。月曜が 0)
+        それぞれ 1 つの値かそのイテラブル。 None (省略時) は条件にしない。
+    戻り値:
+        date.toordinal() の値を並べた array.array('i')"""
+    conditions = [_query_values(rokuyou, 'rokuyou', 0, 5),
+                  _query_values(day, 'day', 1, 30),
+                  _query_values(month, 'month', 1, 12),
+                  _query_values(leap_month, 'leap_month', 0, 1),
+                  _query_values(weekday, 'weekday', 0, 6)]
+    out = array.array('i')
+    for ordinal in range(start.toordinal(), stop.toordinal()):
+        date = datetime.date.fromordinal(ordinal)
+        _, m, leap, d = _kyureki_from_date(date, tz)
+        values = ((m + d) % 6, d, m, leap, date.weekday())
+        if all(c is None or v in c for c, v in zip(conditions, values)):
+            out.append(ordinal)
+    return out
+
+
+def find_dates(start: datetime.date, stop: datetime.date,
+               tz: float = TZ, **conditions: Any) -> list[datetime.date]:
+    """start 以上 stop 未満の新暦の日のうち、条件に合う日を得る
+
+    条件は find_ordinals と同じ。
+
+    使用例: 2 年間の大安の土日
+        find_dates(date(2017, 1, 1), date(2019, 1, 1),
+                   rokuyou='大安', weekday=(5, 6))"""
+    return [datetime.date.fromordinal(o)
+            for o in _find_ordinals(start, stop, tz, **conditions)]
+
+
+_find_ordinals = find_ordinals
+_find_dates = find_dates
+find_ordinals = _qreki.find_ordinals if _qreki else _find_ordinals  # type: ignore
+find_dates = _qreki.find_dates if _qreki else _find_dates  # type: ignore
+
+
+def format_kyureki(values: Iterable[Any], sep: str = '\n', *,
+                   as_bytes: bool = False) -> Union[str, bytes]:
+    """values の各要素を str にしたものを sep でつないだ文字列を得る
+
+    values は Kyureki の列や KyurekiArray など。
+    as_bytes が真ならば UTF-8 の bytes を返す。"""
+    text = sep.join(map(str, values))
+    return text.encode('utf-8') if as_bytes else text
+
+
+_format_kyureki = format_kyureki
+format_kyureki = _qreki.format_kyureki if _qreki else _format_kyureki  # type: ignore
@@ -1,9 +1,11 @@
+import array
 import datetime
 
 import pytest
 
 import qreki
-from qreki.qreki import Kyureki, _Kyureki
+from qreki.qreki import (Kyureki, _from_ordinals, _Kyureki, _to_ordinals,
+                         from_ordinals, to_ordinals)
 
 classes = [_Kyureki]
 ids = ['python']
@@ -12,11 +14,47 @@ if _Kyureki is not Kyureki:
     ids.append('c_extension')
 
 
+from_ordinals_funcs = [_from_ordinals]
+if _from_ordinals is not from_ordinals:
+    from_ordinals_funcs.append(from_ordinals)
+
+to_ordinals_funcs = [_to_ordinals]
+if _to_ordinals is not to_ordinals:
+    to_ordinals_funcs.append(to_ordinals)
+
+
 @pytest.fixture(scope='module', params=classes, ids=ids)
 def kyureki_cls(request):
     yield request.param
 
 
+@pytest.fixture(scope='module', params=from_ordinals_funcs, ids=ids)
+def from_ordinals_func(request):
+    yield request.param
+
+
+@pytest.fixture(scope='module', params=to_ordinals_funcs, ids=ids)
+def to_ordinals_func(request):
+    yield request.param
+
+
+class _PurePython:
+    """qreki._qreki と同じ名前で純 Python 実装を引く"""
+
+    def __getattr__(self, name):
+        return getattr(qreki.qreki, '_' + name)
+
+
+@pytest.fixture(scope='module', params=['python', 'c_extension'])
+def impl(request):
+    if request.param == 'python':
+        yield _PurePython()
+    elif _Kyureki is Kyureki:
+        pytest.skip("c extension is not installed")
+    else:
+        yield qreki._qreki
+
+
 def date_range(start, end, delta=datetime.timedelta(days=1)):
     d = start
     while d < end:
@@ -48,6 +86,234 @@ def test_diff_cextension_purepython(dates_iter):
         assert hash(p) == hash(c)
 
 
+def test_diff_cextension_purepython_all_years():
+    if _Kyureki is Kyureki:
+        pytest.skip("c extension is not installed")
+
+    start = datetime.date.min.toordinal()
+    end = datetime.date.max.toordinal()
+    for ordinal in range(start, end + 1, 997):
+        date = datetime.date.fromordinal(ordinal)
+        p = Kyureki.from_date(date)
+        c = _Kyureki.from_date(date)
+        assert (p.year, p.month, p.leap_month, p.day) == \
+               (c.year, c.month, c.leap_month, c.day)
+
+
+def test_window_cache():
+    if _Kyureki is Kyureki:
+        pytest.skip("c extension is not installed")
+    import qreki._qreki
+
+    tz = 0.0
+    # JST 以外の朔日テーブルを作らせず、 window_cache を使わせる
+    tzs, tables_size = qreki._qreki.tz_tables_info()
+    qreki._qreki.set_tz_tables_size(0)
+    qreki._qreki.window_cache_clear()
+    dates = list(date_range(datetime.date(1900, 1, 1), datetime.date(1900, 3, 1)))
+    for date in dates:
+        o = Kyureki.from_date(date, tz)
+        p = _Kyureki.from_date(date, tz)
+        assert (o.year, o.month, o.leap_month, o.day) == \
+               (p.year, p.month, p.leap_month, p.day)
+
+    hits, misses, maxsize, currsize = qreki._qreki.window_cache_info()
+    assert hits + misses == len(dates)
+    assert misses <= 2
+    assert 1 <= currsize <= maxsize
+
+    qreki._qreki.set_window_cache_size(1)
+    assert qreki._qreki.window_cache_info()[2:] == (1, 1)
+    qreki._qreki.set_window_cache_size(0)
+    Kyureki.from_date(dates[0], tz)
+    assert qreki._qreki.window_cache_info()[3] == 0
+    qreki._qreki.set_window_cache_size(maxsize)
+    qreki._qreki.window_cache_clear()
+    assert qreki._qreki.window_cache_info() == (0, 0, maxsize, 0)
+    qreki._qreki.set_tz_tables_size(tables_size)
+
+
+def test_tz_tables():
+    if _Kyureki is Kyureki:
+        pytest.skip("c extension is not installed")
+    import qreki._qreki
+
+    qreki._qreki.tz_tables_clear()
+    start = datetime.date(1900, 1, 1).toordinal()
+    ordinals = array.array('i', range(start, start + 400))
+    jst = from_ordinals(ordinals)
+    for tz in (0.0, -5 / 24):
+        got = from_ordinals(ordinals, tz, threads=2)
+        expected = _from_ordinals(ordinals, tz)
+        assert [list(c) for c in got] == [list(c) for c in expected]
+        first = datetime.date.fromordinal(start)
+        stop = datetime.date.fromordinal(start + 60)
+        assert list(map(str, Kyureki.range(first, stop, tz))) == \
+               list(map(str, _Kyureki.range(first, stop, tz)))
+    # JST のテーブルは別に持つので、他のタイムゾーンの変換で結果は変わらない
+    assert from_ordinals(ordinals) == jst
+
+    tzs, maxsize = qreki._qreki.tz_tables_info()
+    assert tzs == (0.0, -5 / 24)
+    qreki._qreki.set_tz_tables_size(1)
+    assert qreki._qreki.tz_tables_info() == ((0.0,), 1)
+    assert str(Kyureki.from_ordinal(start, 0.25)) == \
+           str(_Kyureki.from_ordinal(start, 0.25))
+    assert qreki._qreki.tz_tables_info() == ((0.0,), 1)
+    with pytest.raises(ValueError):
+        qreki._qreki.set_tz_tables_size(-1)
+    qreki._qreki.set_tz_tables_size(maxsize)
+    qreki._qreki.tz_tables_clear()
+    assert qreki._qreki.tz_tables_info() == ((), maxsize)
+
+
+def test_stats():
+    if _Kyureki is Kyureki:
+        pytest.skip("c extension is not installed")
+    import qreki._qreki
+
+    qreki._qreki.reset_stats()
+    if qreki._qreki.stats() is None:
+        pytest.skip("c extension is built without QREKI_STATS")
+    assert not any(qreki._qreki.stats().values())
+
+    qreki._qreki.window_cache_clear()
+    Kyureki.from_date(datetime.date(1900, 1, 1), 0.0)
+    stats = qreki._qreki.stats()
+    assert stats['window_builds'] == stats['window_cache_misses'] == 1
+    assert stats['saku_calls'] >= 5
+    assert stats['saku_iterations'] >= stats['saku_calls']
+    assert stats['sun_evals'] >= stats['chuki_iterations'] > 0
+    assert stats['object_calls'] == 1
+
+    qreki._qreki.reset_stats()
+    assert not any(qreki._qreki.stats().values())
+
+
+def test_series_kernel():
+    if _Kyureki is Kyureki:
+        pytest.skip("c extension is not installed")
+    import qreki._qreki
+
+    default = qreki._qreki.series_kernel()
+    dates = [datetime.date(y, m, 1)
+             for y in range(1, 10000, 499) for m in range(1, 13, 3)]
+    try:
+        for name in ('scalar', 'sse2', 'avx2', 'avx512'):
+            try:
+                qreki._qreki.set_series_kernel(name)
+            except ValueError:
+                continue
+            assert qreki._qreki.series_kernel() == name
+            qreki._qreki.window_cache_clear()
+            for date in dates:
+                o = Kyureki.from_date(date, 0.0)
+                p = _Kyureki.from_date(date, 0.0)
+                assert (o.year, o.month, o.leap_month, o.day) == \
+                       (p.year, p.month, p.leap_month, p.day)
+    finally:
+        qreki._qreki.set_series_kernel(default)
+
+    with pytest.raises(ValueError):
+        qreki._qreki.set_series_kernel('unknown')
+
+
+def test_solver():
+    if _Kyureki is Kyureki:
+        pytest.skip("c extension is not installed")
+    import qreki._qreki
+
+    assert qreki._qreki.solver() == 'fixed'
+    dates = [datetime.date(y, m, 1)
+             for y in range(1, 10000, 199) for m in range(1, 13, 2)]
+    expected = [Kyureki.from_date(d) for d in dates]
+    try:
+        qreki._qreki.set_solver('newton')
+        assert qreki._qreki.solver() == 'newton'
+        assert [Kyureki.from_date(d) for d in dates] == expected
+        for date in dates[::7]:
+            o = Kyureki.from_date(date, 0.0)
+            p = _Kyureki.from_date(date, 0.0)
+            assert (o.year, o.month, o.leap_month, o.day) == \
+                   (p.year, p.month, p.leap_month, p.day)
+    finally:
+        qreki._qreki.set_solver('fixed')
+
+    with pytest.raises(ValueError):
+        qreki._qreki.set_solver('unknown')
+
+
+def test_solver_precision():
+    if _Kyureki is Kyureki:
+        pytest.skip("c extension is not installed")
+    import qreki._qreki
+
+    assert qreki._qreki.solver_precision() == 'exact'
+    ordinals = array.array('i', range(1, datetime.date.max.toordinal() + 1))
+    expected = qreki._qreki.from_ordinals(ordinals)
+    expected_utc = qreki._qreki.from_ordinals(ordinals[::97], 0.0)
+    age = qreki._qreki.moon_age(datetime.date(2017, 10, 17))
+    try:
+        qreki._qreki.set_solver_precision('adaptive')
+        assert qreki._qreki.solver_precision() == 'adaptive'
+        # 1 年から 9999 年まで日ごとに exact と同じ
+        assert qreki._qreki.from_ordinals(ordinals) == expected
+        assert qreki._qreki.from_ordinals(ordinals[::97], 0.0) == expected_utc
+        # 月齢は朔の時刻をそのまま使うので exact のまま
+        assert qreki._qreki.moon_age(datetime.date(2017, 10, 17)) == age
+    finally:
+        qreki._qreki.set_solver_precision('exact')
+
+    with pytest.raises(ValueError):
+        qreki._qreki.set_solver_precision('unknown')
+
+
+def test_table_file(tmp_path):
+    if _Kyureki is Kyureki:
+        pytest.skip("c extension is not installed")
+
+    path = tmp_path / 'jst.tbl'
+    qreki._qreki.dump_table(str(path))
+    start = datetime.date(1900, 1, 1).toordinal()
+    ordinals = array.array('i', range(start, start + 3000))
+    expected = from_ordinals(ordinals)
+    qreki._qreki.load_table(path)
+    assert from_ordinals(ordinals) == expected
+    assert Kyureki.from_date(datetime.date(2017, 10, 15)) == Kyureki(2017, 8, 0, 26)
+
+    qreki._qreki.dump_table(tmp_path / 'tz0.tbl', 0.0)
+    expected = from_ordinals(ordinals, 0.0)
+    qreki._qreki.load_table(tmp_path / 'tz0.tbl')
+    assert from_ordinals(ordinals, 0.0) == expected
+    assert from_ordinals(ordinals)[:4] != expected[:4]
+    qreki._qreki.tz_tables_clear()
+    (tmp_path / 'bad.tbl').write_bytes(path.read_bytes()[:-8])
+    with pytest.raises(ValueError):
+        qreki._qreki.load_table(tmp_path / 'bad.tbl')
+    with pytest.raises(OSError):
+        qreki._qreki.load_table(tmp_path / 'missing.tbl')
+
+
+def test_table_env(tmp_path):
+    if _Kyureki is Kyureki:
+        pytest.skip("c extension is not installed")
+    import os
+    import subprocess
+    import sys
+
+    # 読めない QREKI_TABLE は警告だけで、 import は成功する
+    (tmp_path / 'bad.tbl').write_bytes(b'QREKITBL')
+    for path in (tmp_path / 'missing.tbl', tmp_path / 'bad.tbl'):
+        env = dict(os.environ, QREKI_TABLE=str(path), PYTHONIOENCODING='utf-8')
+        result = subprocess.run(
+            [sys.executable, '-c',
+             'import qreki; print(qreki.Kyureki.from_ymd(2017, 10, 17))'],
+            env=env, capture_output=True, text=True, encoding='utf-8')
+        assert result.returncode == 0, result.stderr
+        assert result.stdout.strip() == '2017年8月28日'
+        assert 'QREKI_TABLE is ignored' in result.stderr
+
+
 def test_from_ymd(kyureki_cls):
     o = kyureki_cls.from_ymd(2017, 10, 15)
     assert o.year == 2017
@@ -64,12 +330,67 @@ def test_from_date(kyureki_cls):
     assert o.day == 26
 
 
-def test_rokuyou(kyureki_cls):
+def test_from_ordinal(kyureki_cls):
+    date = datetime.date(2017, 10, 15)
+    o = kyureki_cls.from_ordinal(date.toordinal())
+    assert o == kyureki_cls(2017, 8, 0, 26)
+    assert kyureki_cls.from_ordinal(ordinal=date.toordinal(), tz=0.0) == o
+    assert kyureki_cls.from_date(datetime.datetime(2017, 10, 15, 23, 0)) == o
+    assert kyureki_cls.from_ymd(year=2017, month=10, day=15, tz=0.375) == o
+    assert kyureki_cls(year=2017, month=8, leap_month=0, day=26) == o
+    with pytest.raises(ValueError):
+        kyureki_cls.from_ordinal(0)
+    with pytest.raises(ValueError):
+        kyureki_cls.from_ymd(2017, 2, 29)
+    with pytest.raises(TypeError):
+        kyureki_cls.from_ymd(2017, 10)
+
+
+@pytest.mark.parametrize('tz', [0.375, 0.0])
+def test_range(kyureki_cls, tz):
+    start = datetime.date(2017, 1, 1)
+    stop = datetime.date(2018, 1, 1)
+    expected = [_Kyureki.from_date(d, tz) for d in date_range(start, stop)]
+    actual = list(kyureki_cls.range(start, stop, tz))
+    assert [(o.year, o.month, o.leap_month, o.day) for o in actual] == \
+           [(o.year, o.month, o.leap_month, o.day) for o in expected]
+
+    assert list(kyureki_cls.range(stop, start)) == []
+
+
+@pytest.mark.parametrize('tz', [0.375, 0.0])
+def test_to_date(kyureki_cls, dates_iter, tz):
+    for date in list(dates_iter)[::7]:
+        k = kyureki_cls.from_date(date, tz)
+        assert k.to_date(tz) == date
+        assert k.to_ordinal(tz) == date.toordinal()
+
+    assert kyureki_cls(2017, 5, 1, 1).to_date() == datetime.date(2017, 6, 24)
+    # 閏 4 月はない
+    with pytest.raises(ValueError):
+        kyureki_cls(2017, 4, 1, 1).to_date()
+    # 2017 年 2 月は小の月
+    with pytest.raises(ValueError):
+        kyureki_cls(2017, 2, 0, 30).to_date()
+    with pytest.raises(ValueError):
+        kyureki_cls(2017, 13, 0, 1).to_date()
+    with pytest.raises(ValueError):
+        kyureki_cls(10000, 1, 0, 1).to_date()
+
+
+def test_rokuyou(kyureki_cls, monkeypatch):
     assert kyureki_cls.ROKUYOU == ('大安', '赤口', '先勝', '友引', '先負', '仏滅')
 
     o = kyureki_cls.from_date(datetime.date(2017, 10, 15))
     assert o.rokuyou == '先負'
 
+    # 差し替えた ROKUYOU を使う
+    class Sub(kyureki_cls):
+        ROKUYOU = tuple('ABCDEF')
+    assert Sub(2017, 8, 0, 26).rokuyou == 'E'
+    monkeypatch.setattr(kyureki_cls, 'ROKUYOU', tuple('abcdef'))
+    assert o.rokuyou == 'e'
+
 
 def test_repr(kyureki_cls):
     o = kyureki_cls.from_date(datetime.date(2017, 10, 15))
@@ -124,8 +445,496 @@ def test_hash(kyureki_cls):
     assert len(d) == 2
     assert d[ob] == 2
     assert d[o] == 3
+    assert hash(o) == hash(o.key)
+
+
+def test_key(kyureki_cls):
+    o = kyureki_cls(2017, 5, 1, 26)
+    assert o.key == 2017 << 16 | 5 << 8 | 1 << 7 | 26
+    assert kyureki_cls.from_key(o.key) == o
+    assert kyureki_cls(2017, 5, 0, 30).key < o.key < kyureki_cls(2017, 6, 0, 1).key
+    assert sorted([o, kyureki_cls(2017, 5, 0, 1)], key=lambda k: k.key)[1] is o
+
+    with pytest.raises(ValueError):
+        kyureki_cls.from_key(-1)
+    with pytest.raises(ValueError):
+        kyureki_cls.from_key(1 << 32)
+    with pytest.raises(ValueError):
+        kyureki_cls(2017, 5, 2, 1)
+    with pytest.raises(ValueError):
+        kyureki_cls(2017, 5, 0, 128)
+    with pytest.raises(ValueError):
+        kyureki_cls(-1, 5, 0, 1)
+    with pytest.raises(ValueError):
+        kyureki_cls(2017, 256, 0, 1)
+    o = kyureki_cls(0xFFFF, 0xFF, 1, 0x7F)
+    assert o.key == 0xFFFFFFFF
+    assert kyureki_cls.from_key(o.key) == o
+
+
+def test_subclass(kyureki_cls):
+    class Sub(kyureki_cls):
+        def __init__(self, *args):
+            self.note = 'sub'
+
+    o = Sub(2017, 5, 1, 26)
+    assert type(o) is Sub and o.note == 'sub'
+    assert o == kyureki_cls(2017, 5, 1, 26)
+    assert repr(o) == 'Sub(2017, 5, 1, 26)'
+    assert type(Sub.from_date(datetime.date(2017, 7, 19))) is Sub
+
+
+def test_free_list():
+    if _Kyureki is Kyureki:
+        pytest.skip("c extension is not installed")
+    import qreki._qreki
+
+    count, maxsize = qreki._qreki.free_list_info()
+    try:
+        qreki._qreki.set_free_list_size(4)
+        objs = [Kyureki(2017, 5, 0, i) for i in range(10)]
+        del objs
+        assert qreki._qreki.free_list_info() == (4, 4)
+        o = Kyureki(2017, 5, 1, 26)
+        assert (o.year, o.month, o.leap_month, o.day) == (2017, 5, 1, 26)
+        assert qreki._qreki.free_list_info() == (3, 4)
+        qreki._qreki.free_list_clear()
+        assert qreki._qreki.free_list_info() == (0, 4)
+        with pytest.raises(ValueError):
+            qreki._qreki.set_free_list_size(-1)
+    finally:
+        qreki._qreki.set_free_list_size(maxsize)
+
+
+def test_thread_pool():
+    if _Kyureki is Kyureki:
+        pytest.skip("c extension is not installed")
+    import qreki._qreki
+
+    started, maxsize = qreki._qreki.thread_pool_info()
+    ordinals = array.array('i', range(700000, 700000 + 4096 * 4))
+    expected = qreki._qreki.from_ordinals(ordinals)
+    try:
+        qreki._qreki.thread_pool_clear()
+        qreki._qreki.set_thread_pool_size(2)
+        for _ in range(3):
+            # 2 つは起動済みのスレッドで、残りはその場で作ったスレッドで変換する
+            assert qreki._qreki.from_ordinals(ordinals, threads=4) == expected
+            assert qreki._qreki.thread_pool_info() == (2, 2)
+        qreki._qreki.set_thread_pool_size(1)
+        assert qreki._qreki.thread_pool_info() == (1, 1)
+        qreki._qreki.thread_pool_clear()
+        assert qreki._qreki.thread_pool_info() == (0, 1)
+        with pytest.raises(ValueError):
+            qreki._qreki.set_thread_pool_size(-1)
+    finally:
+        qreki._qreki.set_thread_pool_size(maxsize)
+
+
+def test_from_ordinals(from_ordinals_func, dates_iter):
+    dates = list(dates_iter)
+    ordinals = array.array('l', [d.toordinal() for d in dates])
+    year, month, leap_month, day, rokuyou = from_ordinals_func(ordinals)
+
+    assert len(year) == len(dates)
+    for i, date in enumerate(dates):
+        o = _Kyureki.from_date(date)
+        assert year[i] == o.year
+        assert month[i] == o.month
+        assert leap_month[i] == o.leap_month
+        assert day[i] == o.day
+        assert _Kyureki.ROKUYOU[rokuyou[i]] == o.rokuyou
+
+
+def test_from_ordinals_output(from_ordinals_func):
+    ordinals = array.array('i', [datetime.date(2017, 10, 15).toordinal()])
+    year = array.array('i', [0, 0])
+    day = bytearray(1)
+    ret = from_ordinals_func(ordinals.tobytes(), year=year, day=day)
+    assert ret[0] is year
+    assert ret[3] is day
+    assert list(year) == [2017, 0]
+    assert list(ret[1]) == [8]
+    assert list(day) == [26]
+
+    with pytest.raises(ValueError):
+        from_ordinals_func(ordinals, month=bytearray(0))
+    with pytest.raises(ValueError):
+        from_ordinals_func(array.array('i', [0]))
+    with pytest.raises(ValueError):
+        from_ordinals_func(ordinals, threads=0)
+
+
+def test_to_ordinals(to_ordinals_func, dates_iter):
+    ordinals = array.array('i', [d.toordinal() for d in dates_iter][::7])
+    year, month, leap_month, day, _ = from_ordinals(ordinals)
+    assert to_ordinals_func(year, month, leap_month, day) == ordinals
+
+    out = array.array('q', [0, 0])
+    ret = to_ordinals_func(array.array('H', [2017]), b'\x05', b'\x01', b'\x01',
+                           out=out)
+    assert ret is out
+    assert list(out) == [datetime.date(2017, 6, 24).toordinal(), 0]
+
+    with pytest.raises(ValueError):
+        to_ordinals_func(year, month, leap_month, day[:-1])
+    with pytest.raises(ValueError):
+        to_ordinals_func(array.array('H', [2017]), b'\x04', b'\x01', b'\x01')
+
+
+def test_from_ordinals_threads():
+    if _Kyureki is Kyureki:
+        pytest.skip("c extension is not installed")
+
+    start = datetime.date(1900, 1, 1).toordinal()
+    ordinals = array.array('i', range(start, start + 20000))
+    for tz in (0.375, 0.0):
+        expected = qreki.from_ordinals(ordinals[::3], tz)
+        assert qreki.from_ordinals(ordinals[::3], tz, threads=3) == expected
+    expected = qreki.from_ordinals(ordinals)
+    assert qreki.from_ordinals(ordinals, threads=4) == expected
+    with pytest.raises(ValueError):
+        qreki.from_ordinals(ordinals + array.array('i', [0]), threads=4)
+
+
+def test_from_ordinals_input_rewritten():
+    if _Kyureki is Kyureki:
+        pytest.skip("c extension is not installed")
+    import threading
+
+    import qreki._qreki
+
+    # 変換中に別スレッドが入力を書き換え、用意していない区間の日付になっても
+    # 朔日行列で求めて、書き換え前か後のどちらかと同じ結果になる
+    qreki._qreki.tz_tables_clear()
+    start = datetime.date(2017, 1, 1).toordinal()
+    other = datetime.date(500, 1, 1).toordinal() - start
+    ordinals = array.array('i', range(start, start + 200000))
+    rewritten = array.array('i', (o + other for o in ordinals))
+    stop = threading.Event()
+
+    def rewrite():
+        while not stop.is_set():
+            ordinals[:] = rewritten
+
+    thread = threading.Thread(target=rewrite)
+    thread.start()
+    try:
+        got = qreki.from_ordinals(ordinals, 0.0, threads=4)
+    finally:
+        stop.set()
+        thread.join()
+
+    old = qreki.from_ordinals(array.array('i', range(start, start + 200000)), 0.0)
+    new = qreki.from_ordinals(rewritten, 0.0)
+    for i in range(0, 200000, 101):
+        row = tuple(c[i] for c in got)
+        assert row in (tuple(c[i] for c in old), tuple(c[i] for c in new))
 
 
 def test_module_func():
     assert qreki.rokuyou_from_ymd(2017, 10, 15) == '先負'
     assert qreki.rokuyou_from_date(datetime.date(2017, 10, 15)) == '先負'
+    assert qreki.rokuyou_from_ordinal(datetime.date(2017, 10, 15).toordinal()) == '先負'
+
+
+def test_rokuyou_funcs(impl, dates_iter):
+    funcs = (impl.rokuyou_from_date, impl.rokuyou_from_ordinal,
+             impl.rokuyou_from_ordinals)
+    rokuyou_from_date, rokuyou_from_ordinal, rokuyou_from_ordinals = funcs
+
+    dates = list(dates_iter)[::5]
+    ordinals = array.array('i', [d.toordinal() for d in dates])
+    indexes = rokuyou_from_ordinals(ordinals)
+    for tz in (0.375, 0.0):
+        assert list(rokuyou_from_ordinals(ordinals, tz)) == [
+                _Kyureki.ROKUYOU.index(_Kyureki.from_date(d, tz).rokuyou)
+                for d in dates]
+    for i, date in enumerate(dates):
+        expected = _Kyureki.from_date(date).rokuyou
+        assert rokuyou_from_date(date) == expected
+        assert rokuyou_from_ordinal(ordinals[i]) == expected
+        assert _Kyureki.ROKUYOU[indexes[i]] == expected
+
+    out = bytearray(len(dates) + 1)
+    assert rokuyou_from_ordinals(ordinals, out=out) is out
+    assert list(out[:-1]) == list(indexes)
+    with pytest.raises(ValueError):
+        rokuyou_from_ordinal(0)
+
+
+def test_sekki_funcs(impl):
+    funcs = (impl.sekki, impl.sekki_of_year, impl.sekki_from_ordinals)
+    sekki, sekki_of_year, sekki_from_ordinals = funcs
+
+    terms = sekki_of_year(2017)
+    assert [qreki.SEKKI[i] for i, _ in terms[:3]] == ['小寒', '大寒', '立春']
+    assert [i for i, _ in terms] == [(19 + i) % 24 for i in range(24)]
+    assert terms[3][1].date() == datetime.date(2017, 2, 18)
+    # 中気は朔日行列の計算に使うものと同じ
+    tm, _ = qreki.qreki._chuki_from_jd(terms[5][1].toordinal() + 1721425, 0.375)
+    assert abs(qreki.qreki._sekki_instant(tm) - terms[5][1]) <= \
+        datetime.timedelta(seconds=1)
+    assert sekki(datetime.date(2017, 3, 1), datetime.date(2017, 4, 1)) == terms[4:6]
+    assert sekki(datetime.date(2017, 4, 1), datetime.date(2017, 3, 1)) == []
+    assert len(sekki_of_year(1)) == len(sekki_of_year(9999)) == 24
+
+    first = datetime.date(2016, 12, 1).toordinal()
+    ordinals = array.array('i', range(first, first + 400))
+    indexes = sekki_from_ordinals(ordinals)
+    periods = sekki(datetime.date(2016, 11, 1), datetime.date(2018, 2, 1))
+    for ordinal, index in zip(ordinals, indexes):
+        expected = [i for i, t in periods if t.toordinal() <= ordinal][-1]
+        assert index == expected
+    out = bytearray(len(ordinals))
+    assert sekki_from_ordinals(ordinals, 0.0, out=out) is out
+    with pytest.raises(ValueError):
+        sekki_from_ordinals(array.array('i', [0]))
+
+
+def test_moon_age_funcs(impl):
+    funcs = (impl.moon_age, impl.moon_age_from_ordinals)
+    moon_age, moon_age_from_ordinals = funcs
+
+    # 2017-10-20 04:12 (JST) の朔
+    assert 29.0 < moon_age(datetime.datetime(2017, 10, 20, 3, 0)) < 30.0
+    assert 0.0 <= moon_age(datetime.datetime(2017, 10, 20, 5, 0)) < 0.1
+    assert moon_age(datetime.date(2017, 10, 20)) == pytest.approx(
+        moon_age(datetime.datetime(2017, 10, 20, 12, 0)))
+
+    first = datetime.date(2017, 1, 1).toordinal()
+    ordinals = array.array('i', range(first, first + 365))
+    ages = moon_age_from_ordinals(ordinals)
+    assert ages.typecode == 'd'
+    new_moons = 0
+    for i, age in enumerate(ages):
+        assert 0.0 <= age < 30.0
+        if i and age < ages[i - 1]:
+            new_moons += 1
+        else:
+            assert i == 0 or age == pytest.approx(ages[i - 1] + 1.0)
+        # 朔を含む日を 1 日とするので、朔が正午より後の朔日を除き
+        # 正午の月齢は day - 1.5 から day - 0.5 の間
+        day = _Kyureki.from_ordinal(ordinals[i]).day
+        if day > 1 or age < 1.0:
+            assert day - 1.5 < age <= day - 0.5 + 1e-9
+    assert new_moons == 12
+    # 朔の時刻の誤差は初期値によって 1 秒ほど変わる
+    assert moon_age_from_ordinals(ordinals[::-1])[0] == \
+        pytest.approx(ages[-1], abs=2.0 / 86400.0)
+
+    out = array.array('d', [0.0]) * len(ordinals)
+    assert moon_age_from_ordinals(ordinals, hour=0.0, out=out) is out
+    assert out[10] == pytest.approx(ages[10] - 0.5)
+    with pytest.raises(ValueError):
+        moon_age_from_ordinals(ordinals, hour=24.0)
+    with pytest.raises(ValueError):
+        moon_age_from_ordinals(array.array('i', [0]))
+
+
+def test_year_calendar(impl):
+    year_calendar = impl.year_calendar
+
+    # 2017 年には閏 5 月がある
+    months = year_calendar(2017)
+    assert [(m.month, m.leap_month) for m in months] == \
+        [(1, 0), (2, 0), (3, 0), (4, 0), (5, 0), (5, 1), (6, 0), (7, 0),
+         (8, 0), (9, 0), (10, 0), (11, 0), (12, 0)]
+    assert months[0].start == datetime.date(2017, 1, 28)
+    assert tuple(months[5]) == (5, 1, datetime.date(2017, 6, 24), 29)
+    ordinal = months[0].start.toordinal()
+    for m in months:
+        assert m.start.toordinal() == ordinal
+        assert m.days in (29, 30)
+        for i in range(m.days):
+            k = _Kyureki.from_ordinal(ordinal + i)
+            assert (k.year, k.month, k.leap_month, k.day) == \
+                   (2017, m.month, m.leap_month, i + 1)
+        ordinal += m.days
+    assert year_calendar(2018)[0].start.toordinal() == ordinal
+    assert len(year_calendar(2018)) == 12
+    assert year_calendar(2017, 0.0)[0].days == 29
+
+    with pytest.raises(ValueError):
+        year_calendar(0)
+    with pytest.raises(ValueError):
+        year_calendar(9999)
+
+
+def test_kyureki_array(impl):
+    import pickle
+
+    cls = impl.KyurekiArray
+
+    first = datetime.date(2017, 1, 1).toordinal()
+    ordinals = array.array('i', range(first, first + 365))
+    columns = from_ordinals(ordinals)
+    a = cls.from_ordinals(ordinals)
+    assert len(a) == 365
+    assert a.year.format == 'H' and a.day.format == 'B'
+    assert a.year.readonly and a.month.tolist() == columns[1].tolist()
+    k = a[289]
+    assert (k.year, k.month, k.leap_month, k.day) == (2017, 8, 0, 28)
+    assert str(a[-1]) == str(Kyureki.from_ordinal(ordinals[-1]))
+    with pytest.raises(IndexError):
+        a[365]
+    assert a.rokuyou().tolist() == columns[4].tolist()
+    out = bytearray(365)
+    assert a.rokuyou(out=out) is out
+
+    b = a[10:20]
+    assert len(b) == 10 and str(b[0]) == str(a[10])
+    c = a[::-7]
+    assert str(c[1]) == str(a[-8])
+    assert [str(x) for x in c[:3]] == [str(a[-1]), str(a[-8]), str(a[-15])]
+
+    # protocol 5 では列を out-of-band で渡せる
+    buffers = []
+    data = pickle.dumps(a, protocol=5, buffer_callback=buffers.append)
+    assert len(buffers) == 4
+    assert sum(len(bytes(x.raw())) for x in buffers) == 365 * 5
+    d = pickle.loads(data, buffers=buffers)
+    assert d.year.tolist() == a.year.tolist()
+    assert d.rokuyou().tolist() == columns[4].tolist()
+    for protocol in (2, 5):
+        e = pickle.loads(pickle.dumps(c, protocol=protocol))
+        assert [str(x) for x in e] == [str(x) for x in c]
+
+    with pytest.raises(ValueError):
+        cls(columns[0], columns[1], columns[2], columns[3][:10])
+    with pytest.raises(TypeError):
+        cls(ordinals, columns[1], columns[2], columns[3])
+
+
+def test_arithmetic(kyureki_cls):
+    k = kyureki_cls(2017, 8, 0, 28)
+    assert k + 4 == kyureki_cls(2017, 9, 0, 2)
+    assert 4 + k == k.add_days(4)
+    assert k - 28 == kyureki_cls(2017, 7, 0, 29)
+    assert (k + 400) - k == 400
+    assert kyureki_cls(2017, 6, 0, 1) - kyureki_cls(2017, 5, 1, 1) == 29
+    with pytest.raises(TypeError):
+        k + 1.5
+    with pytest.raises(TypeError):
+        1 - k
+    with pytest.raises(TypeError):
+        k + True
+    with pytest.raises(TypeError):
+        k - False
+
+    # 閏 5 月 (小の月) を 1 か月と数える
+    assert kyureki_cls(2017, 4, 0, 30).add_months(1) == kyureki_cls(2017, 5, 0, 29)
+    assert kyureki_cls(2017, 5, 0, 15).add_months(1) == kyureki_cls(2017, 5, 1, 15)
+    assert kyureki_cls(2017, 5, 0, 15).add_months(2) == kyureki_cls(2017, 6, 0, 15)
+    assert kyureki_cls(2017, 6, 0, 30).add_months(-1) == kyureki_cls(2017, 5, 1, 29)
+    assert k.add_months(12) == kyureki_cls(2018, 8, 0, 28)
+    assert k.add_months(-13) == kyureki_cls(2016, 8, 0, 28)
+    assert k.add_months(0) == k
+    for n in (-30, -1, 1, 30):
+        assert k.add_days(n, 0.0) == \
+            kyureki_cls.from_ordinal(k.to_ordinal(0.0) + n, 0.0)
+
+    with pytest.raises(ValueError):
+        kyureki_cls(1, 1, 0, 1) - 400
+    with pytest.raises(ValueError):
+        kyureki_cls(9999, 11, 0, 1).add_months(2)
+
+
+def test_find_dates(impl):
+    find_dates, find_ordinals = impl.find_dates, impl.find_ordinals
+
+    start, stop = datetime.date(2017, 1, 1), datetime.date(2018, 1, 1)
+    kyureki = {d: _Kyureki.from_date(d) for d in date_range(start, stop)}
+
+    def expected(pred):
+        return [d for d, k in kyureki.items() if pred(d, k)]
+
+    assert find_dates(start, stop, rokuyou='大安', weekday=(5, 6)) == expected(
+        lambda d, k: k.rokuyou == '大安' and d.weekday() >= 5)
+    assert find_dates(start, stop, day=15) == expected(lambda d, k: k.day == 15)
+    assert find_dates(start, stop, month=5, leap_month=1) == expected(
+        lambda d, k: k.month == 5 and k.leap_month)
+    assert find_dates(start, stop, rokuyou=[0, 5], day=range(1, 4)) == expected(
+        lambda d, k: k.rokuyou in ('大安', '仏滅') and k.day <= 3)
+    assert len(find_dates(start, stop)) == 365
+    assert find_dates(stop, start) == []
+
+    ordinals = find_ordinals(start, stop, 0.0, day=1)
+    assert ordinals.typecode == 'i'
+    assert all(_Kyureki.from_ordinal(o, 0.0).day == 1 for o in ordinals)
+    assert len(ordinals) == 12
+
+    with pytest.raises(ValueError):
+        find_dates(start, stop, rokuyou='吉日')
+    with pytest.raises(ValueError):
+        find_dates(start, stop, day=31)
+
+
+def test_format_kyureki(impl, monkeypatch):
+    format_kyureki, cls = impl.format_kyureki, impl.Kyureki
+    array_cls = impl.KyurekiArray
+
+    ordinals = array.array('i', range(736491, 736551))
+    values = array_cls.from_ordinals(ordinals)
+    ks = [cls.from_ordinal(o) for o in ordinals]
+    expected = '\n'.join(str(k) for k in ks)
+    assert '2017年閏5月1日' in expected
+    assert format_kyureki(values) == expected
+    assert format_kyureki(ks) == expected
+    assert format_kyureki(values[::7], ', ', as_bytes=True) == \
+        ', '.join(map(str, ks[::7])).encode('utf-8')
+    assert format_kyureki([]) == ''
+    assert format_kyureki(iter(ks[:2]), sep='') == str(ks[0]) + str(ks[1])
+
+    class SubKyureki(cls):
+        def __str__(self):
+            return 'sub'
+
+    assert format_kyureki([ks[0], SubKyureki(2017, 5, 0, 1), 3], ' ') == \
+        '{} sub 3'.format(ks[0])
+
+    if cls is not _Kyureki:
+        # 書き換えたテンプレートは str と format_kyureki に反映される
+        monkeypatch.setattr(cls, '_str_template', '{}/{}/{}')
+        assert str(cls(2017, 8, 0, 28)) == '2017/8/28'
+        assert format_kyureki(values[:1]) == '2017/5/17'
+        monkeypatch.undo()
+        assert str(cls(2017, 8, 0, 28)) == '2017年8月28日'
+    with pytest.raises(TypeError):
+        format_kyureki(1)
+
+
+def test_main_stream(monkeypatch, capsys, tmp_path):
+    import io
+
+    import qreki.__main__
+
+    monkeypatch.setattr('sys.stdin', io.StringIO('2017-10-17\n\n2017-10-21T09:00\n'))
+    monkeypatch.setattr('sys.argv', ['qreki', '--stream'])
+    qreki.__main__.main()
+    assert capsys.readouterr().out == (
+        '2017-10-17,2017,8,0,28,大安\n'
+        '2017-10-21T09:00,2017,9,0,2,仏滅\n')
+
+    path = tmp_path / 'in.csv'
+    path.write_text('id,date\n1,2017-10-17\n2,x\n', encoding='utf-8')
+    monkeypatch.setattr('sys.argv', ['qreki', '--stream', str(path),
+                                     '--column', '1', '--header', '--skip-invalid'])
+    qreki.__main__.main()
+    out, err = capsys.readouterr()
+    assert out.splitlines() == [
+        'id,date,kyureki_year,kyureki_month,leap_month,kyureki_day,rokuyou',
+        '1,2017-10-17,2017,8,0,28,大安']
+    assert 'line 3' in err
+
+    # 改行を含むレコードと空行
+    path.write_text('id,date\n"a\nb",2017-10-17\n\n2,x\n', encoding='utf-8')
+    qreki.__main__.main()
+    out, err = capsys.readouterr()
+    assert out.splitlines()[1:] == ['"a', 'b",2017-10-17,2017,8,0,28,大安']
+    assert 'line 5' in err
+
+    monkeypatch.setattr('sys.argv', ['qreki', '--stream', str(path),
+                                     '--column', '1', '--header'])
+    with pytest.raises(SystemExit):
+        qreki.__main__.main()